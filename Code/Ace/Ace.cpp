@@ -32,6 +32,7 @@
 #include "PlugInRegistration.h"
 #include "PlugInResource.h"
 #include "ProgressTracker.h"
+#include "PseudocolorMerger.h"
 #include "RasterDataDescriptor.h"
 #include "RasterElement.h"
 #include "RasterUtilities.h"
@@ -43,11 +44,39 @@
 #include "switchOnEncoding.h"
 #include "Units.h"
 #include "Wavelengths.h"
+#include "WhitenedCube.h"
 
+#include <algorithm>
+#include <limits>
 #include <vector>
 
 using namespace std;
 
+namespace
+{
+   // Computes W = V^T * sqrt(L) * V from the eigen decomposition of the inverse covariance so that
+   // W * W is the inverse covariance and x^T * invCov * y = (W * x) . (W * y).  Tiny negative
+   // eigenvalues from round off are treated as zero.
+   bool computeWhitening(const cv::Mat& invCov, cv::Mat& whitening)
+   {
+      cv::Mat eigenvalues;
+      cv::Mat eigenvectors;
+      if (!cv::eigen(invCov, eigenvalues, eigenvectors))
+      {
+         return false;
+      }
+
+      cv::Mat scaledVectors = eigenvectors.clone();
+      for (int row = 0; row < scaledVectors.rows; ++row)
+      {
+         cv::Mat vectorRow = scaledVectors.row(row);
+         vectorRow *= sqrt(std::max(0.0, eigenvalues.at<double>(row)));
+      }
+      whitening = eigenvectors.t() * scaledVectors;
+      return true;
+   }
+}
+
 REGISTER_PLUGIN_BASIC(SpectralAce, Ace);
 
 Ace::Ace() : AlgorithmPlugIn(&mInputs), mpAceGui(NULL), mpAceAlg(NULL), mpProgress(NULL)
@@ -83,6 +112,10 @@ bool Ace::populateBatchInputArgList(PlugInArgList* pInArgList)
       "Flag representing whether to display the results of the ACE operation."));
    VERIFY(pInArgList->addArg<string>("Results Name", mInputs.mResultsName,
       "Name of the raster element resulting from the ACE operation."));
+   VERIFY(pInArgList->addArg<bool>("Use Whitened Cache", mInputs.mbUseWhitenedCache,
+      "Flag representing whether to keep a whitened copy of the raster element for later runs and use it "
+      "instead of recalculating the covariance. The covariance is calculated over the AOI and the copy is "
+      "rebuilt when the raster element or the AOI changes."));
    return true;
 }
 
@@ -135,6 +168,7 @@ bool Ace::parseInputArgList(PlugInArgList* pInArgList)
       mInputs.mpAoi = pInArgList->getPlugInArgValue<AoiElement>("AOI");
       VERIFY(pInArgList->getPlugInArgValue("Display Results", mInputs.mbDisplayResults));
       VERIFY(pInArgList->getPlugInArgValue("Results Name", mInputs.mResultsName));
+      VERIFY(pInArgList->getPlugInArgValue("Use Whitened Cache", mInputs.mbUseWhitenedCache));
 
       mInputs.mSignatures = SpectralUtilities::extractSignatures(vector<Signature*>(1, pSignatures));
    }
@@ -162,7 +196,7 @@ QDialog* Ace::getGui(void* pAlgData)
    // mpAceGui.
    mpAceGui = new AceDlg(mpAceAlg->getRasterElement(), this, mpProgress,
       mInputs.mResultsName, mInputs.mbCreatePseudocolor, false, Ace::hasSettingAceHelp(), mInputs.mThreshold,
-      Service<DesktopServices>()->getMainWidget());
+      Ace::getSettingUseWhitenedCache(), Service<DesktopServices>()->getMainWidget());
    mpAceGui->setWindowTitle("Adaptive Cosine Estimator");
 
    return mpAceGui;
@@ -187,6 +221,8 @@ bool Ace::extractFromGui()
    mInputs.mResultsName = mpAceGui->getResultsName();
    mInputs.mpAoi = mpAceGui->getAoi();
    mInputs.mbCreatePseudocolor = mpAceGui->isPseudocolorLayerUsed();
+   mInputs.mbUseWhitenedCache = mpAceGui->isWhitenedCacheUsed();
+   Ace::setSettingUseWhitenedCache(mInputs.mbUseWhitenedCache);
 
    if (mInputs.mResultsName.empty())
    {
@@ -273,302 +309,275 @@ bool AceAlgorithm::processAll()
          progress.report(ACEERR004, 0, ERRORS, true);
          return false;
       }
+   }
+   
+   // Resample every signature up front and group the signatures which cover the same bands so
+   // each pixel is whitened once per group and scored against all of its signatures
+   vector<AceSignatureGroup> groups;
+   vector<vector<double> > groupSpectra;
+   for (sig_index = 0; sig_index < iSignatureCount && !mAbortFlag; sig_index++)
+   {
+      Signature* pSignature = mInputs.mSignatures[sig_index];
+      sigNames.push_back(pSignature->getName());
 
-      FactoryResource<DataRequest> pseudoRequest;
-      pseudoRequest->setWritable(true);
-      string failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-      DataAccessor pseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-      if (!pseudoAccessor.isValid())
+      vector<double> spectrumValues;
+      vector<int> resampledBands;
+      if (!resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands))
       {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
+         bSuccess = false;
+         break;
       }
 
-      FactoryResource<DataRequest> havRequest;
-      havRequest->setWritable(true);
-      failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(havRequest.get(), pHighestAceValueMatrix.get());
-      DataAccessor highestAceValueAccessor = pHighestAceValueMatrix->getDataAccessor(havRequest.release());
-      if (!highestAceValueAccessor.isValid())
+      // Check for limited spectral coverage and warning log 
+      if (pWavelengths->hasCenterValues() && resampledBands.size() != pWavelengths->getCenterValues().size())
       {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
+         QString buf = QString("Warning AceAlg014: The spectrum %1 only provides spectral coverage for %2 of %3 bands.")
+            .arg(QString::fromStdString(sigNames.back())).arg(resampledBands.size())
+            .arg(pWavelengths->getCenterValues().size());
+         progress.report(buf.toStdString(), 0, WARNING, true);
       }
 
-      //Lets zero out all the results in case we connect to an existing matrix.
-      float* pPseudoValue = NULL;
-      float* pHighestValue = NULL;
-
-      for (unsigned int row_ctr = 0; row_ctr < numRows; row_ctr++)
+      vector<AceSignatureGroup>::size_type group_index = 0;
+      while (group_index < groups.size() && groups[group_index].mResampledBands != resampledBands)
       {
-         for (unsigned int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-         {
-            if (!pseudoAccessor.isValid() || !highestAceValueAccessor.isValid())
-            {
-               progress.report("Unable to access results.", 0, ERRORS, true);
-               return false;
-            }
-
-            pHighestValue = reinterpret_cast<float*>(highestAceValueAccessor->getColumn());
-            pPseudoValue = reinterpret_cast<float*>(pseudoAccessor->getColumn());
-
-            //Initialize the matrices
-            *pPseudoValue = 0.0f;
-            *pHighestValue = 0.0f;
-
-            pseudoAccessor->nextColumn();
-            highestAceValueAccessor->nextColumn();
-         }
-         pseudoAccessor->nextRow();
-         highestAceValueAccessor->nextRow();
+         ++group_index;
       }
+      if (group_index == groups.size())
+      {
+         groups.push_back(AceSignatureGroup());
+         groups.back().mResampledBands = resampledBands;
+         groupSpectra.push_back(vector<double>());
+      }
+      groups[group_index].mSignatureIndices.push_back(sig_index);
+      groupSpectra[group_index].insert(groupSpectra[group_index].end(), spectrumValues.begin(), spectrumValues.end());
    }
-   
-   bool success = true;
-   ExecutableResource covar("Covariance", std::string(), progress.getCurrentProgress(), !isInteractive());
-   success &= covar->getInArgList().setPlugInArgValue(Executable::DataElementArg(), pElement); 
-   bool bInverse = true;
-   success &= covar->getInArgList().setPlugInArgValue("ComputeInverse", &bInverse);
-   success &= covar->execute();
-   RasterElement* pCov = static_cast<RasterElement*>(
-      Service<ModelServices>()->getElement("Covariance Matrix", TypeConverter::toString<RasterElement>(), pElement));
-   RasterElement* pInvCov = static_cast<RasterElement*>(
-      Service<ModelServices>()->getElement("Inverse Covariance Matrix", TypeConverter::toString<RasterElement>(), pElement));
-   RasterElement* pMeans = static_cast<RasterElement*>(
-      Service<ModelServices>()->getElement("Means", TypeConverter::toString<RasterElement>(), pElement));
-
-   // with a small means vector (generally hundreds of doubles) there won't be a problem with getRawData()
-   success &= pCov != NULL && pInvCov != NULL && pMeans != NULL && pMeans->getRawData();
-   if (!success)
-   {
-      progress.report("Unable to calculate covariance.", 0, ERRORS, true);
-      return false;
-   }
-
-   const RasterDataDescriptor* pMeansDesc = static_cast<const RasterDataDescriptor*>(pMeans->getDataDescriptor());
-   if (pMeansDesc->getRowCount() != 1 || pMeansDesc->getColumnCount() != 1 || pMeansDesc->getBandCount() != numBands)
+   if (!bSuccess)
    {
-      progress.report(ACEERR011, 0, ABORT, true);
-      mAbortFlag = false;
+      progress.report(ACEERR002, 0, ERRORS, true);
       return false;
    }
-   //store the mean of the dataset we processing
-   cv::Mat muMat = cv::Mat(1, numBands, CV_64F, pMeans->getRawData());
-   if (static_cast<const RasterDataDescriptor*>(pCov->getDataDescriptor())->getDataType() != FLT8BYTES ||
-       static_cast<const RasterDataDescriptor*>(pInvCov->getDataDescriptor())->getDataType() != FLT8BYTES)
+
+   // A whitened cube cache replaces the covariance calculation and the whitening of every pixel,
+   // but it only applies when every signature covers all of the bands
+   bool bFullCoverage = (groups.size() == 1 && groups.front().mResampledBands.size() == numBands);
+   RasterElement* pWhitenedCube = NULL;
+   vector<double> cachedMeans;
+   vector<double> cachedWhitening;
+   if (mInputs.mbUseWhitenedCache)
    {
-      progress.report("Invalid covariance matrix.", 0, ERRORS, true);
-      return false;
+      pWhitenedCube = WhitenedCube::getCache(pElement, mInputs.mpAoi);
+      if (pWhitenedCube != NULL && !WhitenedCube::getWhitening(pWhitenedCube, cachedMeans, cachedWhitening))
+      {
+         pWhitenedCube = NULL;
+      }
    }
-   cv::Mat invCovMat = cv::Mat(numBands, numBands, CV_64F, pInvCov->getRawData());  
-
-   ModelResource<RasterElement> pResults(reinterpret_cast<RasterElement*>(NULL));
 
-   // Processes each selected signature one at a time and
-   // accumulates results
-   for (sig_index = 0; bSuccess && (sig_index < iSignatureCount) && !mAbortFlag; sig_index++)
+   cv::Mat muMat;
+   cv::Mat invCovMat;
+   if (pWhitenedCube == NULL || !bFullCoverage)
    {
-      // Get the spectrum
-      Signature* pSignature = mInputs.mSignatures[sig_index];
-
-      // Create the results matrix
-      sigNames.push_back(pSignature->getName());
-      std::string rname = mInputs.mResultsName;
-      if (iSignatureCount > 1 && !mInputs.mbCreatePseudocolor)
+      // the cache is keyed on the AOI so its statistics must come from that AOI rather than one picked in the
+      // Covariance dialog
+      bool success = true;
+      ExecutableResource covar("Covariance", std::string(), progress.getCurrentProgress(),
+         !isInteractive() || mInputs.mbUseWhitenedCache);
+      success &= covar->getInArgList().setPlugInArgValue(Executable::DataElementArg(), pElement); 
+      if (mInputs.mbUseWhitenedCache)
       {
-         rname += " " + sigNames.back();
+         success &= covar->getInArgList().setPlugInArgValue("AOI", mInputs.mpAoi);
       }
-      else if (iSignatureCount > 1)
+      bool bInverse = true;
+      success &= covar->getInArgList().setPlugInArgValue("ComputeInverse", &bInverse);
+      success &= covar->execute();
+      RasterElement* pCov = static_cast<RasterElement*>(
+         Service<ModelServices>()->getElement("Covariance Matrix", TypeConverter::toString<RasterElement>(), pElement));
+      RasterElement* pInvCov = static_cast<RasterElement*>(
+         Service<ModelServices>()->getElement("Inverse Covariance Matrix", TypeConverter::toString<RasterElement>(), pElement));
+      RasterElement* pMeans = static_cast<RasterElement*>(
+         Service<ModelServices>()->getElement("Means", TypeConverter::toString<RasterElement>(), pElement));
+
+      // with a small means vector (generally hundreds of doubles) there won't be a problem with getRawData()
+      success &= pCov != NULL && pInvCov != NULL && pMeans != NULL && pMeans->getRawData();
+      if (!success)
       {
-         rname += "AceTemp";
+         progress.report("Unable to calculate covariance.", 0, ERRORS, true);
+         return false;
       }
 
-      if (mInputs.mbCreatePseudocolor == false || pResults.get() == NULL)
+      const RasterDataDescriptor* pMeansDesc = static_cast<const RasterDataDescriptor*>(pMeans->getDataDescriptor());
+      if (pMeansDesc->getRowCount() != 1 || pMeansDesc->getColumnCount() != 1 || pMeansDesc->getBandCount() != numBands)
       {
-         pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, 1, rname));
+         progress.report(ACEERR011, 0, ABORT, true);
+         mAbortFlag = false;
+         return false;
       }
-      if (pResults.get() == NULL)
+      //store the mean of the dataset we processing
+      muMat = cv::Mat(1, numBands, CV_64F, pMeans->getRawData());
+      if (static_cast<const RasterDataDescriptor*>(pCov->getDataDescriptor())->getDataType() != FLT8BYTES ||
+          static_cast<const RasterDataDescriptor*>(pInvCov->getDataDescriptor())->getDataType() != FLT8BYTES)
       {
-         bSuccess = false;
-         break;
+         progress.report("Invalid covariance matrix.", 0, ERRORS, true);
+         return false;
       }
+      invCovMat = cv::Mat(numBands, numBands, CV_64F, pInvCov->getRawData());  
 
-      //Send the message to the progress object
-      QString messageSigNumber = QString("Processing Signature %1 of %2 : ACE running on signature %3")
-         .arg(sig_index+1).arg(iSignatureCount).arg(QString::fromStdString(sigNames.back()));
-      string message = messageSigNumber.toStdString();
-
-      vector<double> spectrumValues;
-      vector<int> resampledBands;
-      bSuccess = resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands);
-
-      // Check for limited spectral coverage and warning log 
-      if (bSuccess && pWavelengths->hasCenterValues() &&
-         resampledBands.size() != pWavelengths->getCenterValues().size())
+      // Whiten the full cube for later runs, it is used by this run when all the bands are covered
+      if (mInputs.mbUseWhitenedCache && pWhitenedCube == NULL)
       {
-         QString buf = QString("Warning AceAlg014: The spectrum only provides spectral coverage for %1 of %2 bands.")
-            .arg(resampledBands.size()).arg(pWavelengths->getCenterValues().size());
-         progress.report(buf.toStdString(), 0, WARNING, true);
+         cv::Mat whitening;
+         if (computeWhitening(invCovMat, whitening))
+         {
+            cachedMeans.assign(muMat.ptr<double>(0), muMat.ptr<double>(0) + numBands);
+            cachedWhitening.assign(whitening.ptr<double>(0), whitening.ptr<double>(0) + numBands * numBands);
+            pWhitenedCube = WhitenedCube::createCache(pElement, mInputs.mpAoi, cachedMeans, cachedWhitening, progress,
+               &mAbortFlag);
+         }
+         if (mAbortFlag)
+         {
+            progress.report(ACEABORT000, 0, ABORT, true);
+            mAbortFlag = false;
+            return false;
+         }
+         if (pWhitenedCube == NULL)
+         {
+            progress.report("Warning AceAlg015: Unable to create the whitened cube cache.", 0, WARNING, true);
+         }
       }
+   }
+   bool bPrewhitened = (pWhitenedCube != NULL && bFullCoverage);
+   if (bPrewhitened)
+   {
+      muMat = cv::Mat(1, numBands, CV_64F, &cachedMeans.front());
+   }
 
-      if (bSuccess)
+   // Factor the inverse covariance once per group and whiten the signatures
+   for (vector<AceSignatureGroup>::size_type group_index = 0; group_index < groups.size(); ++group_index)
+   {
+      AceSignatureGroup& group = groups[group_index];
+      int groupBands = static_cast<int>(group.mResampledBands.size());
+      int groupSignatures = static_cast<int>(group.mSignatureIndices.size());
+      if (bPrewhitened)
       {
-         BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
-         RasterElement* pResult = NULL;
-
-         //subtract the mean from the signature
-         cv::Mat spectrum(spectrumValues.size(), 1, CV_64F);
-         for (unsigned int i = 0; i < spectrumValues.size(); i++)
-         {
-            spectrum.at<double>(i, 0) = spectrumValues[i] - muMat.at<double>(0, resampledBands[i]);
-         }
-         cv::Mat invCovMatSubset(resampledBands.size(), resampledBands.size(), CV_64F);
-         for (int i_idx = 0; i_idx < resampledBands.size(); ++i_idx)
+         group.mWhitening = cv::Mat(numBands, numBands, CV_64F, &cachedWhitening.front());
+      }
+      else
+      {
+         cv::Mat invCovMatSubset(groupBands, groupBands, CV_64F);
+         for (int i_idx = 0; i_idx < groupBands; ++i_idx)
          {
-            for (int j_idx = 0; j_idx < resampledBands.size(); ++j_idx)
+            for (int j_idx = 0; j_idx < groupBands; ++j_idx)
             {
-               invCovMatSubset.at<double>(i_idx, j_idx) = invCovMat.at<double>(resampledBands[i_idx], resampledBands[j_idx]);
+               invCovMatSubset.at<double>(i_idx, j_idx) =
+                  invCovMat.at<double>(group.mResampledBands[i_idx], group.mResampledBands[j_idx]);
             }
          }
-         cv::Mat spectrumTerm = spectrum.t() * invCovMatSubset * spectrum;
-         cv::sqrt(spectrumTerm, spectrumTerm);
-         AceAlgInput aceInput(pElement, pResults.get(), spectrum, &mAbortFlag, iterChecker, resampledBands, 
-            muMat, invCovMatSubset, spectrumTerm);
-
-         //Output Structure
-         AceAlgOutput aceOutput;
-
-         // Reports current Spectrum ACE is running on
-         mta::ProgressObjectReporter reporter(message, getProgress());
-
-         // Initializes all threads
-         mta::MultiThreadedAlgorithm<AceAlgInput, AceAlgOutput, AceThread>
-            mtaAce(mta::getNumRequiredThreads(numRows),
-            aceInput, 
-            aceOutput, 
-            &reporter);
-
-         // Calculates ACE for current signature
-         mtaAce.run();
-         if (mAbortFlag)
+         if (!computeWhitening(invCovMatSubset, group.mWhitening))
          {
-            progress.report(ACEABORT000, 0, ABORT, true);
-            mAbortFlag = false;
+            progress.report("Unable to factor the inverse covariance matrix.", 0, ERRORS, true);
             return false;
          }
-         if (aceInput.mpResultsMatrix == NULL)
+      }
+
+      //subtract the mean from the signatures
+      vector<double>& spectraValues = groupSpectra[group_index];
+      for (vector<double>::size_type i = 0; i < spectraValues.size(); i++)
+      {
+         spectraValues[i] -= muMat.at<double>(0, group.mResampledBands[i % groupBands]);
+      }
+
+      // groupSpectra holds one signature after another so it is the transpose of the spectra matrix
+      cv::Mat spectra = cv::Mat(groupSignatures, groupBands, CV_64F, &spectraValues.front()).t();
+      group.mWhitenedSpectra = group.mWhitening * spectra;
+      for (int sig = 0; sig < groupSignatures; ++sig)
+      {
+         group.mSpectrumTerms.push_back(cv::norm(group.mWhitenedSpectra.col(sig)));
+      }
+   }
+
+   // Results are only needed for each signature when they are not merged in to a pseudocolor layer
+   bool bMerged = (iSignatureCount > 1 && mInputs.mbCreatePseudocolor);
+   vector<RasterElement*> resultsMatrices;
+   if (!bMerged)
+   {
+      for (sig_index = 0; sig_index < iSignatureCount; sig_index++)
+      {
+         std::string rname = mInputs.mResultsName;
+         if (iSignatureCount > 1)
          {
-            progress.report(ACEERR003, 0, ERRORS, true);
-            return false;
+            rname += " " + sigNames[sig_index];
          }
 
-         if (isInteractive() || mInputs.mbDisplayResults)
+         RasterElement* pResults = createResults(numRows, numColumns, 1, rname);
+         if (pResults == NULL)
          {
-            if (iSignatureCount > 1 && mInputs.mbCreatePseudocolor)
+            for (vector<RasterElement*>::iterator iter = resultsMatrices.begin();
+               iter != resultsMatrices.end(); ++iter)
             {
-               // Merges results in to one output layer if a Pseudocolor
-               // output layer has been selected
-               FactoryResource<DataRequest> pseudoRequest, currentRequest, highestRequest;
-               pseudoRequest->setWritable(true);
-               string failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-               DataAccessor daPseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-               if (!daPseudoAccessor.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
+               Service<ModelServices>()->destroyElement(*iter);
+            }
+            progress.report(ACEERR005, 0, ERRORS, true);
+            return false;
+         }
+         resultsMatrices.push_back(pResults);
+      }
+   }
 
-               DataAccessor daCurrentAccessor = pResults->getDataAccessor(currentRequest.release());
+   BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
+   // The cached cube already has the means removed
+   cv::Mat zeroMeans;
+   if (bPrewhitened)
+   {
+      zeroMeans = cv::Mat::zeros(1, numBands, CV_64F);
+   }
+   AceAlgInput aceInput(bPrewhitened ? pWhitenedCube : pElement, resultsMatrices, groups, iSignatureCount,
+      &mAbortFlag, iterChecker, bPrewhitened ? zeroMeans : muMat, bPrewhitened, pPseudocolorMatrix.get(),
+      pHighestAceValueMatrix.get(), mInputs.mThreshold);
 
-               highestRequest->setWritable(true);
-               failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(highestRequest.get(), pHighestAceValueMatrix.get());
-               DataAccessor daHighestAceValue = pHighestAceValueMatrix->getDataAccessor(highestRequest.release());
-               if (!daHighestAceValue.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
+   //Output Structure
+   AceAlgOutput aceOutput;
 
-               float* pPseudoValue = NULL;
-               float* pCurrentValue = NULL;
-               float* pHighestValue = NULL; 
+   // Reports the signatures ACE is running on
+   string message = QString("ACE running on %1 signatures").arg(iSignatureCount).toStdString();
+   mta::ProgressObjectReporter reporter(message, getProgress());
 
-               for (unsigned  int row_ctr = 0; row_ctr < numRows; row_ctr++)
-               {
-                  for (unsigned  int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-                  {
-                     if (!daPseudoAccessor.isValid() || !daCurrentAccessor.isValid())
-                     {
-                        progress.report("Unable to access data.", 0, ERRORS, true);
-                        return false;
-                     }
-                     daPseudoAccessor->toPixel(row_ctr, col_ctr);
-                     daCurrentAccessor->toPixel(row_ctr, col_ctr);
-
-                     pPseudoValue = reinterpret_cast<float*>(daPseudoAccessor->getColumn());
-                     pCurrentValue = reinterpret_cast<float*>(daCurrentAccessor->getColumn());
-
-                     daHighestAceValue->toPixel(row_ctr, col_ctr);
-                     pHighestValue = reinterpret_cast<float*>(daHighestAceValue->getColumn());
-
-                     if (*pCurrentValue >= mInputs.mThreshold)
-                     {
-                        if (*pCurrentValue > *pHighestValue)
-                        {
-                           *pPseudoValue = sig_index + 1;
-                           *pHighestValue = *pCurrentValue;
-                        }
-                     }
-                  }
-               }
-            }
-            else
-            {
-               ColorType color;
-               if (sig_index <= static_cast<int>(layerColors.size()))
-               {
-                  color = layerColors[sig_index];
-               }
+   // Initializes all threads
+   mta::MultiThreadedAlgorithm<AceAlgInput, AceAlgOutput, AceThread>
+      mtaAce(mta::getNumRequiredThreads(numRows),
+      aceInput, 
+      aceOutput, 
+      &reporter);
 
-               double dMaxValue = pResults->getStatistics()->getMax();
+   // Calculates ACE for all signatures
+   mtaAce.run();
+   if (mAbortFlag)
+   {
+      for (vector<RasterElement*>::iterator iter = resultsMatrices.begin(); iter != resultsMatrices.end(); ++iter)
+      {
+         Service<ModelServices>()->destroyElement(*iter);
+      }
+      progress.report(ACEABORT000, 0, ABORT, true);
+      mAbortFlag = false;
+      return false;
+   }
 
-               // Displays results for current signature
-               displayThresholdResults(pResults.release(), color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
-            }
-         }
-         else
+   for (sig_index = 0; sig_index < static_cast<int>(resultsMatrices.size()); sig_index++)
+   {
+      RasterElement* pResults = resultsMatrices[sig_index];
+      pResults->updateData();
+      if (isInteractive() || mInputs.mbDisplayResults)
+      {
+         ColorType color;
+         if (sig_index <= static_cast<int>(layerColors.size()))
          {
-            pResults.release();
+            color = layerColors[sig_index];
          }
+
+         double dMaxValue = pResults->getStatistics()->getMax();
+
+         // Displays results for current signature
+         displayThresholdResults(pResults, color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
       }
-   } //End of Signature Loop Counter
+   }
 
    if (bSuccess && !mAbortFlag)
    {
@@ -595,10 +604,9 @@ bool AceAlgorithm::processAll()
          mpResults = pPseudocolorMatrix.get();
          mpResults->updateData();
       }
-      else if (pResults.get() != NULL)
+      else if (!resultsMatrices.empty())
       {
-         mpResults = pResults.get();
-         mpResults->updateData();
+         mpResults = resultsMatrices.back();
       }
       else
       {
@@ -798,16 +806,12 @@ void AceThread::run()
 template<class T>
 void AceThread::ComputeAce(const T* pDummyData)
 {
-   int reSamBan_index = 0, row_index = 0, col_index = 0;
-   float* pResultsData = NULL;
+   int row_index = 0, col_index = 0;
    int oldPercentDone = -1;
-   double spectrumMag = 0.0;
    const T* pData=NULL;
    const RasterDataDescriptor* pDescriptor = static_cast<const RasterDataDescriptor*>(
       mInput.mpCube->getDataDescriptor());
    unsigned int numCols = pDescriptor->getColumnCount();
-   unsigned int numBands = pDescriptor->getBandCount();
-   unsigned int numRows = (mRowRange.mLast - mRowRange.mFirst + 1);
 
    int numResultsCols = 0;
 
@@ -823,25 +827,36 @@ void AceThread::ComputeAce(const T* pDummyData)
       numResultsCols = mInput.mIterCheck.getNumSelectedColumns();
    }
 
-   if (mInput.mpResultsMatrix == NULL)
+   if (mInput.mResultsMatrices.empty() && mInput.mpPseudocolorMatrix == NULL)
    {
       return;
    }
 
-   const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
-      mInput.mpResultsMatrix->getDataDescriptor());
-
-   // Gets results matrix that was initialized in ProcessAll()
+   // Gets results matrices that were initialized in ProcessAll()
    mRowRange.mFirst = std::max(0, mRowRange.mFirst);
    mRowRange.mLast = std::min(mRowRange.mLast, static_cast<int>(pDescriptor->getRowCount()) - 1);
-   FactoryResource<DataRequest> pResultRequest;
-   pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
-      pResultDescriptor->getActiveRow(mRowRange.mLast));
-   pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
-      pResultDescriptor->getActiveColumn(numResultsCols - 1));
-   pResultRequest->setWritable(true);
-   DataAccessor resultAccessor = mInput.mpResultsMatrix->getDataAccessor(pResultRequest.release());
-   if (!resultAccessor.isValid())
+   vector<DataAccessor> resultAccessors;
+   for (vector<RasterElement*>::const_iterator iter = mInput.mResultsMatrices.begin();
+      iter != mInput.mResultsMatrices.end(); ++iter)
+   {
+      const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
+         (*iter)->getDataDescriptor());
+      FactoryResource<DataRequest> pResultRequest;
+      pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
+         pResultDescriptor->getActiveRow(mRowRange.mLast));
+      pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
+         pResultDescriptor->getActiveColumn(numResultsCols - 1));
+      pResultRequest->setWritable(true);
+      resultAccessors.push_back((*iter)->getDataAccessor(pResultRequest.release()));
+      if (!resultAccessors.back().isValid())
+      {
+         return;
+      }
+   }
+
+   PseudocolorMerger merger(mInput.mpPseudocolorMatrix, mInput.mpHighestValueMatrix, mRowRange.mFirst,
+      mRowRange.mLast, numResultsCols, 0, mInput.mThreshold, true, 0.0f);
+   if (merger.isEnabled() && !merger.isValid())
    {
       return;
    }
@@ -855,7 +870,7 @@ void AceThread::ComputeAce(const T* pDummyData)
    int stopColumn = (numResultsCols + columnOffset - 1);
 
    const Units* pUnits = pDescriptor->getUnits();
-   double unitScale = (pUnits == NULL) ? 1.0 : pUnits->getScaleFromStandard();
+   double unitScale = (pUnits == NULL || mInput.mbPrewhitened) ? 1.0 : pUnits->getScaleFromStandard();
 
    FactoryResource<DataRequest> pRequest;
    pRequest->setInterleaveFormat(BIP);
@@ -867,6 +882,31 @@ void AceThread::ComputeAce(const T* pDummyData)
       return;
    }
 
+   //Coherent ACE description from paper: doi:10.1117/12.893950
+   //\sigma = covariance matrix of scene (should be minus anomalies)
+   //\mu_b = means of scene (using same subset as \sigma)
+   //S = s - \mu_b
+   //X = x - \mu_b
+   //y = \frac{S^T * \sigma^-1 * X}{\sqrt{S^T * \sigma^-1 * S} * \sqrt{X^T * \sigma^-1 * X}}
+   //
+   //With W * W = \sigma^-1 this is the cosine between W * S and W * X, so each row is mean
+   //adjusted and whitened with one matrix product per group and scored against every whitened
+   //signature with a second product.  All buffers are allocated once per thread.
+   vector<cv::Mat> pixelBlocks;
+   vector<cv::Mat> whitenedBlocks;
+   vector<cv::Mat> scoreBlocks;
+   for (vector<AceSignatureGroup>::const_iterator group = mInput.mGroups.begin();
+      group != mInput.mGroups.end(); ++group)
+   {
+      int groupBands = static_cast<int>(group->mResampledBands.size());
+      pixelBlocks.push_back(cv::Mat(numResultsCols, groupBands, CV_64F));
+      whitenedBlocks.push_back(cv::Mat(numResultsCols, groupBands, CV_64F));
+      scoreBlocks.push_back(cv::Mat(numResultsCols, static_cast<int>(group->mSignatureIndices.size()), CV_64F));
+   }
+   const double* pMeans = mInput.mMuMat.ptr<double>(0);
+   vector<float> rowScores(numResultsCols * mInput.mSignatureCount);
+   vector<char> selectedPixels(numResultsCols);
+
    for (row_index = startRow; row_index <= stopRow; ++row_index)
    {
       int percentDone = mRowRange.computePercent(row_index-rowOffset);
@@ -880,67 +920,98 @@ void AceThread::ComputeAce(const T* pDummyData)
          break;
       }
 
+      // Mean adjust the row once for each group, unselected pixels are left as zero
       for (col_index = startColumn; col_index <= stopColumn; ++col_index)
-      {  
-         VERIFYNRV(resultAccessor.isValid());
+      {
          VERIFYNRV(accessor.isValid());
-
-         // Pointer to results data
-         pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
-         if (pResultsData == NULL)
-         {
-            return;
-         }
-         if (mInput.mIterCheck.getPixel(col_index, row_index))
+         int column = col_index - startColumn;
+         selectedPixels[column] = mInput.mIterCheck.getPixel(col_index, row_index);
+         pData = NULL;
+         if (selectedPixels[column])
          {
             //Pointer to cube/sensor data
             pData = reinterpret_cast<T*>(accessor->getColumn());
             VERIFYNRV(pData != NULL);
-            *pResultsData = 0.0f;
-            double pixelMag = 0.0;
-            double angle =0.0;
-
-            //Calculates Spectral Angle and Magnitude at current location
-            cv::Mat dataSpectrum(mInput.mResampledBands.size(), 1, CV_64F);
-            for (unsigned int reAce_index = 0; 
-               reAce_index < mInput.mResampledBands.size(); ++reAce_index)
+         }
+         for (vector<AceSignatureGroup>::size_type group_index = 0; group_index < mInput.mGroups.size();
+            ++group_index)
+         {
+            const vector<int>& resampledBands = mInput.mGroups[group_index].mResampledBands;
+            double* pPixel = pixelBlocks[group_index].ptr<double>(column);
+            for (vector<int>::size_type band = 0; band < resampledBands.size(); ++band)
             {
-               int resampledBand = mInput.mResampledBands[reAce_index];
-               dataSpectrum.at<double>(reAce_index, 0) = (unitScale * pData[resampledBand]) - mInput.mMuMat.at<double>(resampledBand);
+               int resampledBand = resampledBands[band];
+               pPixel[band] = (pData == NULL) ? 0.0 : (unitScale * pData[resampledBand]) - pMeans[resampledBand];
             }
-            
-            //Coherent ACE description from paper: doi:10.1117/12.893950
-            //\sigma = covariance matrix of scene (should be minus anomalies)
-            //\mu_b = means of scene (using same subset as \sigma)
-            //S = s - \mu_b
-            //X = x - \mu_b
-            //y = \frac{S^T * \sigma^-1 * X}{\sqrt{S^T * \sigma^-1 * S} * \sqrt{X^T * \sigma^-1 * X}}
-            cv::Mat numerator = dataSpectrum.t() * mInput.mCovMat * mInput.mSpectrum;
-            cv::Mat dataTerm = dataSpectrum.t() * mInput.mCovMat * dataSpectrum;
-            cv::sqrt(dataTerm, dataTerm);
-            cv::Mat denominator = mInput.mSpectrumTerm * dataTerm;
-            if (denominator.at<double>(0) - 0.0 > std::numeric_limits<double>::epsilon())
+         }
+         accessor->nextColumn();
+      }
+      accessor->nextRow();
+
+      for (vector<AceSignatureGroup>::size_type group_index = 0; group_index < mInput.mGroups.size();
+         ++group_index)
+      {
+         const AceSignatureGroup& group = mInput.mGroups[group_index];
+         // the whitening matrix is symmetric so the transposed product is not needed
+         if (!mInput.mbPrewhitened)
+         {
+            cv::gemm(pixelBlocks[group_index], group.mWhitening, 1.0, cv::Mat(), 0.0, whitenedBlocks[group_index]);
+         }
+         const cv::Mat& whitened = mInput.mbPrewhitened ? pixelBlocks[group_index] : whitenedBlocks[group_index];
+         cv::gemm(whitened, group.mWhitenedSpectra, 1.0, cv::Mat(), 0.0, scoreBlocks[group_index]);
+
+         for (int column = 0; column < numResultsCols; ++column)
+         {
+            const double* pWhitened = whitened.ptr<double>(column);
+            double dataTerm = 0.0;
+            for (int band = 0; band < whitened.cols; ++band)
             {
-               cv::Mat result = numerator / denominator;
-               *pResultsData = result.at<double>(0);
+               dataTerm += pWhitened[band] * pWhitened[band];
             }
-            else
+            dataTerm = sqrt(dataTerm);
+
+            const double* pScores = scoreBlocks[group_index].ptr<double>(column);
+            for (vector<unsigned int>::size_type sig = 0; sig < group.mSignatureIndices.size(); ++sig)
             {
-               *pResultsData = 0.0;
+               double denominator = group.mSpectrumTerms[sig] * dataTerm;
+               float value = 0.0f;
+               if (denominator - 0.0 > std::numeric_limits<double>::epsilon())
+               {
+                  value = static_cast<float>(pScores[sig] / denominator);
+               }
+               rowScores[column * mInput.mSignatureCount + group.mSignatureIndices[sig]] = value;
             }
          }
-         else
+      }
+
+      for (vector<DataAccessor>::size_type sig = 0; sig < resultAccessors.size(); ++sig)
+      {
+         DataAccessor& resultAccessor = resultAccessors[sig];
+         for (int column = 0; column < numResultsCols; ++column)
          {
-            *pResultsData = 0.0;
+            VERIFYNRV(resultAccessor.isValid());
+            float* pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
+            if (pResultsData == NULL)
+            {
+               return;
+            }
+            *pResultsData = rowScores[column * mInput.mSignatureCount + sig];
+            resultAccessor->nextColumn();
          }
-
-         //Increment Columns
-         resultAccessor->nextColumn();
-         accessor->nextColumn();
+         resultAccessor->nextRow();
       }
 
-      //Increment Rows
-      resultAccessor->nextRow();
-      accessor->nextRow();
+      if (merger.isValid())
+      {
+         for (int column = 0; column < numResultsCols; ++column)
+         {
+            for (unsigned int sig = 0; sig < mInput.mSignatureCount; ++sig)
+            {
+               merger.merge(rowScores[column * mInput.mSignatureCount + sig], sig, selectedPixels[column] != 0);
+            }
+            merger.nextColumn();
+         }
+         merger.nextRow();
+      }
    }
 }
@@ -32,7 +32,8 @@ struct AceInputs
                  mbDisplayResults(false),
                  mResultsName("ACE Results"),
                  mpAoi(NULL),
-                 mbCreatePseudocolor(true) 
+                 mbCreatePseudocolor(true),
+                 mbUseWhitenedCache(false)
    {}
    std::vector<Signature*> mSignatures;
    double mThreshold;
@@ -40,6 +41,7 @@ struct AceInputs
    std::string mResultsName;
    AoiElement* mpAoi;
    bool mbCreatePseudocolor;
+   bool mbUseWhitenedCache;
 };
 
 class AceAlgorithm : public AlgorithmPattern
@@ -63,39 +65,61 @@ public:
    RasterElement* getResults() const;
 };
 
+/**
+ * Signatures which were resampled to the same set of cube bands.
+ *
+ * The whitening matrix is the symmetric square root of the inverse covariance for the resampled
+ * bands, so a whitened pixel only needs a dot product with each whitened signature.
+ */
+struct AceSignatureGroup
+{
+   std::vector<int> mResampledBands;
+   std::vector<unsigned int> mSignatureIndices;
+   cv::Mat mWhitening;                       // resampled bands x resampled bands
+   cv::Mat mWhitenedSpectra;                 // resampled bands x signatures, mean removed before whitening
+   std::vector<double> mSpectrumTerms;       // magnitude of each whitened signature
+};
+
 struct AceAlgInput
 {
    AceAlgInput(const RasterElement* pCube,
-      RasterElement* pResultsMatrix,
-      const cv::Mat& spectrum,
+      const std::vector<RasterElement*>& resultsMatrices,
+      const std::vector<AceSignatureGroup>& groups,
+      unsigned int signatureCount,
       const bool* pAbortFlag, 
       const BitMaskIterator& iterCheck,
-      const std::vector<int>& resampledBands,
       const cv::Mat& muMat, 
-      const cv::Mat& covMat,
-      const cv::Mat& spectrumTerm) : mpCube(pCube),
-      mpResultsMatrix(pResultsMatrix),
-      mSpectrum(spectrum),
+      bool prewhitened,
+      RasterElement* pPseudocolorMatrix,
+      RasterElement* pHighestValueMatrix,
+      double threshold) : mpCube(pCube),
+      mResultsMatrices(resultsMatrices),
+      mGroups(groups),
+      mSignatureCount(signatureCount),
       mpAbortFlag(pAbortFlag),
       mIterCheck(iterCheck),
-      mResampledBands(resampledBands),
       mMuMat(muMat),
-      mCovMat(covMat),
-      mSpectrumTerm(spectrumTerm)
+      mbPrewhitened(prewhitened),
+      mpPseudocolorMatrix(pPseudocolorMatrix),
+      mpHighestValueMatrix(pHighestValueMatrix),
+      mThreshold(threshold)
    {}
 
    virtual ~AceAlgInput()
    {}
 
    const RasterElement* mpCube;
-   RasterElement* mpResultsMatrix;
-   const cv::Mat& mSpectrum;
+   const std::vector<RasterElement*>& mResultsMatrices;  // one per signature, empty when only merging
+   const std::vector<AceSignatureGroup>& mGroups;
+   unsigned int mSignatureCount;
    const bool* mpAbortFlag;
    const BitMaskIterator& mIterCheck;
-   const std::vector<int>& mResampledBands;
    const cv::Mat& mMuMat;
-   const cv::Mat& mCovMat;
-   const cv::Mat& mSpectrumTerm;};
+   bool mbPrewhitened;                    // mpCube is a whitened cube cache so pixels are not whitened again
+   RasterElement* mpPseudocolorMatrix;    // NULL unless results are merged in to a pseudocolor layer
+   RasterElement* mpHighestValueMatrix;
+   double mThreshold;
+};
 
 class AceThread : public mta::AlgorithmThread
 {
@@ -127,6 +151,7 @@ public:
    Ace();
    ~Ace();
    SETTING(AceHelp, SpectralContextSensitiveHelp, std::string, "");
+   SETTING(UseWhitenedCache, Ace, bool, false);
 
 private:
    bool canRunBatch() const { return true; }
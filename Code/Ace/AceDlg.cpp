@@ -12,20 +12,40 @@
 #include "Ace.h"
 #include "AceDlg.h"
 
+#include <QtGui/QCheckBox>
+#include <QtGui/QGridLayout>
+
 using namespace std;
 
 AceDlg::AceDlg(RasterElement* pCube, AlgorithmRunner* pRunner, Progress* pProgress,
        const string& resultsName, bool pseudocolor, bool addApply, bool contextHelp, double threshold,
-        QWidget* pParent) :
+       bool whitenedCache, QWidget* pParent) :
    SpectralSignatureSelector(pCube, pRunner, pProgress, resultsName, pseudocolor,
-      addApply, pParent, (contextHelp ? "Help" : string()) )
+      addApply, pParent, (contextHelp ? "Help" : string()) ),
+   mpWhitenedCacheCheck(NULL)
 {
    setThreshold(threshold);
+
+   mpWhitenedCacheCheck = new QCheckBox("Keep a whitened copy of the cube for later runs", this);
+   mpWhitenedCacheCheck->setChecked(whitenedCache);
+   mpWhitenedCacheCheck->setToolTip("This option whitens the whole cube once and keeps it so later runs on the "
+      "same cube and AOI skip the covariance calculation.\nThe copy is rebuilt when the cube or the AOI changes.");
+   mpWhitenedCacheCheck->setWhatsThis(mpWhitenedCacheCheck->toolTip());
+   QGridLayout* pGrid = getLayout();
+   if (pGrid != NULL)
+   {
+      pGrid->addWidget(mpWhitenedCacheCheck, 4, 0, 1, 2);
+   }
 }
 
 AceDlg::~AceDlg()
 {}
 
+bool AceDlg::isWhitenedCacheUsed() const
+{
+   return mpWhitenedCacheCheck->isChecked();
+}
+
 void AceDlg::customButtonClicked()
 {
    Service<DesktopServices> pDesktop;
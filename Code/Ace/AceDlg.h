@@ -12,6 +12,8 @@
 
 #include "SpectralSignatureSelector.h"
 
+class QCheckBox;
+
 class AceDlg : public SpectralSignatureSelector
 {
    Q_OBJECT
@@ -19,11 +21,17 @@ class AceDlg : public SpectralSignatureSelector
 public:
    AceDlg(RasterElement* pCube, AlgorithmRunner* pRunner, Progress* pProgress,
       const std::string& resultsName = std::string(), bool pseudocolor = true, 
-      bool addApply = false, bool contextHelp = false, double threshold = 0.5, QWidget* pParent = NULL);
+      bool addApply = false, bool contextHelp = false, double threshold = 0.5, bool whitenedCache = false,
+      QWidget* pParent = NULL);
    ~AceDlg();
 
+   bool isWhitenedCacheUsed() const;
+
 protected slots:
    void customButtonClicked();
+
+private:
+   QCheckBox* mpWhitenedCacheCheck;
 };
 
 #endif
@@ -25,11 +25,13 @@
 #include "PlugInRegistration.h"
 #include "PlugInResource.h"
 #include "ProgressTracker.h"
+#include "PseudocolorMerger.h"
 #include "RasterDataDescriptor.h"
 #include "RasterElement.h"
 #include "RasterUtilities.h"
 #include "Resampler.h"
 #include "Signature.h"
+#include "SpectralKernels.h"
 #include "SpectralUtilities.h"
 #include "SpectralVersion.h"
 #include "Statistics.h"
@@ -38,6 +40,8 @@
 #include "Units.h"
 #include "Wavelengths.h"
 
+#include <algorithm>
+
 using namespace std;
 
 struct InsertReflectance : public unary_function<unsigned int,bool>
@@ -132,6 +136,11 @@ bool Cem::populateBatchInputArgList(PlugInArgList* pInArgList)
    VERIFY(pInArgList->addArg<bool>("Create Pseudocolor", mInputs.mbCreatePseudocolor, "Flag for whether a single "
       "pseudocolor layer should be created instead of multiple threshold layers if multiple target signatures are "
       "used and the results are displayed.  A pseudocolor layer is created by default if results are displayed."));
+   VERIFY(pInArgList->addArg<unsigned int>("Row Skip Factor", mInputs.mRowSkip, "Only every Nth row is used to "
+      "estimate the second moment matrix.  If this or the column skip factor is greater than 1, the estimation error "
+      "is reported.  Every row is used by default."));
+   VERIFY(pInArgList->addArg<unsigned int>("Column Skip Factor", mInputs.mColumnSkip, "Only every Nth column is "
+      "used to estimate the second moment matrix.  Every column is used by default."));
    return true;
 }
 
@@ -177,6 +186,8 @@ bool Cem::parseInputArgList(PlugInArgList* pInArgList)
       VERIFY(pInArgList->getPlugInArgValue("Display Results", mInputs.mbDisplayResults));
       VERIFY(pInArgList->getPlugInArgValue("Results Name", mInputs.mResultsName));
       VERIFY(pInArgList->getPlugInArgValue("Create Pseudocolor", mInputs.mbCreatePseudocolor));
+      VERIFY(pInArgList->getPlugInArgValue("Row Skip Factor", mInputs.mRowSkip));
+      VERIFY(pInArgList->getPlugInArgValue("Column Skip Factor", mInputs.mColumnSkip));
 
       mInputs.mSignatures = SpectralUtilities::extractSignatures(vector<Signature*>(1, pSignatures));
    }
@@ -230,6 +241,8 @@ bool Cem::extractFromGui()
    mInputs.mResultsName = mpCemGui->getResultsName();
    mInputs.mpAoi = mpCemGui->getAoi();
    mInputs.mbCreatePseudocolor = mpCemGui->isPseudocolorLayerUsed();
+   mInputs.mRowSkip = Cem::getSettingSecondMomentRowSkip();
+   mInputs.mColumnSkip = Cem::getSettingSecondMomentColumnSkip();
 
    if (mInputs.mResultsName.empty())
    {
@@ -306,23 +319,60 @@ bool CemAlgorithm::processAll()
    excludeColors.push_back(ColorType(255, 255, 255));
    ColorType::getUniqueColors(iSignatureCount + 2, layerColors, excludeColors); // 2 for "no match" and "interminacy
 
-   // get SMM^-1
-   ExecutableResource smmPlugin("Second Moment", string(), progress.getCurrentProgress(), !isInteractive());
-   if (smmPlugin->getPlugIn() == NULL)
-   {
-      progress.report("Second Moment Matrix plug-in not available.", 0, ERRORS, true);
-      return false;
+   // get SMM^-1, either from the full data or estimated from a subsample
+   const double* pSmmData = NULL;
+   const double* pInvSmmData = NULL;
+   vector<double> sampledSmm;
+   vector<double> sampledInvSmm;
+   if (mInputs.mRowSkip > 1 || mInputs.mColumnSkip > 1)
+   {
+      BitMaskIterator sampleIter(getPixelsToProcess(), pElement);
+      double relativeError = 0.0;
+      sampledSmm = SpectralUtilities::calculateSecondMoment(pElement, sampleIter, mInputs.mRowSkip,
+         mInputs.mColumnSkip, relativeError, progress, &mAbortFlag);
+      if (mAbortFlag)
+      {
+         progress.report("User aborted the operation.", 0, ABORT, true);
+         mAbortFlag = false;
+         return false;
+      }
+      sampledInvSmm.resize(sampledSmm.size());
+      if (sampledSmm.size() != numBands * numBands ||
+         !MatrixFunctions::invertSquareMatrix1D(&sampledInvSmm.front(), &sampledSmm.front(), numBands))
+      {
+         progress.report("Failed to calculate second moment matrix.", 0, ERRORS, true);
+         return false;
+      }
+      pSmmData = &sampledSmm.front();
+      pInvSmmData = &sampledInvSmm.front();
+
+      QString buf = QString("The second moment matrix was estimated from 1 of every %1 rows and 1 of every "
+         "%2 columns with a relative error of about %3%.").arg(mInputs.mRowSkip).arg(mInputs.mColumnSkip)
+         .arg(relativeError * 100.0, 0, 'g', 3);
+      progress.report(buf.toStdString(), 0, NORMAL, true);
+      progress.getCurrentStep()->addProperty("Second Moment Relative Error", relativeError);
    }
-   smmPlugin->getInArgList().setPlugInArgValue<RasterElement>(Executable::DataElementArg(), pElement);
-   smmPlugin->getInArgList().setPlugInArgValue<AoiElement>("AOI", mInputs.mpAoi);
-   RasterElement* pSmm = NULL;
-   RasterElement* pInvSmm = NULL;
-   if (!smmPlugin->execute() ||
-      (pSmm = smmPlugin->getOutArgList().getPlugInArgValue<RasterElement>("Second Moment Matrix")) == NULL ||
-      (pInvSmm = smmPlugin->getOutArgList().getPlugInArgValue<RasterElement>("Inverse Second Moment Matrix")) == NULL)
+   else
    {
-      progress.report("Failed to calculate second moment matrix.", 0, ERRORS, true);
-      return false;
+      ExecutableResource smmPlugin("Second Moment", string(), progress.getCurrentProgress(), !isInteractive());
+      if (smmPlugin->getPlugIn() == NULL)
+      {
+         progress.report("Second Moment Matrix plug-in not available.", 0, ERRORS, true);
+         return false;
+      }
+      smmPlugin->getInArgList().setPlugInArgValue<RasterElement>(Executable::DataElementArg(), pElement);
+      smmPlugin->getInArgList().setPlugInArgValue<AoiElement>("AOI", mInputs.mpAoi);
+      RasterElement* pSmm = NULL;
+      RasterElement* pInvSmm = NULL;
+      if (!smmPlugin->execute() ||
+         (pSmm = smmPlugin->getOutArgList().getPlugInArgValue<RasterElement>("Second Moment Matrix")) == NULL ||
+         (pInvSmm = smmPlugin->getOutArgList().getPlugInArgValue<RasterElement>("Inverse Second Moment Matrix")) == NULL)
+      {
+         progress.report("Failed to calculate second moment matrix.", 0, ERRORS, true);
+         return false;
+      }
+      pSmmData = reinterpret_cast<const double*>(pSmm->getRawData());
+      pInvSmmData = reinterpret_cast<const double*>(pInvSmm->getRawData());
    }
 
    // get cube wavelengths
@@ -344,269 +394,168 @@ bool CemAlgorithm::processAll()
          progress.report("Unable to create pseudocolor results matrix.", 0, ERRORS, true);
          return false;
       }
-      FactoryResource<DataRequest> pseudoRequest;
-      pseudoRequest->setWritable(true);
-      string failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-      DataAccessor pseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-      if (!pseudoAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      FactoryResource<DataRequest> hcvRequest;
-      hcvRequest->setWritable(true);
-      failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(hcvRequest.get(), pHighestCEMValueMatrix.get());
-      DataAccessor highestCemValueAccessor = pHighestCEMValueMatrix->getDataAccessor(hcvRequest.release());
-      if (!highestCemValueAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      //Let's zero out all the results in case we connect to an existing matrix.
-      float* pPseudoValue = NULL;
-      float* pHighestValue = NULL;
-
-      for (unsigned int row_ctr = 0; row_ctr < numRows; row_ctr++)
-      {
-         for (unsigned int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-         {
-            if (!pseudoAccessor.isValid() || !highestCemValueAccessor.isValid())
-            {
-               progress.report("Unable to access results.", 0, ERRORS, true);
-               return false;
-            }
-
-            pHighestValue = reinterpret_cast<float*>(highestCemValueAccessor->getColumn());
-            pPseudoValue = reinterpret_cast<float*>(pseudoAccessor->getColumn());
-
-            //Initialize the matrices
-            *pPseudoValue = 0.0f;
-            *pHighestValue = -10.0f;
-
-            pseudoAccessor->nextColumn();
-            highestCemValueAccessor->nextColumn();
-         }
-         pseudoAccessor->nextRow();
-         highestCemValueAccessor->nextRow();
-      }
    }
 
    const Units* pUnits = pDescriptor->getUnits();
    vector<string> sigNames;
-   ModelResource<RasterElement> pResults(reinterpret_cast<RasterElement*>(NULL));
 
-   // else create a result for each signature..with a unique name...INCLUDE offset!
+   // Resample every signature and stack the filters of the signatures which cover the same bands
+   // so the cube is only read once
    bool success = true;
+   vector<CemFilterGroup> groups;
    for (int sig_index = 0; success && sig_index < iSignatureCount && !mAbortFlag; sig_index++)
    {
       Signature* pSignature = mInputs.mSignatures[sig_index];
       sigNames.push_back(pSignature->getName());
-      std::string rname = mInputs.mResultsName;
-      if (iSignatureCount > 1 && !mInputs.mbCreatePseudocolor)
-      {
-         rname += " " + sigNames.back();
-      }
-      else if (iSignatureCount > 1)
-      {
-         rname += "CemTemp";
-      }
 
-      if (mInputs.mbCreatePseudocolor == false || pResults.get() == NULL)
-      {
-         pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, rname));
-      }
-      if (pResults.get() == NULL)
+      vector<double> spectrumValues;
+      vector<int> resampledBands;
+      success = resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands);
+      if (!success)
       {
-         success = false;
          break;
       }
 
-      QString messageSigNumber = QString("Processing Signature %1 of %2 : CEM running on signature %3")
-         .arg(sig_index+1).arg(iSignatureCount).arg(QString::fromStdString(sigNames.back()));
-      string message = messageSigNumber.toStdString();
-
-      vector<double> spectrumValues;
-      vector<int> resampledBands, prevResampledBands;
-      vector<double> woper(numBands);
-      success = resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands);
-
       // Check for limited spectral coverage and warning log 
-      if (success && pWavelengths->hasCenterValues() &&
-         resampledBands.size() != pWavelengths->getCenterValues().size())
+      if (pWavelengths->hasCenterValues() && resampledBands.size() != pWavelengths->getCenterValues().size())
       {
-         QString buf = QString("The spectrum only provides spectral coverage for %1 of %2 bands.")
-            .arg(resampledBands.size()).arg(pWavelengths->getCenterValues().size());
+         QString buf = QString("The spectrum %1 only provides spectral coverage for %2 of %3 bands.")
+            .arg(QString::fromStdString(sigNames.back())).arg(resampledBands.size())
+            .arg(pWavelengths->getCenterValues().size());
          progress.report(buf.toStdString(), 0, WARNING, true);
       }
 
-      if (success)
+      const Units* pSigUnits = pSignature->getUnits("Reflectance");
+      if (pSigUnits != NULL && pUnits != NULL)
       {
-         const Units* pSigUnits = pSignature->getUnits("Reflectance");
-         if (pSigUnits != NULL && pUnits != NULL)
+         if (pUnits->getUnitType() != pSigUnits->getUnitType())
          {
-            if (pUnits->getUnitType() != pSigUnits->getUnitType())
-            {
-               progress.report("The spectrum and data have different units. CEM detections will be unpredictable.", 0, WARNING, true);
-            }
-
-            // what to multiply the spectrum by to have it in the same units as the cube
-            double unitScaleRatio = 0;
-            if (pUnits->getScaleFromStandard() != 0) // prevent divided by zero
-            {
-               unitScaleRatio = pSigUnits->getScaleFromStandard() / pUnits->getScaleFromStandard();
-            }
-
-            // scale to ensure that cube and spectrum are scaled the same:
-            std::transform(spectrumValues.begin(), spectrumValues.end(), 
-               spectrumValues.begin(), std::bind2nd(std::multiplies<double>(), 
-               unitScaleRatio));
+            progress.report("The spectrum and data have different units. CEM detections will be unpredictable.", 0, WARNING, true);
          }
 
-         if (resampledBands.size() != pWavelengths->getCenterValues().size())
-         {
-            vector<double> smmSubset(numBands * numBands);
-            if (!compareBands(resampledBands, prevResampledBands))
-            {
-               prevResampledBands = resampledBands;
-               computeSmmSubset(numBands, reinterpret_cast<double*>(pSmm->getRawData()), &smmSubset.front(),
-                  resampledBands);
-            }
-            computeWoper(spectrumValues, &smmSubset.front(), numBands, woper, resampledBands);
-         }
-         else
+         // what to multiply the spectrum by to have it in the same units as the cube
+         double unitScaleRatio = 0;
+         if (pUnits->getScaleFromStandard() != 0) // prevent divided by zero
          {
-            computeWoper(spectrumValues, reinterpret_cast<double*>(pInvSmm->getRawData()), numBands, woper, resampledBands);
+            unitScaleRatio = pSigUnits->getScaleFromStandard() / pUnits->getScaleFromStandard();
          }
 
-         BitMaskIterator iterChecker(getPixelsToProcess(), 0, 0, pDescriptor->getColumnCount() - 1,
-                                     pDescriptor->getRowCount() - 1);
-         CemAlgInput cemInput(pElement, pResults.get(), woper, &mAbortFlag, iterChecker, resampledBands);
+         // scale to ensure that cube and spectrum are scaled the same:
+         std::transform(spectrumValues.begin(), spectrumValues.end(), 
+            spectrumValues.begin(), std::bind2nd(std::multiplies<double>(), 
+            unitScaleRatio));
+      }
+
+      vector<CemFilterGroup>::size_type group_index = 0;
+      while (group_index < groups.size() && !compareBands(groups[group_index].mResampledBands, resampledBands))
+      {
+         ++group_index;
+      }
+      if (group_index == groups.size())
+      {
+         groups.push_back(CemFilterGroup());
+         groups.back().mResampledBands = resampledBands;
+      }
+      groups[group_index].mSignatureIndices.push_back(sig_index);
+      groups[group_index].mFilters.insert(groups[group_index].mFilters.end(),
+         spectrumValues.begin(), spectrumValues.end());
+   }
+   if (!success)
+   {
+      progress.report("Unable to resample signature " + sigNames.back() + ".", 0, ERRORS, true);
+      return false;
+   }
+
+   // Replace each group's spectra with their filters, the second moment subset only needs to be
+   // inverted once per group
+   for (vector<CemFilterGroup>::iterator group = groups.begin(); group != groups.end(); ++group)
+   {
+      unsigned int groupBands = group->mResampledBands.size();
+      vector<double> smmSubset;
+      const double* pInverse = pInvSmmData;
+      if (groupBands != pWavelengths->getCenterValues().size())
+      {
+         smmSubset.resize(std::max(groupBands * groupBands, 1U));
+         computeSmmSubset(numBands, pSmmData, &smmSubset.front(),
+            group->mResampledBands);
+         pInverse = &smmSubset.front();
+      }
+      for (vector<unsigned int>::size_type sig = 0; sig < group->mSignatureIndices.size(); ++sig)
+      {
+         vector<double> spectrumValues(group->mFilters.begin() + sig * groupBands,
+            group->mFilters.begin() + (sig + 1) * groupBands);
+         vector<double> woper;
+         computeWoper(spectrumValues, pInverse, numBands, woper, group->mResampledBands);
+         std::copy(woper.begin(), woper.end(), group->mFilters.begin() + sig * groupBands);
+      }
+   }
 
-         CemAlgOutput cemOutput;
-         mta::ProgressObjectReporter reporter(message, progress.getCurrentProgress());
-         mta::MultiThreadedAlgorithm<CemAlgInput, CemAlgOutput, CemThread>
-            mtaCem(mta::getNumRequiredThreads(numRows), cemInput, cemOutput, &reporter);
-         mtaCem.run();
-         if (mAbortFlag)
+   // Results are only needed for each signature when they are not merged in to a pseudocolor layer
+   bool bMerged = (iSignatureCount > 1 && mInputs.mbCreatePseudocolor);
+   vector<RasterElement*> resultsMatrices;
+   if (!bMerged)
+   {
+      for (int sig_index = 0; sig_index < iSignatureCount; sig_index++)
+      {
+         std::string rname = mInputs.mResultsName;
+         if (iSignatureCount > 1)
          {
-            progress.report("User aborted the operation.", 0, ABORT, true);
-            mAbortFlag = false;
-            return false;
+            rname += " " + sigNames[sig_index];
          }
-         if (cemInput.mpResultsMatrix == NULL)
+
+         RasterElement* pResults = createResults(numRows, numColumns, rname);
+         if (pResults == NULL)
          {
-            progress.report("Error calculating CEM", 0, ERRORS, true);
+            for (vector<RasterElement*>::iterator iter = resultsMatrices.begin();
+               iter != resultsMatrices.end(); ++iter)
+            {
+               Service<ModelServices>()->destroyElement(*iter);
+            }
+            progress.report("Unable to create results matrix.", 0, ERRORS, true);
             return false;
          }
-         if (isInteractive() || mInputs.mbDisplayResults)
-         {
-            if (iSignatureCount > 1 && mInputs.mbCreatePseudocolor)
-            {
-               // Merges results in to one output layer if a Pseudocolor
-               // output layer has been selected
-               FactoryResource<DataRequest> pseudoRequest;
-               pseudoRequest->setWritable(true);
-               string failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-               DataAccessor daPseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-               if (!daPseudoAccessor.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
-
-               DataAccessor daCurrentAccessor = pResults->getDataAccessor();
-
-               FactoryResource<DataRequest> highestRequest;
-               highestRequest->setWritable(true);
-               failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(highestRequest.get(), pHighestCEMValueMatrix.get());
-               DataAccessor daHighestCEMValue = pHighestCEMValueMatrix->getDataAccessor(highestRequest.release());
-               if (!daHighestCEMValue.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
-
-               float* pPseudoValue = NULL;
-               float* pCurrentValue = NULL;
-               float* pHighestValue = NULL; 
+         resultsMatrices.push_back(pResults);
+      }
+   }
 
-               for (unsigned  int row_ctr = 0; row_ctr < numRows; row_ctr++)
-               {
-                  for (unsigned  int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-                  {
-                     if (!daPseudoAccessor.isValid() || !daCurrentAccessor.isValid())
-                     {
-                        progress.report("Unable to access data.", 0, ERRORS, true);
-                        return false;
-                     }
-                     daPseudoAccessor->toPixel(row_ctr, col_ctr);
-                     daCurrentAccessor->toPixel(row_ctr, col_ctr);
-
-                     pPseudoValue = reinterpret_cast<float*>(daPseudoAccessor->getColumn());
-                     pCurrentValue = reinterpret_cast<float*>(daCurrentAccessor->getColumn());
-
-                     daHighestCEMValue->toPixel(row_ctr, col_ctr);
-                     pHighestValue = reinterpret_cast<float*>(daHighestCEMValue->getColumn());
-
-                     if (*pCurrentValue >= mInputs.mThreshold)
-                     {
-                        if (*pCurrentValue > *pHighestValue)
-                        {
-                           *pPseudoValue = sig_index+1;
-                           *pHighestValue = *pCurrentValue;
-                        }
-                     }
-                  }
-               }
-            }
-            else
-            {
-               ColorType color;
-               if (sig_index <= static_cast<int>(layerColors.size()))
-               {
-                  color = layerColors[sig_index];
-               }
+   BitMaskIterator iterChecker(getPixelsToProcess(), 0, 0, pDescriptor->getColumnCount() - 1,
+                               pDescriptor->getRowCount() - 1);
+   CemAlgInput cemInput(pElement, resultsMatrices, groups, iSignatureCount, &mAbortFlag, iterChecker,
+      pPseudocolorMatrix.get(), pHighestCEMValueMatrix.get(), mInputs.mThreshold);
 
-               double dMaxValue = pResults->getStatistics()->getMax();
+   CemAlgOutput cemOutput;
+   string message = QString("CEM running on %1 signatures").arg(iSignatureCount).toStdString();
+   mta::ProgressObjectReporter reporter(message, progress.getCurrentProgress());
+   mta::MultiThreadedAlgorithm<CemAlgInput, CemAlgOutput, CemThread>
+      mtaCem(mta::getNumRequiredThreads(numRows), cemInput, cemOutput, &reporter);
+   mtaCem.run();
+   if (mAbortFlag)
+   {
+      for (vector<RasterElement*>::iterator iter = resultsMatrices.begin(); iter != resultsMatrices.end(); ++iter)
+      {
+         Service<ModelServices>()->destroyElement(*iter);
+      }
+      progress.report("User aborted the operation.", 0, ABORT, true);
+      mAbortFlag = false;
+      return false;
+   }
 
-               // Displays results for current signature
-               displayThresholdResults(pResults.release(), color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
-            }
-         }
-         else
+   for (int sig_index = 0; sig_index < static_cast<int>(resultsMatrices.size()); sig_index++)
+   {
+      RasterElement* pResults = resultsMatrices[sig_index];
+      pResults->updateData();
+      if (isInteractive() || mInputs.mbDisplayResults)
+      {
+         ColorType color;
+         if (sig_index <= static_cast<int>(layerColors.size()))
          {
-            pResults.release();
+            color = layerColors[sig_index];
          }
+
+         double dMaxValue = pResults->getStatistics()->getMax();
+
+         // Displays results for current signature
+         displayThresholdResults(pResults, color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
       }
    }
 
@@ -635,10 +584,9 @@ bool CemAlgorithm::processAll()
          mpResults = pPseudocolorMatrix.get();
          mpResults->updateData();
       }
-      else if (pResults.get() != NULL)
+      else if (!resultsMatrices.empty())
       {
-         mpResults = pResults.get();
-         mpResults->updateData();
+         mpResults = resultsMatrices.back();
       }
       else
       {
@@ -655,7 +603,7 @@ bool CemAlgorithm::processAll()
    return success;
 }
 
-void CemAlgorithm::computeWoper(std::vector<double>& spectrumValues, double* pSmm,
+void CemAlgorithm::computeWoper(std::vector<double>& spectrumValues, const double* pSmm,
                                 int numBands, std::vector<double>& pWoper, const std::vector<int>& resampledBands)
 {
    unsigned int numResampledBands = resampledBands.size();
@@ -881,8 +829,6 @@ void CemThread::ComputeCem(const T* pDummyData)
 {
    const RasterDataDescriptor* pDescriptor = dynamic_cast<const RasterDataDescriptor*>(mInput.mpCube->getDataDescriptor());
    int numCols = pDescriptor->getColumnCount();
-   int numBands = pDescriptor->getBandCount();
-   int numRows = mRowRange.mLast - mRowRange.mFirst + 1;
    int numResultsCols = 0;
 
    if (mInput.mCheck.useAllPixels())
@@ -894,29 +840,53 @@ void CemThread::ComputeCem(const T* pDummyData)
       numResultsCols = mInput.mCheck.getNumSelectedColumns();
    }
 
-   if (mInput.mpResultsMatrix == NULL)
+   if (mInput.mResultsMatrices.empty() && mInput.mpPseudocolorMatrix == NULL)
    {
       return;
    }
 
-   const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
-      mInput.mpResultsMatrix->getDataDescriptor());
-   // Gets results matrix that was initialized in ProcessAll()
+   // Gets results matrices that were initialized in ProcessAll()
    mRowRange.mFirst = std::max(0, mRowRange.mFirst);
    mRowRange.mLast = std::min(mRowRange.mLast, static_cast<int>(pDescriptor->getRowCount()) - 1);
-   FactoryResource<DataRequest> pResultRequest;
-   pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
-      pResultDescriptor->getActiveRow(mRowRange.mLast));
-   pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
-      pResultDescriptor->getActiveColumn(numResultsCols - 1));
-   pResultRequest->setWritable(true);
-   DataAccessor resultAccessor = mInput.mpResultsMatrix->getDataAccessor(pResultRequest.release());
-   if (!resultAccessor.isValid())
+   vector<DataAccessor> resultAccessors;
+   for (vector<RasterElement*>::const_iterator iter = mInput.mResultsMatrices.begin();
+      iter != mInput.mResultsMatrices.end(); ++iter)
+   {
+      const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
+         (*iter)->getDataDescriptor());
+      FactoryResource<DataRequest> pResultRequest;
+      pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
+         pResultDescriptor->getActiveRow(mRowRange.mLast));
+      pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
+         pResultDescriptor->getActiveColumn(numResultsCols - 1));
+      pResultRequest->setWritable(true);
+      resultAccessors.push_back((*iter)->getDataAccessor(pResultRequest.release()));
+      if (!resultAccessors.back().isValid())
+      {
+         return;
+      }
+   }
+
+   PseudocolorMerger merger(mInput.mpPseudocolorMatrix, mInput.mpHighestValueMatrix, mRowRange.mFirst,
+      mRowRange.mLast, numResultsCols, 0, mInput.mThreshold, true, -10.0f);
+   if (merger.isEnabled() && !merger.isValid())
    {
       return;
    }
 
-   int index = numResultsCols * mRowRange.mFirst;
+   // Bands which form one contiguous run are filtered in place, all others are packed
+   // into a dense buffer once per pixel so every filter in the group reuses it
+   vector<bool> contiguousGroups;
+   unsigned int maxGroupBands = 0;
+   for (vector<CemFilterGroup>::const_iterator group = mInput.mGroups.begin();
+      group != mInput.mGroups.end(); ++group)
+   {
+      contiguousGroups.push_back(SpectralKernels::isContiguous(group->mResampledBands));
+      maxGroupBands = std::max(maxGroupBands, static_cast<unsigned int>(group->mResampledBands.size()));
+   }
+   vector<T> packedBands(std::max(maxGroupBands, 1U));
+   vector<float> pixelScores(std::max(mInput.mSignatureCount, 1U));
+
    int oldPercentDone = -1;
    int rowOffset = static_cast<int>(mInput.mCheck.getOffset().mY);
    int startRow = mRowRange.mFirst + rowOffset;
@@ -951,30 +921,60 @@ void CemThread::ComputeCem(const T* pDummyData)
 
       for (int col_index = startColumn; col_index <= stopColumn; ++col_index)
       {
-         VERIFYNRV(resultAccessor.isValid());
          VERIFYNRV(accessor.isValid());
 
-         float* pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
-         VERIFYNRV(pResultsData != NULL);
-
-         if (mInput.mCheck.getPixel(col_index, row_index))
+         bool selected = mInput.mCheck.getPixel(col_index, row_index);
+         if (selected)
          {
-            T* pData = reinterpret_cast<T*>(accessor->getColumn());
-            *pResultsData = 0.0f;
-            for (unsigned int band_index = 0; band_index < mInput.mResampledBands.size(); ++band_index)
+            const T* pData = reinterpret_cast<T*>(accessor->getColumn());
+            for (vector<CemFilterGroup>::size_type group_index = 0; group_index < mInput.mGroups.size();
+               ++group_index)
             {
-               int resampledBand = mInput.mResampledBands[band_index];
-               *pResultsData += (pData[resampledBand] * mInput.mWoper[band_index]);
+               const CemFilterGroup& group = mInput.mGroups[group_index];
+               const unsigned int groupBands = group.mResampledBands.size();
+               const T* pBands = &packedBands.front();
+               if (contiguousGroups[group_index])
+               {
+                  pBands = pData + group.mResampledBands.front();
+               }
+               else
+               {
+                  SpectralKernels::gatherBands(pData, group.mResampledBands, &packedBands.front());
+               }
+
+               for (vector<unsigned int>::size_type sig = 0; sig < group.mSignatureIndices.size(); ++sig)
+               {
+                  pixelScores[group.mSignatureIndices[sig]] = static_cast<float>(groupBands == 0 ? 0.0 :
+                     SpectralKernels::dotProduct(pBands, &group.mFilters[sig * groupBands], groupBands));
+               }
             }
          }
          else
          {
-            *pResultsData = -10.0;
+            std::fill(pixelScores.begin(), pixelScores.end(), -10.0f);
+         }
+
+         for (vector<DataAccessor>::size_type sig = 0; sig < resultAccessors.size(); ++sig)
+         {
+            VERIFYNRV(resultAccessors[sig].isValid());
+            float* pResultsData = reinterpret_cast<float*>(resultAccessors[sig]->getColumn());
+            VERIFYNRV(pResultsData != NULL);
+            *pResultsData = pixelScores[sig];
+            resultAccessors[sig]->nextColumn();
+         }
+         for (unsigned int sig = 0; sig < mInput.mSignatureCount && merger.isValid(); ++sig)
+         {
+            merger.merge(pixelScores[sig], sig, selected);
          }
-         resultAccessor->nextColumn();
          accessor->nextColumn();
+         merger.nextColumn();
+      }
+      for (vector<DataAccessor>::iterator resultAccessor = resultAccessors.begin();
+         resultAccessor != resultAccessors.end(); ++resultAccessor)
+      {
+         (*resultAccessor)->nextRow();
       }
-      resultAccessor->nextRow();
       accessor->nextRow();
+      merger.nextRow();
    }
 }
@@ -32,13 +32,17 @@ struct CemInputs
                  mbDisplayResults(false),
                  mResultsName("CEM Results"),
                  mpAoi(NULL),
-                 mbCreatePseudocolor(true) {}
+                 mbCreatePseudocolor(true),
+                 mRowSkip(1),
+                 mColumnSkip(1) {}
    std::vector<Signature*> mSignatures;
    double mThreshold;
    bool mbDisplayResults;
    std::string mResultsName;
    AoiElement* mpAoi;
    bool mbCreatePseudocolor;
+   unsigned int mRowSkip;
+   unsigned int mColumnSkip;
 };
 
 class CemAlgorithm : public AlgorithmPattern
@@ -52,7 +56,7 @@ class CemAlgorithm : public AlgorithmPattern
       Wavelengths* pWavelengths, std::vector<int>& resampledBands);
    bool canAbort() const;
    bool doAbort();
-   void computeWoper(std::vector<double>& pSpectrum, double* pSmm,
+   void computeWoper(std::vector<double>& pSpectrum, const double* pSmm,
       int numBands, std::vector<double>& pWoper, const std::vector<int>& resampledBands);
 
    RasterElement* mpResults;
@@ -64,20 +68,39 @@ public:
    RasterElement* getResults() const;
 };
 
+/**
+ * Signatures which were resampled to the same set of cube bands.
+ *
+ * The CEM filters of the signatures are stacked so each pixel is read once and
+ * filtered by every signature in the group.
+ */
+struct CemFilterGroup
+{
+   std::vector<int> mResampledBands;
+   std::vector<unsigned int> mSignatureIndices;
+   std::vector<double> mFilters;             // one filter after another, each mResampledBands.size() long
+};
+
 struct CemAlgInput
 {
    CemAlgInput(const RasterElement* pCube,
-      RasterElement* pResultsMatrix,
-      const std::vector<double>& woper,
+      const std::vector<RasterElement*>& resultsMatrices,
+      const std::vector<CemFilterGroup>& groups,
+      unsigned int signatureCount,
       const bool* pAbortFlag,
       const BitMaskIterator& iterCheck,
-      const std::vector<int>& resampledBands) :
+      RasterElement* pPseudocolorMatrix,
+      RasterElement* pHighestValueMatrix,
+      double threshold) :
                mpCube(pCube),
-               mpResultsMatrix(pResultsMatrix),
-               mWoper(woper),
+               mResultsMatrices(resultsMatrices),
+               mGroups(groups),
+               mSignatureCount(signatureCount),
                mCheck(iterCheck),
                mpAbortFlag(pAbortFlag),
-               mResampledBands(resampledBands)
+               mpPseudocolorMatrix(pPseudocolorMatrix),
+               mpHighestValueMatrix(pHighestValueMatrix),
+               mThreshold(threshold)
    {
    }
 
@@ -86,11 +109,14 @@ struct CemAlgInput
    }
 
    const RasterElement* mpCube;
-   RasterElement* mpResultsMatrix;  
-   const std::vector<double>& mWoper;
+   const std::vector<RasterElement*>& mResultsMatrices;  // one per signature, empty when only merging
+   const std::vector<CemFilterGroup>& mGroups;
+   unsigned int mSignatureCount;
    const bool* mpAbortFlag;
    const BitMaskIterator& mCheck;
-   const std::vector<int>& mResampledBands;
+   RasterElement* mpPseudocolorMatrix;    // NULL unless results are merged in to a pseudocolor layer
+   RasterElement* mpHighestValueMatrix;
+   double mThreshold;
 };
 
 class CemThread : public mta::AlgorithmThread
@@ -123,6 +149,8 @@ public:
    Cem();
    ~Cem();
    SETTING(CemHelp, SpectralContextSensitiveHelp, std::string, "");
+   SETTING(SecondMomentRowSkip, Cem, unsigned int, 1);
+   SETTING(SecondMomentColumnSkip, Cem, unsigned int, 1);
 
 private:
    bool canRunBatch() const { return true; }
@@ -7,10 +7,8 @@
  * http://www.gnu.org/licenses/lgpl.html
  */
 
-#include "AoiElement.h"
-#include "AoiLayer.h"
 #include "AppVerify.h"
-#include "BitMaskIterator.h"
+#include "ColorType.h"
 #include "DataAccessor.h"
 #include "DataAccessorImpl.h"
 #include "DataElementGroup.h"
@@ -31,24 +29,530 @@
 #include "PseudocolorLayer.h"
 #include "RasterDataDescriptor.h"
 #include "RasterUtilities.h"
+#include "Resampler.h"
 #include "Signature.h"
+#include "SignatureDataDescriptor.h"
 #include "SignatureSet.h"
 #include "SignatureSelector.h"
 #include "SpatialDataView.h"
+#include "SpectralKernels.h"
 #include "SpectralUtilities.h"
 #include "SpectralVersion.h"
+#include "switchOnEncoding.h"
+#include "Wavelengths.h"
 
+#include <QtCore/QtConcurrentMap>
+#include <QtCore/QPair>
+#include <QtCore/QThread>
 #include <QtCore/QTime>
 #include <QtCore/QString>
 #include <QtGui/QInputDialog>
 #include <QtGui/QMessageBox>
 
+#include <algorithm>
 #include <limits>
+#include <math.h>
 #include <string>
 #include <vector>
 
 REGISTER_PLUGIN_BASIC(SpectralKMeans, KMeans);
 
+namespace
+{
+   const double sPi = 3.141592654;
+
+   /**
+    * The totals accumulated by one pass of the clustering over a range of rows.
+    *
+    * Entry 0 of the counts and the first row of the sums hold the pixels which match no
+    * centroid, entry k + 1 holds cluster k.  Pixels with no magnitude, such as fill, are also
+    * class 0 in the class map but are only counted in mEmpty since they have no direction.
+    */
+   struct ClusterTotals
+   {
+      ClusterTotals() : mEmpty(0), mChanged(0), mEvaluations(0), mCandidates(0), mValid(true) {}
+
+      std::vector<double> mSums;
+      std::vector<int> mCounts;
+      int mEmpty;
+      int mChanged;
+      qulonglong mEvaluations;
+      qulonglong mCandidates;
+      bool mValid;
+   };
+
+   void clusterReduce(ClusterTotals& final, const ClusterTotals& partial)
+   {
+      if (final.mCounts.empty())
+      {
+         final = partial;
+         return;
+      }
+      for (std::vector<double>::size_type index = 0; index < final.mSums.size(); ++index)
+      {
+         final.mSums[index] += partial.mSums[index];
+      }
+      for (std::vector<int>::size_type index = 0; index < final.mCounts.size(); ++index)
+      {
+         final.mCounts[index] += partial.mCounts[index];
+      }
+      final.mEmpty += partial.mEmpty;
+      final.mChanged += partial.mChanged;
+      final.mEvaluations += partial.mEvaluations;
+      final.mCandidates += partial.mCandidates;
+      final.mValid = final.mValid && partial.mValid;
+   }
+
+   // the spectral angle in radians, or pi when either spectrum has no magnitude
+   template<class T>
+   double getAngle(const T* pData, double dataMag, const double* pCentroid, double centroidMag, unsigned int bands)
+   {
+      if (dataMag == 0.0 || centroidMag == 0.0)
+      {
+         return sPi;
+      }
+      double cosine = SpectralKernels::dotProduct(pData, pCentroid, bands) / (dataMag * centroidMag);
+      return acos(std::max(-1.0, std::min(cosine, 1.0)));
+   }
+
+   /**
+    * The bounds kept between passes to skip most of the angle evaluations (Hamerly's algorithm).
+    *
+    * The spectral angle is a metric on the directions of the spectra, so the angle from a pixel to
+    * its nearest centroid grows by at most the angle that centroid moved, and the angle to every
+    * other centroid shrinks by at most the largest angle any of them moved.  A pixel keeps its
+    * centroid without evaluating the others while its upper bound is below both its lower bound
+    * and half the angle from its centroid to the closest other centroid.
+    */
+   struct ClusterBounds
+   {
+      ClusterBounds(std::vector<float>::size_type pixels) :
+            mNearest(pixels, 0),
+            mUpper(pixels, 0.0f),
+            mLower(pixels, 0.0f),
+            mPrune(false)
+      {
+      }
+
+      /**
+       * Prepares the per-centroid bounds for the next pass.
+       *
+       * The drifts must hold the angle each centroid moved in the last update, with pi for
+       * centroids which are new.  Pruning is disabled for the first pass, when no pixels are
+       * tracked.  Centroids with no magnitude are never nearest to a pixel, so they are left out
+       * of the drifts and separations and their half separation is 0 so no pixel is pruned to them.
+       */
+      void prepare(const std::vector<double>& centroids, const std::vector<double>& magnitudes, unsigned int bands,
+         bool firstPass)
+      {
+         const unsigned int clusters = magnitudes.size();
+         mDrifts.resize(clusters, sPi);
+         mPrune = !firstPass && !mNearest.empty();
+
+         // every pixel's lower bound drops by the largest drift of the centroids other than its own
+         double largestDrift = 0.0;
+         double secondLargest = 0.0;
+         unsigned int largest = 0;
+         for (unsigned int cluster = 0; cluster < clusters; ++cluster)
+         {
+            if (magnitudes[cluster] == 0.0)
+            {
+               continue;
+            }
+            if (mDrifts[cluster] > largestDrift)
+            {
+               secondLargest = largestDrift;
+               largestDrift = mDrifts[cluster];
+               largest = cluster;
+            }
+            else
+            {
+               secondLargest = std::max(secondLargest, mDrifts[cluster]);
+            }
+         }
+         mOtherDrifts.assign(clusters, largestDrift);
+         if (clusters > 0)
+         {
+            mOtherDrifts[largest] = secondLargest;
+         }
+
+         mHalfSeparations.assign(clusters, sPi);
+         for (unsigned int first = 0; first < clusters; ++first)
+         {
+            if (magnitudes[first] == 0.0)
+            {
+               mHalfSeparations[first] = 0.0;
+               continue;
+            }
+            for (unsigned int second = first + 1; second < clusters; ++second)
+            {
+               if (magnitudes[second] == 0.0)
+               {
+                  continue;
+               }
+               double halfAngle = 0.5 * getAngle(&centroids[first * bands], magnitudes[first],
+                  &centroids[second * bands], magnitudes[second], bands);
+               mHalfSeparations[first] = std::min(mHalfSeparations[first], halfAngle);
+               mHalfSeparations[second] = std::min(mHalfSeparations[second], halfAngle);
+            }
+         }
+      }
+
+      std::vector<unsigned short> mNearest;
+      std::vector<float> mUpper;
+      std::vector<float> mLower;
+      std::vector<double> mDrifts;
+      std::vector<double> mOtherDrifts;
+      std::vector<double> mHalfSeparations;
+      bool mPrune;
+   };
+
+   /**
+    * Assigns each pixel in a range of rows to the centroid with the smallest spectral angle.
+    *
+    * The class of each pixel is written to the class map and the pixel is added to the sums
+    * of its cluster.  Each range accumulates its own totals, which are summed by clusterReduce(),
+    * so the workers share nothing but the read-only centroids and the bounds of their own pixels.
+    */
+   struct ClusterAssignMap
+   {
+      typedef QPair<int, int> input_type;
+      typedef ClusterTotals result_type;
+
+      RasterElement* mpElement;
+      RasterElement* mpClassMap;
+      const RasterDataDescriptor* mpDesc;
+      const std::vector<double>& mCentroids;
+      const std::vector<double>& mMagnitudes;
+      ClusterBounds& mBounds;
+      double mThreshold;
+      unsigned int mBands;
+      unsigned int mClusters;
+
+      ClusterAssignMap(RasterElement* pElement, RasterElement* pClassMap, const std::vector<double>& centroids,
+            const std::vector<double>& magnitudes, ClusterBounds& bounds, double threshold) :
+               mpElement(pElement),
+               mpClassMap(pClassMap),
+               mCentroids(centroids),
+               mMagnitudes(magnitudes),
+               mBounds(bounds),
+               mThreshold(threshold)
+      {
+         mpDesc = static_cast<const RasterDataDescriptor*>(mpElement->getDataDescriptor());
+         mBands = mpDesc->getBandCount();
+         mClusters = mMagnitudes.size();
+      }
+
+      result_type operator()(const input_type& rows)
+      {
+         ClusterTotals totals;
+         totals.mSums.resize((mClusters + 1) * mBands, 0.0);
+         totals.mCounts.resize(mClusters + 1, 0);
+
+         FactoryResource<DataRequest> pReq;
+         pReq->setInterleaveFormat(BIP);
+         pReq->setRows(mpDesc->getActiveRow(rows.first), mpDesc->getActiveRow(rows.second));
+         DataAccessor acc(mpElement->getDataAccessor(pReq.release()));
+
+         const RasterDataDescriptor* pClassDesc = static_cast<const RasterDataDescriptor*>(
+            mpClassMap->getDataDescriptor());
+         FactoryResource<DataRequest> pClassReq;
+         pClassReq->setRows(pClassDesc->getActiveRow(rows.first), pClassDesc->getActiveRow(rows.second));
+         pClassReq->setWritable(true);
+         DataAccessor classAcc(mpClassMap->getDataAccessor(pClassReq.release()));
+         if (!acc.isValid() || !classAcc.isValid())
+         {
+            totals.mValid = false;
+            return totals;
+         }
+
+         switchOnEncoding(mpDesc->getDataType(), assignRows, NULL, acc, classAcc, rows, totals);
+         return totals;
+      }
+
+      template<class T>
+      void assignRows(const T* pDummy, DataAccessor& acc, DataAccessor& classAcc, const input_type& rows,
+         ClusterTotals& totals)
+      {
+         const unsigned int columns = mpDesc->getColumnCount();
+         for (int row = rows.first; row <= rows.second; ++row)
+         {
+            for (unsigned int col = 0; col < columns; ++col)
+            {
+               const T* pData = reinterpret_cast<const T*>(acc->getColumn());
+               unsigned short* pClass = reinterpret_cast<unsigned short*>(classAcc->getColumn());
+               if (pData == NULL || pClass == NULL)
+               {
+                  totals.mValid = false;
+                  return;
+               }
+
+               unsigned short classValue = 0;
+               double pixelMag = sqrt(SpectralKernels::sumOfSquares(pData, mBands));
+               if (pixelMag == 0.0)
+               {
+                  ++totals.mEmpty;
+               }
+               else
+               {
+                  std::vector<float>::size_type pixel = static_cast<std::vector<float>::size_type>(row) * columns + col;
+                  double upper = 0.0;
+                  unsigned short nearest = findNearest(pData, pixelMag, pixel, upper, totals);
+                  if (upper <= mThreshold)
+                  {
+                     classValue = nearest + 1;
+                  }
+
+                  double* pSums = &totals.mSums[classValue * mBands];
+                  for (unsigned int band = 0; band < mBands; ++band)
+                  {
+                     pSums[band] += pData[band];
+                  }
+                  ++totals.mCounts[classValue];
+               }
+
+               if (*pClass != classValue)
+               {
+                  ++totals.mChanged;
+                  *pClass = classValue;
+               }
+
+               acc->nextColumn();
+               classAcc->nextColumn();
+            }
+            acc->nextRow();
+            classAcc->nextRow();
+         }
+      }
+
+      // finds the nearest centroid of a pixel and an upper bound on the angle to it which is exact whenever it
+      // exceeds the threshold
+      template<class T>
+      unsigned short findNearest(const T* pData, double pixelMag, std::vector<float>::size_type pixel, double& upper,
+         ClusterTotals& totals)
+      {
+         totals.mCandidates += mClusters;
+         unsigned short nearest = 0;
+         if (mBounds.mPrune && mMagnitudes[mBounds.mNearest[pixel]] != 0.0)
+         {
+            nearest = mBounds.mNearest[pixel];
+            upper = mBounds.mUpper[pixel] + mBounds.mDrifts[nearest];
+            double lower = std::max(0.0, mBounds.mLower[pixel] - mBounds.mOtherDrifts[nearest]);
+            double bound = std::max(mBounds.mHalfSeparations[nearest], lower);
+            if (upper > bound || upper > mThreshold)
+            {
+               upper = getAngle(pData, pixelMag, &mCentroids[nearest * mBands], mMagnitudes[nearest], mBands);
+               ++totals.mEvaluations;
+            }
+            if (upper <= bound)
+            {
+               mBounds.mUpper[pixel] = static_cast<float>(upper);
+               mBounds.mLower[pixel] = static_cast<float>(lower);
+               return nearest;
+            }
+         }
+
+         double best = std::numeric_limits<double>::max();
+         double second = std::numeric_limits<double>::max();
+         for (unsigned int cluster = 0; cluster < mClusters; ++cluster)
+         {
+            if (mMagnitudes[cluster] == 0.0)
+            {
+               continue;
+            }
+            double angle = getAngle(pData, pixelMag, &mCentroids[cluster * mBands], mMagnitudes[cluster], mBands);
+            ++totals.mEvaluations;
+            if (angle < best)
+            {
+               second = best;
+               best = angle;
+               nearest = static_cast<unsigned short>(cluster);
+            }
+            else if (angle < second)
+            {
+               second = angle;
+            }
+         }
+         upper = best;
+         if (!mBounds.mNearest.empty())
+         {
+            mBounds.mNearest[pixel] = nearest;
+            mBounds.mUpper[pixel] = static_cast<float>(best);
+            mBounds.mLower[pixel] = static_cast<float>(second);
+         }
+         return nearest;
+      }
+   };
+
+   // the number of pixels sampled to seed the clusters, unless more are needed for the cluster count
+   const unsigned int sSeedSamples = 20000;
+
+   // a uniform random number in [0, 1) with finer steps than a single qrand() call
+   double getRandomFraction()
+   {
+      const double range = RAND_MAX + 1.0;
+      return (qrand() * range + qrand()) / (range * range);
+   }
+
+   template<class T>
+   void copySpectrum(const T* pData, double* pSpectrum, unsigned int bands)
+   {
+      for (unsigned int band = 0; band < bands; ++band)
+      {
+         pSpectrum[band] = pData[band];
+      }
+   }
+
+   /**
+    * Reads the spectra of pixels picked at random, with replacement, from the raster element.
+    *
+    * The pixels are read in raster order so the accessor only moves forward through the data.
+    */
+   bool getPixelSample(RasterElement* pElement, unsigned int count, std::vector<double>& spectra,
+      std::vector<Opticks::PixelLocation>& locations)
+   {
+      const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+      VERIFY(pDesc != NULL);
+      const unsigned int bands = pDesc->getBandCount();
+      const unsigned int columns = pDesc->getColumnCount();
+      const double pixelCount = static_cast<double>(pDesc->getRowCount()) * columns;
+
+      std::vector<qulonglong> indices(count);
+      for (std::vector<qulonglong>::iterator index = indices.begin(); index != indices.end(); ++index)
+      {
+         *index = std::min(static_cast<qulonglong>(getRandomFraction() * pixelCount),
+            static_cast<qulonglong>(pixelCount) - 1);
+      }
+      std::sort(indices.begin(), indices.end());
+
+      FactoryResource<DataRequest> pReq;
+      pReq->setInterleaveFormat(BIP);
+      DataAccessor acc(pElement->getDataAccessor(pReq.release()));
+      if (!acc.isValid())
+      {
+         return false;
+      }
+
+      spectra.resize(static_cast<std::vector<double>::size_type>(count) * bands);
+      locations.clear();
+      for (unsigned int sample = 0; sample < count; ++sample)
+      {
+         Opticks::PixelLocation location(static_cast<int>(indices[sample] % columns),
+            static_cast<int>(indices[sample] / columns));
+         acc->toPixel(location.mY, location.mX);
+         if (!acc.isValid())
+         {
+            return false;
+         }
+         switchOnEncoding(pDesc->getDataType(), copySpectrum, acc->getColumn(), &spectra[sample * bands], bands);
+         locations.push_back(location);
+      }
+      return true;
+   }
+
+   /**
+    * Converts a signature to a centroid over the bands of the raster element.
+    *
+    * Signatures from the raster element are used as is, all others are resampled to the
+    * wavelengths of the raster element and must cover every band.
+    */
+   bool getCentroid(Signature* pSignature, RasterElement* pElement, const Wavelengths* pWavelengths,
+      std::vector<double>& centroid, std::string& errorMessage)
+   {
+      VERIFY(pSignature != NULL && pElement != NULL && pWavelengths != NULL);
+      const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+      VERIFY(pDesc != NULL);
+      std::vector<double> reflectances =
+         dv_cast<std::vector<double> >(pSignature->getData("Reflectance"), std::vector<double>());
+      if (reflectances.size() == pDesc->getBandCount() &&
+         (pSignature->getParent() == pElement || pWavelengths->isEmpty()))
+      {
+         centroid = reflectances;
+         return true;
+      }
+      if (pWavelengths->isEmpty())
+      {
+         errorMessage = "The data set wavelengths are invalid.";
+         return false;
+      }
+
+      PlugInResource resampler("Resampler");
+      Resampler* pResampler = dynamic_cast<Resampler*>(resampler.get());
+      if (pResampler == NULL)
+      {
+         errorMessage = "The resampler plug-in could not be created.";
+         return false;
+      }
+      std::vector<int> resampledBands;
+      if (!pResampler->execute(reflectances, centroid,
+         dv_cast<std::vector<double> >(pSignature->getData("Wavelength"), std::vector<double>()),
+         pWavelengths->getCenterValues(), pWavelengths->getFwhm(), resampledBands, errorMessage))
+      {
+         errorMessage = "Resampling failed: " + errorMessage;
+         return false;
+      }
+      if (resampledBands.size() != pDesc->getBandCount())
+      {
+         errorMessage = "The signature " + pSignature->getName() + " does not cover every band of the data set.";
+         return false;
+      }
+      return true;
+   }
+
+   SignatureSet* createCentroidSet(const std::string& name, unsigned int iterationNumber,
+      const std::vector<double>& centroids, RasterElement* pElement, DataElement* pParent)
+   {
+      Service<ModelServices> pModel;
+      ModelResource<SignatureSet> pSignatureSet(dynamic_cast<SignatureSet*>(
+         pModel->createElement(name, TypeConverter::toString<SignatureSet>(), pParent)));
+      if (pSignatureSet.get() == NULL)
+      {
+         return NULL;
+      }
+
+      const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+      VERIFYRV(pDesc != NULL, NULL);
+      const unsigned int bands = pDesc->getBandCount();
+      FactoryResource<Wavelengths> pWavelengths;
+      pWavelengths->initializeFromDynamicObject(pElement->getMetadata(), false);
+      std::vector<double> wavelengthData = pWavelengths->getCenterValues();
+      if (wavelengthData.size() != bands)
+      {
+         wavelengthData.clear();
+      }
+      std::vector<unsigned int> bandNumbers;
+      const std::vector<DimensionDescriptor>& bandDescriptors = pDesc->getBands();
+      for (std::vector<DimensionDescriptor>::const_iterator band = bandDescriptors.begin();
+         band != bandDescriptors.end(); ++band)
+      {
+         if (band->isActiveNumberValid())
+         {
+            bandNumbers.push_back(band->getActiveNumber());
+         }
+      }
+
+      for (std::vector<double>::size_type first = 0; first < centroids.size(); first += bands)
+      {
+         ModelResource<Signature> pSignature(dynamic_cast<Signature*>(pModel->createElement(
+            QString("K-Means Iteration %1: Centroid %2").arg(iterationNumber).arg(first / bands + 1).toStdString(),
+            TypeConverter::toString<Signature>(), pSignatureSet.get())));
+         if (pSignature.get() == NULL)
+         {
+            return NULL;
+         }
+         pSignature->setData("BandNumber", bandNumbers);
+         pSignature->setData("Reflectance",
+            std::vector<double>(centroids.begin() + first, centroids.begin() + first + bands));
+         pSignature->setData("Wavelength", wavelengthData);
+         SignatureDataDescriptor* pSigDesc = dynamic_cast<SignatureDataDescriptor*>(pSignature->getDataDescriptor());
+         VERIFYRV(pSigDesc != NULL, NULL);
+         pSigDesc->setUnits("Reflectance", pDesc->getUnits());
+         pSignatureSet->insertSignature(pSignature.release());
+      }
+      return pSignatureSet.release();
+   }
+}
+
 KMeans::KMeans()
 {
    setName("K-Means");
@@ -80,13 +584,18 @@ bool KMeans::getInputSpecification(PlugInArgList*& pInArgList)
       "Setting this value to 0 forces the algorithm to run until convergence (which may never occur). "
       "Default is 10."));
    VERIFY(pInArgList->addArg<unsigned int>("Cluster Count", static_cast<unsigned int>(0),
-      "Determines how many clusters should be created from random points in the raster element. "
+      "Determines how many clusters should be seeded with k-means++ from a random sample of the raster element. "
       "The total number of clusters used will be the sum of this argument and the number of signatures selected by the "
       "user if the \"Select Signatures\" argument is set to true (interactive mode) or the signatures specified by the "
       "\"Initial Signatures\" argument (batch mode)."
       "Default is 0."));
+   VERIFY(pInArgList->addArg<unsigned int>("Mini-Batch Size", static_cast<unsigned int>(0),
+      "If nonzero, each iteration updates the centroids from this many randomly sampled pixels instead of the "
+      "whole raster element, and the raster element is classified once after the last iteration. "
+      "This requires a nonzero \"Max Iterations\" argument. "
+      "Default is 0."));
    VERIFY(pInArgList->addArg<bool>("Keep Intermediate Results", false,
-      "Determines whether to keep or discard intermediate results. "
+      "Determines whether to keep or discard the centroids of intermediate iterations. "
       "Default is to discard intermediate results."));
    VERIFY(pInArgList->addArg<std::string>("Results Name", "K-Means Results",
       "Determines the name for the results of the classification. "
@@ -187,6 +696,9 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
    unsigned int clusterCount;
    VERIFY(pInArgList->getPlugInArgValue("Cluster Count", clusterCount) == true);
 
+   unsigned int miniBatchSize;
+   VERIFY(pInArgList->getPlugInArgValue("Mini-Batch Size", miniBatchSize) == true);
+
    bool keepIntermediateResults;
    VERIFY(pInArgList->getPlugInArgValue("Keep Intermediate Results", keepIntermediateResults) == true);
 
@@ -210,8 +722,8 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
    // The results name is handled later (but only when a conflict occurs).
    if (isBatch() == false)
    {
-      KMeansDlg kMeansDlg(threshold, convergenceThreshold, maxIterations, clusterCount, selectSignatures,
-         keepIntermediateResults, Service<DesktopServices>()->getMainWidget());
+      KMeansDlg kMeansDlg(threshold, convergenceThreshold, maxIterations, clusterCount, miniBatchSize,
+         selectSignatures, keepIntermediateResults, Service<DesktopServices>()->getMainWidget());
       if (kMeansDlg.exec() != QDialog::Accepted)
       {
          progress.report("Unable to obtain input parameters.", 0, ABORT, true);
@@ -222,10 +734,17 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
       convergenceThreshold = kMeansDlg.getConvergenceThreshold();
       maxIterations = kMeansDlg.getMaxIterations();
       clusterCount = kMeansDlg.getClusterCount();
+      miniBatchSize = kMeansDlg.getMiniBatchSize();
       selectSignatures = kMeansDlg.getSelectSignatures();
       keepIntermediateResults = kMeansDlg.getKeepIntermediateResults();
    }
 
+   if (miniBatchSize != 0 && maxIterations == 0)
+   {
+      progress.report("Mini-batch K-Means requires a maximum number of iterations.", 0, ERRORS, true);
+      return false;
+   }
+
    // Determine the initial signatures to use.
    // For this particular K-Means implementation, centroids are signatures, meaning that we are using spectral distance
    // as measured by SAM and not (e.g.) Euclidean distance.
@@ -263,29 +782,106 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
       signatures.insert(signatures.end(), moreSignatures.begin(), moreSignatures.end());
    }
 
+   // Convert the signatures into centroids over the bands of the raster element.
+   // The centroids are stored one after another so each pass can score them without any lookups.
+   FactoryResource<Wavelengths> pWavelengths;
+   pWavelengths->initializeFromDynamicObject(pRasterElement->getMetadata(), false);
+   const unsigned int bands = pDescriptor->getBandCount();
+   std::vector<double> centroids;
+   for (std::vector<Signature*>::const_iterator iter = signatures.begin(); iter != signatures.end(); ++iter)
+   {
+      std::vector<double> centroid;
+      std::string errorMessage;
+      if (getCentroid(*iter, pRasterElement, pWavelengths.get(), centroid, errorMessage) == false)
+      {
+         progress.report(errorMessage, 0, ERRORS, true);
+         return false;
+      }
+
+      centroids.insert(centroids.end(), centroid.begin(), centroid.end());
+   }
+
+   qsrand(QTime::currentTime().msec());
    if (clusterCount != 0)
    {
-      // Get signatures for random pixels.
-      // These signatures will remain loaded after K-Means exits.
-      // This enables the user to determine which pixels were used for the classification.
-      qsrand(QTime::currentTime().msec());
+      // Seed the remaining clusters with k-means++ over a random sample of pixels.
+      // Each seed is drawn with a probability proportional to its squared angle from the nearest centroid so far,
+      // which spreads the seeds across the scene.
+      progress.report("Seeding clusters", 0, NORMAL);
+      std::vector<double> samples;
+      std::vector<Opticks::PixelLocation> locations;
+      if (getPixelSample(pRasterElement, std::max(sSeedSamples, 100 * clusterCount), samples, locations) == false)
+      {
+         progress.report("Unable to access data.", 0, ERRORS, true);
+         return false;
+      }
+
+      std::vector<double> centroidMags;
+      for (std::vector<double>::size_type first = 0; first < centroids.size(); first += bands)
+      {
+         centroidMags.push_back(sqrt(SpectralKernels::sumOfSquares(&centroids[first], bands)));
+      }
+      std::vector<double> sampleMags;
+      std::vector<double> nearestAngles;
+      for (std::vector<double>::size_type first = 0; first < samples.size(); first += bands)
+      {
+         sampleMags.push_back(sqrt(SpectralKernels::sumOfSquares(&samples[first], bands)));
+         double nearest = sPi;
+         for (std::vector<double>::size_type centroid = 0; centroid < centroidMags.size(); ++centroid)
+         {
+            nearest = std::min(nearest, getAngle(&samples[first], sampleMags.back(), &centroids[centroid * bands],
+               centroidMags[centroid], bands));
+         }
+         // pixels without a direction can't seed a cluster
+         nearestAngles.push_back(sampleMags.back() == 0.0 ? 0.0 : nearest);
+      }
+
       for (unsigned int i = 0; i < clusterCount; ++i)
       {
-         Opticks::PixelLocation location(rand() % pDescriptor->getColumnCount(), rand() % pDescriptor->getRowCount());
-         Signature* pSignature = SpectralUtilities::getPixelSignature(pRasterElement, location);
+         double total = 0.0;
+         for (std::vector<double>::const_iterator angle = nearestAngles.begin(); angle != nearestAngles.end(); ++angle)
+         {
+            total += *angle * *angle;
+         }
+         if (total <= 0.0)
+         {
+            break;
+         }
+
+         std::vector<double>::size_type seed = 0;
+         double target = getRandomFraction() * total;
+         for (; seed + 1 < nearestAngles.size(); ++seed)
+         {
+            target -= nearestAngles[seed] * nearestAngles[seed];
+            if (target < 0.0)
+            {
+               break;
+            }
+         }
 
-         if (pSignature == NULL)
+         // These signatures will remain loaded after K-Means exits.
+         // This enables the user to determine which pixels were used for the classification.
+         if (SpectralUtilities::getPixelSignature(pRasterElement, locations[seed]) == NULL)
          {
             progress.report("Failed to get pixel signature.", 0, ERRORS, true);
             return false;
          }
 
-         signatures.push_back(pSignature);
+         const double* pSeed = &samples[seed * bands];
+         centroids.insert(centroids.end(), pSeed, pSeed + bands);
+         for (std::vector<double>::size_type sample = 0; sample < nearestAngles.size(); ++sample)
+         {
+            if (sampleMags[sample] != 0.0)
+            {
+               nearestAngles[sample] = std::min(nearestAngles[sample], getAngle(&samples[sample * bands],
+                  sampleMags[sample], pSeed, sampleMags[seed], bands));
+            }
+         }
       }
    }
 
    // There is no sense running a classification algorithm with only one cluster, so check for that now.
-   if (signatures.size()  < 2)
+   if (centroids.size() < 2 * bands)
    {
       progress.report("Unable to run K-Means with fewer than 2 clusters.", 0, ERRORS, true);
       return false;
@@ -301,20 +897,6 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
    }
    const int convergenceCount = static_cast<int>(convergenceCountRaw);
 
-   // Maintain a count of how many pixels belonged to each class.
-   // This is used alongside the convergenceCount to determine convergence.
-   std::vector<int> signatureCounts(signatures.size(), 0);
-
-   // Load the SAM plug-in, and keep it loaded throughout execution.
-   // This improves performance dramatically.
-   // Note: SAM is hard-coded here (cf. configurable) because certain assumptions are made about its behavior.
-   ExecutableResource pSam("SAM", std::string(), progress.getCurrentProgress());
-   if (pSam.get() == NULL)
-   {
-      progress.report("SAM is not available.", 0, ERRORS, true);
-      return false;
-   }
-
    // Check for previous results, and prompt to delete them if they exist.
    // This is a while and not a simple if to prevent the user from re-entering a name which was already used.
    ModelResource<DataElementGroup> pResultElement(dynamic_cast<DataElementGroup*>(Service<ModelServices>()->getElement(
@@ -369,225 +951,271 @@ bool KMeans::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
       return false;
    }
 
-   // Initialize signatures.
-   ModelResource<SignatureSet> pSignatureSet(dynamic_cast<SignatureSet*>(Service<ModelServices>()->createElement(
-      "Centroids for Iteration 1", TypeConverter::toString<SignatureSet>(), pResultElement.get())));
-   if (pSignatureSet.get() == NULL)
-   {
-      progress.report("Unable to create signature set.", 0, ERRORS, true);
-      return false;
-   }
-
-   // Iterations are 1-based since they are displayed to the user.
-   for (unsigned int iterationNumber = 1; maxIterations == 0 || iterationNumber <= maxIterations; ++iterationNumber)
+   // Only the final classification is materialized. Each pass writes the class of every pixel to it so the
+   // number of pixels which changed clusters can be counted without keeping a copy of the previous pass.
+   // Class 0 holds the pixels which did not match any centroid within the SAM threshold.
+   const unsigned int numRows = pDescriptor->getRowCount();
+   const unsigned int numColumns = pDescriptor->getColumnCount();
+   ModelResource<RasterElement> pClassMap(RasterUtilities::createRasterElement(resultsName + " Element",
+      numRows, numColumns, INT2UBYTES, true, pResultElement.get()));
+   if (pClassMap.get() == NULL)
    {
-      if (isAborted() == true)
-      {
-         progress.report("User Aborted.", 0, ABORT, true);
-         return false;
-      }
-
-      // Insert the signatures into the signature set.
-      if (pSignatureSet->insertSignatures(signatures) == false)
-      {
-         progress.report("Unable to add signatures to signature set.", 0, ERRORS, true);
-         return false;
-      }
-
-      // Call SAM. The Signature Set and most of the other parameters should have been set up
-      // already (either before the loop or in the last iteration).
-      PlugInArgList& samInput = pSam->getInArgList();
-      std::string samResultsName = resultsName + QString(" for Iteration %1").arg(iterationNumber).toStdString();
-      bool samSuccess = samInput.setPlugInArgValue<Signature>("Target Signatures", pSignatureSet.get());
-      samSuccess &= samInput.setPlugInArgValue<RasterElement>(DataElementArg(), pRasterElement);
-      samSuccess &= samInput.setPlugInArgValue<std::string>("Results Name", &samResultsName);
-      samSuccess &= samInput.setPlugInArgValue<double>("Threshold", &threshold);
-      samSuccess &= samInput.setPlugInArgValue<bool>("Display Results", &samSuccess);
-      samSuccess &= pSam->execute();
-      if (samSuccess == false)
-      {
-         progress.report("SAM failed to execute.", 0, ERRORS, true);
-         return false;
-      }
-
-      PlugInArgList& samOutput = pSam->getOutArgList();
-      RasterElement* pSamResults = samOutput.getPlugInArgValue<RasterElement>("Sam Results");
-      if (pSamResults == NULL)
-      {
-         progress.report("SAM failed to return valid results.", 0, ERRORS, true);
-         return false;
-      }
-
-      // Retrieve the SAM pseudocolor result layer.
-      // This relies on the SAM implementation creating a layer, which it cannot do in application batch mode.
-      LayerList* pLayerList = pView->getLayerList();
-      if (pLayerList == NULL)
+      pClassMap = ModelResource<RasterElement>(RasterUtilities::createRasterElement(resultsName + " Element",
+         numRows, numColumns, INT2UBYTES, false, pResultElement.get()));
+      if (pClassMap.get() == NULL)
       {
-         progress.report("Failed to access SAM results layer list.", 0, ERRORS, true);
+         progress.report("Unable to create result element.", 0, ERRORS, true);
          return false;
       }
+   }
 
-      PseudocolorLayer* pSamLayer = dynamic_cast<PseudocolorLayer*>(pLayerList->getLayer(PSEUDOCOLOR, pSamResults));
-      if (pSamLayer == NULL)
-      {
-         // The assumption that SAM will create a pseudocolor layer when the number of signatures is greater than two
-         // was broken. Did the SAM implementation change?
-         progress.report("Failed to access SAM results layer.", 0, ERRORS, true);
-         return false;
-      }
+   // A few ranges of rows per thread balance the load.
+   const int blockHeight = std::max(1, static_cast<int>(numRows) / (4 * std::max(1, QThread::idealThreadCount())));
+   QList<QPair<int, int> > blocks;
+   for (int row = 0; row < static_cast<int>(numRows); row += blockHeight)
+   {
+      blocks.push_back(qMakePair(row, std::min(static_cast<int>(numRows) - 1, row + blockHeight - 1)));
+   }
 
-      // Failure to reparent is not fatal.
-      // Results will just look weird, so ignore the return value here.
-      Service<ModelServices>()->setElementParent(pSamLayer->getDataElement(), pResultElement.get());
+   // The angles are compared in radians.
+   const double angleThreshold = std::min(threshold, 180.0) * sPi / 180.0;
 
-      // Force a new signature set to be created.
-      // This does not simply clear old signatures because the user might have specified to keep them.
-      ModelResource<SignatureSet> pNewSignatureSet(dynamic_cast<SignatureSet*>(
-         Service<ModelServices>()->createElement(
-         QString("Centroids for Iteration %1").arg(iterationNumber + 1).toStdString(),
-         TypeConverter::toString<SignatureSet>(), pResultElement.get())));
-      if (pNewSignatureSet.get() == NULL)
-      {
-         progress.report("Unable to create new signature set.", 0, ERRORS, true);
-         return false;
-      }
+   // The bounds cost 10 bytes per pixel and let later passes skip most of the angle evaluations.
+   // Mini-batch mode only makes a single full pass so it does not track them.
+   ClusterBounds bounds(miniBatchSize != 0 ? 0 : static_cast<std::vector<float>::size_type>(numRows) * numColumns);
 
-      // Recompute the cluster centroids based on the SAM results, and check for convergence.
-      // There is no need to recompute clusters if this is the last iteration.
-      signatures.clear();
-      bool converged = true;
-      if (iterationNumber != maxIterations)
+   // Iterations are 1-based since they are displayed to the user.
+   unsigned int iterationNumber = 1;
+   if (miniBatchSize != 0)
+   {
+      // Mini-batch mode moves the centroids toward small random batches of pixels and then classifies the whole
+      // scene once, so the iterations never read the full data set.
+      std::vector<int> updates(centroids.size() / bands, 0);
+      for (; iterationNumber <= maxIterations; ++iterationNumber)
       {
-         std::vector<int> classIds;
-         pSamLayer->getClassIDs(classIds);
-
-         // Hide all classes.
-         // Hidden classes will not be converted into an AOI in the next step -- this is crucial.
-         for (std::vector<int>::const_iterator iter = classIds.begin(); iter != classIds.end(); ++iter)
+         if (isAborted() == true)
          {
-            pSamLayer->setClassDisplayed(*iter, false);
+            progress.report("User Aborted.", 0, ABORT, true);
+            return false;
          }
+         progress.report(QString("K-Means Mini-Batch %1 of %2").arg(iterationNumber).arg(maxIterations).toStdString(),
+            (iterationNumber - 1) * 99 / maxIterations, NORMAL);
 
-         // Recompute the number of clusters (deviation from standard K-Means algorithm) as well as the centroids.
-         // To recompute the centroids, do the following for each class:
-         //    - Show the class
-         //    - Create an AOI from the class
-         //    - Use the AOI to compute the average AOI signature of the class
-         //    - Hide the class (so it is excluded from other calculations)
-         //    - Destroy the AOI created from the class
-         for (unsigned int i = 0; i < classIds.size(); ++i)
+         std::vector<double> batch;
+         std::vector<Opticks::PixelLocation> locations;
+         if (getPixelSample(pRasterElement, miniBatchSize, batch, locations) == false)
          {
-            // Display the class so that it will be included in the derived AOI.
-            pSamLayer->setClassDisplayed(classIds[i], true);
+            progress.report("Unable to access data.", 0, ERRORS, true);
+            return false;
+         }
 
-            // Derive an AOI from the pseudocolor layer.
-            AoiLayer* pAoiLayer = dynamic_cast<AoiLayer*>(pView->deriveLayer(pSamLayer, AOI_LAYER));
-            if (pAoiLayer == NULL)
+         // Assign the whole batch before any centroid moves.
+         std::vector<double> magnitudes;
+         for (std::vector<double>::size_type first = 0; first < centroids.size(); first += bands)
+         {
+            magnitudes.push_back(sqrt(SpectralKernels::sumOfSquares(&centroids[first], bands)));
+         }
+         std::vector<int> nearest(miniBatchSize, -1);
+         for (unsigned int sample = 0; sample < miniBatchSize; ++sample)
+         {
+            const double* pPixel = &batch[sample * bands];
+            double pixelMag = sqrt(SpectralKernels::sumOfSquares(pPixel, bands));
+            double best = angleThreshold;
+            for (unsigned int cluster = 0; cluster < magnitudes.size(); ++cluster)
             {
-               progress.report("Failed to derive AOI from pseudocolor layer.", 0, ERRORS, true);
-               return false;
+               double angle = getAngle(pPixel, pixelMag, &centroids[cluster * bands], magnitudes[cluster], bands);
+               if (angle <= best && (nearest[sample] < 0 || angle < best))
+               {
+                  best = angle;
+                  nearest[sample] = static_cast<int>(cluster);
+               }
             }
+         }
 
-            // Use a ModelResource so pAoiLayer gets deleted when pAoiElement goes out of scope.
-            ModelResource<AoiElement> pAoiElement(dynamic_cast<AoiElement*>(pAoiLayer->getDataElement()));
-            if (pAoiElement.get() == NULL)
+         // Each centroid steps toward its pixels with a rate of one over the number of pixels it has seen,
+         // so it is the running mean of every pixel ever assigned to it.
+         for (unsigned int sample = 0; sample < miniBatchSize; ++sample)
+         {
+            if (nearest[sample] < 0 || magnitudes[nearest[sample]] == 0.0)
             {
-               progress.report("Failed to obtain AOI element from layer.", 0, ERRORS, true);
-               return false;
+               continue;
             }
-
-            // Check for empty AOI -- an empty AOI implies that no "Indeterminate" or "No Match" results were found.
-            BitMaskIterator iterator(pAoiElement->getSelectedPoints(), pRasterElement);
-            if (iterator != iterator.end())
+            double rate = 1.0 / ++updates[nearest[sample]];
+            double* pCentroid = &centroids[nearest[sample] * bands];
+            const double* pPixel = &batch[sample * bands];
+            for (unsigned int band = 0; band < bands; ++band)
             {
-               // Compute the average signature for the class.
-               // These signatures will be used next iteration (hence the + 1).
-               ModelResource<Signature> pSignature(dynamic_cast<Signature*>(Service<ModelServices>()->createElement(
-                  QString("K-Means Iteration %1: Centroid %2").arg(iterationNumber + 1).arg(signatures.size() + 1).toStdString(),
-                  TypeConverter::toString<Signature>(), pNewSignatureSet.get())));
-               if (pSignature.get() == NULL)
-               {
-                  progress.report("Failed to create new signature for centroid."
-                     "Please check that previous K-Means results have been deleted and try again.", 0, ERRORS, true);
-                  return false;
-               }
-
-               if (SpectralUtilities::convertAoiToSignature(pAoiElement.get(), pSignature.get(),
-                  pRasterElement, progress.getCurrentProgress(), &mAborted) == false)
-               {
-                  progress.report("Failed to derive AOI from pseudocolor layer.", 0, ERRORS, true);
-                  return false;
-               }
-
-               signatures.push_back(pSignature.release());
+               pCentroid[band] += rate * (pPixel[band] - pCentroid[band]);
             }
+         }
 
-            // Do not check "Indeterminate" or "No Match" groups for convergence.
-            // This checks i < signatureCounts.size() because that is always the value K.
-            if (i < signatureCounts.size())
+         if (keepIntermediateResults == true)
+         {
+            if (createCentroidSet(QString("Centroids for Iteration %1").arg(iterationNumber).toStdString(),
+               iterationNumber, centroids, pRasterElement, pResultElement.get()) == NULL)
             {
-               // Check for convergence by taking the difference of how many pixels belonged to this class last iteration.
-               int count = iterator.getCount();
-               if (abs(count - signatureCounts[i]) > convergenceCount)
-               {
-                  converged = false;
-               }
-
-               signatureCounts[i] = count;
+               progress.report("Unable to create signature set.", 0, ERRORS, true);
+               return false;
             }
-
-            // Hide the layer so it is not included in the next calculation.
-            pSamLayer->setClassDisplayed(classIds[i], false);
          }
+      }
+   }
+
+   // The full passes run until convergence, except in mini-batch mode where a single pass classifies the scene.
+   const unsigned int lastIteration = (miniBatchSize != 0 ? iterationNumber : maxIterations);
+   ClusterTotals totals;
+   for (;; ++iterationNumber)
+   {
+      std::vector<double> magnitudes;
+      for (std::vector<double>::size_type first = 0; first < centroids.size(); first += bands)
+      {
+         magnitudes.push_back(sqrt(SpectralKernels::sumOfSquares(&centroids[first], bands)));
+      }
 
-         // Show all classes.
-         for (std::vector<int>::const_iterator iter = classIds.begin(); iter != classIds.end(); ++iter)
+      // Assign every pixel and accumulate the new cluster sums in one pass.
+      bounds.prepare(centroids, magnitudes, bands, iterationNumber == 1);
+      ClusterAssignMap assignMap(pRasterElement, pClassMap.get(), centroids, magnitudes, bounds, angleThreshold);
+      QFuture<ClusterTotals> pass = QtConcurrent::mappedReduced(blocks, assignMap, clusterReduce,
+         QtConcurrent::UnorderedReduce);
+      const std::string message = QString("K-Means Iteration %1").arg(iterationNumber).toStdString();
+      bool isCancelling = false;
+      while (pass.isRunning())
+      {
+         if (isCancelling)
          {
-            pSamLayer->setClassDisplayed(*iter, true);
+            progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
          }
+         else
+         {
+            progress.report(message, (pass.progressValue() - pass.progressMinimum()) * 99 /
+               std::max(1, pass.progressMaximum() - pass.progressMinimum()), NORMAL);
+            if (isAborted() == true)
+            {
+               pass.cancel();
+               isCancelling = true;
+               setAbortSupported(false);
+            }
+         }
+         QThread::yieldCurrentThread();
+      }
+      if (pass.isCanceled() || isAborted() == true)
+      {
+         progress.report("User Aborted.", 0, ABORT, true);
+         return false;
+      }
+
+      totals = pass.result();
+      if (totals.mValid == false)
+      {
+         progress.report("Unable to access data.", 0, ERRORS, true);
+         return false;
       }
 
+      // Record how many of the pixel to centroid angles the bounds avoided.
+      qulonglong skipped = totals.mCandidates - std::min(totals.mCandidates, totals.mEvaluations);
+      progress.getCurrentStep()->addProperty(QString("Iteration %1").arg(iterationNumber).toStdString(),
+         QString("%1 of %2 angle evaluations skipped").arg(skipped).arg(totals.mCandidates).toStdString());
+
       // Check for convergence (which may have been forced by number of iterations).
-      // On convergence, release, rename, and set the results into the output argument list, and break from the loop.
-      // If there will be another iteration, either hide or delete the results before continuing.
+      // The first pass is compared against an unset class map so it never converges on its own.
+      bool converged = (lastIteration != 0 && iterationNumber >= lastIteration) ||
+         (iterationNumber > 1 && totals.mChanged <= convergenceCount);
       if (converged == true)
       {
-         // Release the resources for the results so they are not deleted and can be checked by the user.
-         pResultElement.release();
-         pSignatureSet.release();
-
-         // Rename the final result layer and its data element.
-         pSamLayer->rename(resultsName + " Layer");
-         Service<ModelServices>()->setElementName(pSamLayer->getDataElement(), resultsName + " Element");
-         Service<ModelServices>()->setElementName(pSignatureSet.get(), resultsName + " Centroids");
+         break;
+      }
 
-         // Set output arguments.
-         if (pOutArgList != NULL)
+      if (keepIntermediateResults == true)
+      {
+         if (createCentroidSet(QString("Centroids for Iteration %1").arg(iterationNumber).toStdString(),
+            iterationNumber, centroids, pRasterElement, pResultElement.get()) == NULL)
          {
-            pOutArgList->setPlugInArgValue<DataElementGroup>("K-Means Results",
-               dynamic_cast<DataElementGroup*>(pResultElement.get()));
-            pOutArgList->setPlugInArgValue<RasterElement>("K-Means Results Element",
-               dynamic_cast<RasterElement*>(pSamLayer->getDataElement()));
-            pOutArgList->setPlugInArgValue<PseudocolorLayer>("K-Means Results Layer", pSamLayer);
+            progress.report("Unable to create signature set.", 0, ERRORS, true);
+            return false;
          }
-
-         break;
       }
-      else
+
+      // Recompute the cluster centroids and how far each one moved. A cluster with no pixels keeps its centroid.
+      bounds.mDrifts.assign(magnitudes.size(), 0.0);
+      for (unsigned int cluster = 0; cluster < magnitudes.size(); ++cluster)
       {
-         if (keepIntermediateResults == true)
+         int count = totals.mCounts[cluster + 1];
+         if (count > 0)
          {
-            pView->hideLayer(pSamLayer);
-            pSignatureSet.release();
+            std::vector<double> previous(centroids.begin() + cluster * bands,
+               centroids.begin() + (cluster + 1) * bands);
+            for (unsigned int band = 0; band < bands; ++band)
+            {
+               centroids[cluster * bands + band] = totals.mSums[(cluster + 1) * bands + band] / count;
+            }
+            bounds.mDrifts[cluster] = getAngle(&previous.front(), magnitudes[cluster], &centroids[cluster * bands],
+               sqrt(SpectralKernels::sumOfSquares(&centroids[cluster * bands], bands)), bands);
          }
-         else
+      }
+
+      // Pixels which matched no centroid form a new cluster (deviation from standard K-Means algorithm).
+      // A mean with no magnitude has no direction to match, so it is not added.
+      if (totals.mCounts[0] > 0 && magnitudes.size() < std::numeric_limits<unsigned short>::max() &&
+         SpectralKernels::sumOfSquares(&totals.mSums.front(), bands) > 0.0)
+      {
+         for (unsigned int band = 0; band < bands; ++band)
          {
-            pView->deleteLayer(pSamLayer);
+            centroids.push_back(totals.mSums[band] / totals.mCounts[0]);
          }
+      }
+   }
+
+   ModelResource<SignatureSet> pSignatureSet(createCentroidSet(resultsName + " Centroids", iterationNumber, centroids,
+      pRasterElement, pResultElement.get()));
+   if (pSignatureSet.get() == NULL)
+   {
+      progress.report("Unable to create signature set.", 0, ERRORS, true);
+      return false;
+   }
 
-         pSignatureSet = ModelResource<SignatureSet>(pNewSignatureSet.release());
+   // Display the classification with a class for each populated cluster.
+   pClassMap->updateData();
+   PseudocolorLayer* pLayer = static_cast<PseudocolorLayer*>(pView->createLayer(PSEUDOCOLOR, pClassMap.get(),
+      resultsName + " Layer"));
+   if (pLayer == NULL)
+   {
+      progress.report("Unable to create results layer.", 0, ERRORS, true);
+      return false;
+   }
+
+   std::vector<ColorType> layerColors;
+   std::vector<ColorType> excludeColors;
+   excludeColors.push_back(ColorType(0, 0, 0));
+   excludeColors.push_back(ColorType(255, 255, 255));
+   ColorType::getUniqueColors(totals.mCounts.size(), layerColors, excludeColors);
+   const std::vector<Signature*> centroidSignatures = pSignatureSet->getSignatures();
+   for (std::vector<int>::size_type classValue = 1; classValue < totals.mCounts.size(); ++classValue)
+   {
+      if (totals.mCounts[classValue] > 0 && classValue <= centroidSignatures.size() &&
+         classValue < layerColors.size())
+      {
+         pLayer->addInitializedClass(centroidSignatures[classValue - 1]->getName(), static_cast<int>(classValue),
+            layerColors[classValue]);
       }
    }
+   if ((totals.mCounts[0] > 0 || totals.mEmpty > 0) && !layerColors.empty())
+   {
+      pLayer->addInitializedClass("No Match", 0, layerColors.front());
+   }
+
+   // Release the resources for the results so they are not deleted and can be checked by the user.
+   pClassMap.release();
+   pSignatureSet.release();
+   DataElementGroup* pResults = pResultElement.release();
+
+   // Set output arguments.
+   if (pOutArgList != NULL)
+   {
+      pOutArgList->setPlugInArgValue<DataElementGroup>("K-Means Results", pResults);
+      pOutArgList->setPlugInArgValue<RasterElement>("K-Means Results Element",
+         dynamic_cast<RasterElement*>(pLayer->getDataElement()));
+      pOutArgList->setPlugInArgValue<PseudocolorLayer>("K-Means Results Layer", pLayer);
+   }
 
    progress.report("K-Means complete", 100, NORMAL);
    progress.upALevel();
@@ -24,14 +24,15 @@
 #include <limits>
 
 KMeansDlg::KMeansDlg(double threshold, double convergenceThreshold, unsigned int maxIterations,
-   unsigned int clusterCount, bool selectSignatures, bool keepIntermediateResults, QWidget* pParent) :
+   unsigned int clusterCount, unsigned int miniBatchSize, bool selectSignatures, bool keepIntermediateResults,
+   QWidget* pParent) :
    QDialog(pParent)
 {
    setModal(true);
    setWindowTitle("K-Means");
 
    QLabel* pThresholdLabel = new QLabel("SAM Threshold", this);
-   pThresholdLabel->setToolTip("This threshold wil be used for each run of the SAM algorithm.");
+   pThresholdLabel->setToolTip("Pixels are only assigned to a centroid within this spectral angle.");
    mpThreshold = new QDoubleSpinBox(this);
    mpThreshold->setValue(threshold);
    mpThreshold->setDecimals(5);
@@ -60,7 +61,7 @@ KMeansDlg::KMeansDlg(double threshold, double convergenceThreshold, unsigned int
    mpMaxIterations->setToolTip(pMaxIterationsLabel->toolTip());
 
    QLabel* pClusterCountLabel = new QLabel("Cluster Count", this);
-   pClusterCountLabel->setToolTip("Determines how many clusters should be created from random points in the data. "
+   pClusterCountLabel->setToolTip("Determines how many clusters should be seeded from a random sample of the data. "
       "This will be in addition to selected signatures if \"Select Signatures\" is checked.");
    mpClusterCount = new QSpinBox(this);
    mpClusterCount->setValue(clusterCount);
@@ -68,6 +69,17 @@ KMeansDlg::KMeansDlg(double threshold, double convergenceThreshold, unsigned int
    mpClusterCount->setMaximum(std::numeric_limits<int>::max());
    mpClusterCount->setToolTip(pClusterCountLabel->toolTip());
 
+   QLabel* pMiniBatchSizeLabel = new QLabel("Mini-Batch Size", this);
+   pMiniBatchSizeLabel->setToolTip("If nonzero, each iteration updates the centroids from this many random pixels "
+      "instead of the whole data set and the data set is classified once after the last iteration. "
+      "This requires \"Max Iterations\".");
+   mpMiniBatchSize = new QSpinBox(this);
+   mpMiniBatchSize->setMinimum(0);
+   mpMiniBatchSize->setMaximum(std::numeric_limits<int>::max());
+   mpMiniBatchSize->setValue(miniBatchSize);
+   mpMiniBatchSize->setSpecialValueText("Off");
+   mpMiniBatchSize->setToolTip(pMiniBatchSizeLabel->toolTip());
+
    mpSelectSignatures = new QCheckBox("Select Signatures", this);
    mpSelectSignatures->setChecked(selectSignatures);
    mpSelectSignatures->setToolTip("Determines whether to select signatures to use. "
@@ -75,7 +87,8 @@ KMeansDlg::KMeansDlg(double threshold, double convergenceThreshold, unsigned int
 
    mpKeepIntermediateResults = new QCheckBox("Keep Intermediate Results", this);
    mpKeepIntermediateResults->setChecked(keepIntermediateResults);
-   mpKeepIntermediateResults->setToolTip("Determines whether to keep or discard intermediate results.");
+   mpKeepIntermediateResults->setToolTip("Determines whether to keep or discard the centroids of intermediate "
+      "iterations.");
 
    QFrame* pLine = new QFrame(this);
    pLine->setFrameStyle(QFrame::HLine | QFrame::Sunken);
@@ -92,11 +105,13 @@ KMeansDlg::KMeansDlg(double threshold, double convergenceThreshold, unsigned int
    pLayout->addWidget(mpMaxIterations, 2, 1);
    pLayout->addWidget(pClusterCountLabel, 3, 0);
    pLayout->addWidget(mpClusterCount, 3, 1);
-   pLayout->addWidget(mpSelectSignatures, 4, 0, 1, 2);
-   pLayout->addWidget(mpKeepIntermediateResults, 5, 0, 1, 2);
-   pLayout->addWidget(pLine, 6, 0, 1, 2);
-   pLayout->addWidget(pButtonBox, 7, 0, 1, 2);
-   pLayout->setRowStretch(8, 10);
+   pLayout->addWidget(pMiniBatchSizeLabel, 4, 0);
+   pLayout->addWidget(mpMiniBatchSize, 4, 1);
+   pLayout->addWidget(mpSelectSignatures, 5, 0, 1, 2);
+   pLayout->addWidget(mpKeepIntermediateResults, 6, 0, 1, 2);
+   pLayout->addWidget(pLine, 7, 0, 1, 2);
+   pLayout->addWidget(pButtonBox, 8, 0, 1, 2);
+   pLayout->setRowStretch(9, 10);
    pLayout->setColumnStretch(2, 10);
    pLayout->setMargin(10);
    pLayout->setSpacing(5);
@@ -141,6 +156,11 @@ unsigned int KMeansDlg::getClusterCount() const
    return static_cast<unsigned int>(mpClusterCount->value());
 }
 
+unsigned int KMeansDlg::getMiniBatchSize() const
+{
+   return static_cast<unsigned int>(mpMiniBatchSize->value());
+}
+
 void KMeansDlg::accept()
 {
    if (getSelectSignatures() == false && getClusterCount() < 2)
@@ -149,5 +169,11 @@ void KMeansDlg::accept()
       return;
    }
 
+   if (getMiniBatchSize() != 0 && getMaxIterations() == 0)
+   {
+      QMessageBox::critical(this, "Error", "Mini-batch K-Means requires a maximum number of iterations.");
+      return;
+   }
+
    QDialog::accept();
 }
@@ -22,7 +22,8 @@ class KMeansDlg : public QDialog
 
 public:
    KMeansDlg(double threshold, double convergenceThreshold, unsigned int maxIterations,
-      unsigned int clusterCount, bool selectSignatures, bool keepIntermediateResults, QWidget* pParent = NULL);
+      unsigned int clusterCount, unsigned int miniBatchSize, bool selectSignatures, bool keepIntermediateResults,
+      QWidget* pParent = NULL);
    virtual ~KMeansDlg();
 
    double getThreshold() const;
@@ -31,6 +32,7 @@ public:
    bool getKeepIntermediateResults() const;
    unsigned int getMaxIterations() const;
    unsigned int getClusterCount() const;
+   unsigned int getMiniBatchSize() const;
 
 public slots:
    void accept();
@@ -40,6 +42,7 @@ private:
    QDoubleSpinBox* mpConvergenceThreshold;
    QSpinBox* mpMaxIterations;
    QSpinBox* mpClusterCount;
+   QSpinBox* mpMiniBatchSize;
    QCheckBox* mpSelectSignatures;
    QCheckBox* mpKeepIntermediateResults;
 };
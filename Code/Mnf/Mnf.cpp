@@ -7,6 +7,9 @@
  * http://www.gnu.org/licenses/lgpl.html
  */
 
+#include <QtCore/QPair>
+#include <QtCore/QtConcurrentMap>
+#include <QtCore/QThread>
 #include <QtGui/QFileDialog>
 #include <QtGui/QMessageBox>
 
@@ -42,6 +45,7 @@
 #include "RasterUtilities.h"
 #include "SpatialDataView.h"
 #include "SpatialDataWindow.h"
+#include "SpectralKernels.h"
 #include "SpectralVersion.h"
 #include "Statistics.h"
 #include "StatisticsDlg.h"
@@ -51,25 +55,18 @@
 #include "Units.h"
 #include "Wavelengths.h"
 
+#include <algorithm>
 #include <fstream>
 #include <limits>
 #include <math.h>
 #include <sstream>
 #include <typeinfo>
+#include <vector>
 
 using namespace std;
 
 namespace
 {
-   template<class T>
-   void sumBandValues(T* pDummy, void* pData, double* pSums, unsigned int numBands)
-   {
-      for (unsigned int band = 0; band < numBands; ++band)
-      {
-         pSums[band] += static_cast<double>(reinterpret_cast<T*>(pData)[band]);
-      }
-   }
-
    template<class T>
    void computeDifferencePixel(T* pDummy, void* pData1, void* pData2, double* pResults,
                                unsigned int numBands)
@@ -82,57 +79,346 @@ namespace
       }
    }
 
-   template<class T>
-   void computeCovarValue(T* pData, double* pMeans, double** pValues, unsigned int numBands)
+   const unsigned int sBlockPixels = 256;
+   const unsigned int sBandTile = 64;
+
+   /**
+    * The band means and co-moments of a set of pixels.
+    *
+    * The co-moments are the sums of the products of the deviations from the means, stored as a
+    * numBands x numBands row-major matrix of which only the upper triangle is accumulated.
+    */
+   struct CovarianceTotals
+   {
+      CovarianceTotals() : mCount(0), mValid(true) {}
+
+      qulonglong mCount;
+      std::vector<double> mMeans;
+      std::vector<double> mComoments;
+      bool mValid;
+   };
+
+   // Folds in the means of a set of pixels whose co-moments have already been added to the totals.
+   // The co-moments are corrected for the difference between the two sets of means (Chan, Golub and LeVeque).
+   void mergeMeans(CovarianceTotals& totals, qulonglong count, const double* pMeans)
    {
-      if (pData != NULL && pMeans != NULL && pValues != NULL)
+      const qulonglong total = totals.mCount + count;
+      if (count == 0)
       {
-         for (unsigned int band1 = 0; band1 < numBands; ++band1)
+         return;
+      }
+      const unsigned int numBands = totals.mMeans.size();
+      std::vector<double> deltas(numBands);
+      for (unsigned int band = 0; band < numBands; ++band)
+      {
+         deltas[band] = pMeans[band] - totals.mMeans[band];
+      }
+      const double weight = static_cast<double>(totals.mCount) * static_cast<double>(count) /
+         static_cast<double>(total);
+      for (unsigned int band1 = 0; band1 < numBands; ++band1)
+      {
+         double* pRow = &totals.mComoments[band1 * numBands];
+         const double delta = deltas[band1] * weight;
+         for (unsigned int band2 = band1; band2 < numBands; ++band2)
          {
-            for (unsigned int band2 = 0; band2 < numBands; ++ band2)
-            {
-               pValues[band1][band2] += (static_cast<double>(pData[band1]) - pMeans[band1]) *
-                        (static_cast<double>(pData[band2]) - pMeans[band2]);
-            }
+            pRow[band2] += delta * deltas[band2];
          }
       }
+      const double fraction = static_cast<double>(count) / static_cast<double>(total);
+      for (unsigned int band = 0; band < numBands; ++band)
+      {
+         totals.mMeans[band] += deltas[band] * fraction;
+      }
+      totals.mCount = total;
    }
 
-   template<class T>
-   void computeMnfColumn(T *pData, double* pMnfData, double** pCoefficients, unsigned int numBands,
-      unsigned int numComponents)
+   void covarianceReduce(CovarianceTotals& final, const CovarianceTotals& partial)
+   {
+      if (final.mMeans.empty())
+      {
+         final = partial;
+         return;
+      }
+      final.mValid = final.mValid && partial.mValid;
+      for (std::vector<double>::size_type index = 0; index < final.mComoments.size(); ++index)
+      {
+         final.mComoments[index] += partial.mComoments[index];
+      }
+      mergeMeans(final, partial.mCount, &partial.mMeans.front());
+   }
+
+   /**
+    * Adds a block of pixels, stored pixel by pixel, to the totals.
+    *
+    * The pixels are centered on the block means so the products stay small, then a symmetric rank-k update
+    * adds them to the upper triangle one tile of bands at a time so each tile stays in cache across the block.
+    */
+   void addPixelBlock(std::vector<double>& block, unsigned int count, unsigned int numBands,
+      CovarianceTotals& totals)
    {
-      for (unsigned int comp = 0; comp < numComponents; ++comp)
+      if (count == 0)
+      {
+         return;
+      }
+      std::vector<double> means(numBands, 0.0);
+      for (unsigned int pixel = 0; pixel < count; ++pixel)
+      {
+         const double* pPixel = &block[pixel * numBands];
+         for (unsigned int band = 0; band < numBands; ++band)
+         {
+            means[band] += pPixel[band];
+         }
+      }
+      for (unsigned int band = 0; band < numBands; ++band)
+      {
+         means[band] /= static_cast<double>(count);
+      }
+      for (unsigned int pixel = 0; pixel < count; ++pixel)
       {
-         pMnfData[comp] = 0.0;
+         double* pPixel = &block[pixel * numBands];
          for (unsigned int band = 0; band < numBands; ++band)
          {
-            pMnfData[comp] += pCoefficients[band][comp] * static_cast<double>(pData[band]);
+            pPixel[band] -= means[band];
          }
       }
+
+      for (unsigned int tile1 = 0; tile1 < numBands; tile1 += sBandTile)
+      {
+         const unsigned int end1 = std::min(tile1 + sBandTile, numBands);
+         for (unsigned int tile2 = tile1; tile2 < numBands; tile2 += sBandTile)
+         {
+            const unsigned int end2 = std::min(tile2 + sBandTile, numBands);
+            for (unsigned int pixel = 0; pixel < count; ++pixel)
+            {
+               const double* pPixel = &block[pixel * numBands];
+               for (unsigned int band1 = tile1; band1 < end1; ++band1)
+               {
+                  const double value = pPixel[band1];
+                  double* pRow = &totals.mComoments[band1 * numBands];
+                  for (unsigned int band2 = std::max(band1, tile2); band2 < end2; ++band2)
+                  {
+                     pRow[band2] += value * pPixel[band2];
+                  }
+               }
+            }
+         }
+      }
+
+      mergeMeans(totals, count, &means.front());
    }
 
-   template <class T>
-   void computeMnfRow(T* pData, double* pMnfData,  double** pCoefficients, unsigned int numCols,
-      unsigned int numBands, unsigned int numComponents)
+   /**
+    * Accumulates the band means and co-moments of the sampled pixels in a range of rows.
+    *
+    * Each range is read in a single pass and keeps its own totals, which are merged by covarianceReduce().
+    */
+   struct CovarianceMap
    {
-      T* pColumn = pData;
-      double* pValue = pMnfData;
+      typedef QPair<unsigned int, unsigned int> input_type;
+      typedef CovarianceTotals result_type;
+
+      RasterElement* mpRaster;
+      const RasterDataDescriptor* mpDesc;
+      const BitMask* mpMask;
+      unsigned int mRowFactor;
+      unsigned int mColumnFactor;
+      unsigned int mNumBands;
+
+      CovarianceMap(RasterElement* pRaster, const BitMask* pMask, unsigned int rowFactor, unsigned int columnFactor) :
+         mpRaster(pRaster),
+         mpMask(pMask),
+         mRowFactor(rowFactor),
+         mColumnFactor(columnFactor)
+      {
+         mpDesc = static_cast<const RasterDataDescriptor*>(mpRaster->getDataDescriptor());
+         mNumBands = mpDesc->getBandCount();
+      }
+
+      result_type operator()(const input_type& rows)
+      {
+         CovarianceTotals totals;
+         totals.mMeans.resize(mNumBands, 0.0);
+         totals.mComoments.resize(mNumBands * mNumBands, 0.0);
+
+         FactoryResource<DataRequest> pRequest;
+         pRequest->setInterleaveFormat(BIP);
+         pRequest->setRows(mpDesc->getActiveRow(rows.first), mpDesc->getActiveRow(rows.second));
+         DataAccessor accessor(mpRaster->getDataAccessor(pRequest.release()));
+         if (!accessor.isValid())
+         {
+            totals.mValid = false;
+            return totals;
+         }
+
+         switchOnEncoding(mpDesc->getDataType(), accumulateRows, NULL, accessor, rows, totals);
+         return totals;
+      }
 
-      for (unsigned int col = 0; col < numCols; ++col)
+      template<class T>
+      void accumulateRows(const T* pDummy, DataAccessor& accessor, const input_type& rows,
+         CovarianceTotals& totals)
       {
-         for (unsigned int comp = 0; comp < numComponents; ++comp)
+         const unsigned int numCols = mpDesc->getColumnCount();
+         std::vector<double> block(sBlockPixels * mNumBands);
+         unsigned int count = 0;
+         for (unsigned int row = rows.first; row <= rows.second; row += mRowFactor)
          {
-            pValue[comp] = 0.0;
-            for (unsigned int band = 0; band < numBands; ++band)
+            for (unsigned int col = 0; col < numCols; col += mColumnFactor)
             {
-               pValue[comp] += (pCoefficients[band][comp] * static_cast<double>(pColumn[band]));
+               if (mpMask == NULL || mpMask->getPixel(col, row))
+               {
+                  const T* pData = reinterpret_cast<const T*>(accessor->getColumn());
+                  if (pData == NULL)
+                  {
+                     totals.mValid = false;
+                     return;
+                  }
+                  std::copy(pData, pData + mNumBands, &block[count * mNumBands]);
+                  if (++count == sBlockPixels)
+                  {
+                     addPixelBlock(block, count, mNumBands, totals);
+                     count = 0;
+                  }
+               }
+               for (unsigned int skip = 0; skip < mColumnFactor; ++skip)  // need to account for skip factor
+               {
+                  accessor->nextColumn();
+               }
             }
+            for (unsigned int skip = 0; skip < mRowFactor && row + skip < rows.second; ++skip)
+            {
+               accessor->nextRow();
+            }
+         }
+         addPixelBlock(block, count, mNumBands, totals);
+      }
+   };
+
+   const unsigned int sPixelTile = 64;
+   const unsigned int sComponentTile = 16;
+
+   /**
+    * Applies the MNF transform to a range of rows of the MNF cube.
+    *
+    * The coefficients are stored one component per row so each output value is a contiguous dot product
+    * with the pixel.  The product is computed a tile of pixels by a tile of components at a time, which keeps
+    * both the pixels and the coefficients in cache while they are reused.
+    */
+   struct MnfTransformMap
+   {
+      typedef QPair<unsigned int, unsigned int> input_type;
+      typedef bool result_type;
+
+      RasterElement* mpRaster;
+      RasterElement* mpMnfRaster;
+      const BitMask* mpMask;
+      const std::vector<double>& mCoefficients;
+      unsigned int mRowOffset;
+      unsigned int mColumnOffset;
+      unsigned int mNumBands;
+      unsigned int mNumComponents;
+
+      MnfTransformMap(RasterElement* pRaster, RasterElement* pMnfRaster, const BitMask* pMask,
+            const std::vector<double>& coefficients, unsigned int rowOffset, unsigned int columnOffset) :
+         mpRaster(pRaster),
+         mpMnfRaster(pMnfRaster),
+         mpMask(pMask),
+         mCoefficients(coefficients),
+         mRowOffset(rowOffset),
+         mColumnOffset(columnOffset)
+      {
+         mNumBands = static_cast<const RasterDataDescriptor*>(mpRaster->getDataDescriptor())->getBandCount();
+         mNumComponents = static_cast<const RasterDataDescriptor*>(mpMnfRaster->getDataDescriptor())->getBandCount();
+      }
+
+      result_type operator()(const input_type& rows)
+      {
+         const RasterDataDescriptor* pOrigDesc = static_cast<const RasterDataDescriptor*>(
+            mpRaster->getDataDescriptor());
+         const RasterDataDescriptor* pMnfDesc = static_cast<const RasterDataDescriptor*>(
+            mpMnfRaster->getDataDescriptor());
+         const unsigned int numCols = pMnfDesc->getColumnCount();
+
+         FactoryResource<DataRequest> pBipRequest;
+         pBipRequest->setInterleaveFormat(BIP);
+         pBipRequest->setRows(pOrigDesc->getActiveRow(mRowOffset + rows.first),
+            pOrigDesc->getActiveRow(mRowOffset + rows.second), 1);
+         pBipRequest->setColumns(pOrigDesc->getActiveColumn(mColumnOffset),
+            pOrigDesc->getActiveColumn(mColumnOffset + numCols - 1), numCols);
+         DataAccessor origAccessor = mpRaster->getDataAccessor(pBipRequest.release());
+
+         FactoryResource<DataRequest> pBipWritableRequest;
+         pBipWritableRequest->setWritable(true);
+         pBipWritableRequest->setInterleaveFormat(BIP);
+         pBipWritableRequest->setRows(pMnfDesc->getActiveRow(rows.first), pMnfDesc->getActiveRow(rows.second), 1);
+         pBipWritableRequest->setColumns(pMnfDesc->getActiveColumn(0), pMnfDesc->getActiveColumn(numCols - 1),
+            numCols);
+         DataAccessor mnfAccessor = mpMnfRaster->getDataAccessor(pBipWritableRequest.release());
+         if (!origAccessor.isValid() || !mnfAccessor.isValid())
+         {
+            return false;
          }
-         pValue += numComponents;
-         pColumn += numBands;
+
+         bool success = true;
+         switchOnEncoding(pOrigDesc->getDataType(), transformRows, NULL, origAccessor, mnfAccessor, rows, numCols,
+            success);
+         return success;
       }
-   }
+
+      template<class T>
+      void transformRows(const T* pDummy, DataAccessor& origAccessor, DataAccessor& mnfAccessor,
+         const input_type& rows, unsigned int numCols, bool& success)
+      {
+         std::vector<const T*> pixels;
+         std::vector<double*> values;
+         pixels.reserve(sPixelTile);
+         values.reserve(sPixelTile);
+         for (unsigned int row = rows.first; row <= rows.second; ++row)
+         {
+            if (!origAccessor.isValid() || !mnfAccessor.isValid())
+            {
+               success = false;
+               return;
+            }
+            for (unsigned int col = 0; col < numCols; ++col)
+            {
+               if (mpMask == NULL || mpMask->getPixel(col + mColumnOffset, row + mRowOffset))
+               {
+                  pixels.push_back(reinterpret_cast<const T*>(origAccessor->getColumn()));
+                  values.push_back(reinterpret_cast<double*>(mnfAccessor->getColumn()));
+               }
+               if (pixels.size() == sPixelTile || (col + 1 == numCols && !pixels.empty()))
+               {
+                  transformPixels(pixels, values);
+                  pixels.clear();
+                  values.clear();
+               }
+               origAccessor->nextColumn();
+               mnfAccessor->nextColumn();
+            }
+            origAccessor->nextRow();
+            mnfAccessor->nextRow();
+         }
+      }
+
+      template<class T>
+      void transformPixels(const std::vector<const T*>& pixels, const std::vector<double*>& values)
+      {
+         for (unsigned int tile = 0; tile < mNumComponents; tile += sComponentTile)
+         {
+            const unsigned int end = std::min(tile + sComponentTile, mNumComponents);
+            for (typename std::vector<const T*>::size_type pixel = 0; pixel < pixels.size(); ++pixel)
+            {
+               for (unsigned int comp = tile; comp < end; ++comp)
+               {
+                  values[pixel][comp] = SpectralKernels::dotProduct(pixels[pixel],
+                     &mCoefficients[comp * mNumBands], mNumBands);
+               }
+            }
+         }
+      }
+   };
+
 }
 
 REGISTER_PLUGIN_BASIC(SpectralMnf, Mnf);
@@ -755,7 +1041,6 @@ bool Mnf::computeMnfValues()
    VERIFY(pMnfDesc != NULL);
    EncodingType mnfDataType = pMnfDesc->getDataType();
    unsigned int mnfNumRows = pMnfDesc->getRowCount();
-   unsigned int mnfNumCols = pMnfDesc->getColumnCount();
    unsigned int mnfNumBands = pMnfDesc->getBandCount();
 
    const BitMask* pMask(NULL);
@@ -807,88 +1092,44 @@ bool Mnf::computeMnfValues()
    }
    // Initialize progress bar variables
    int currentProgress = 0;
-   int count = 0;
-
-   void* pMnfData = NULL;
-   void* pOrigData = NULL;
 
-   FactoryResource<DataRequest> pBipRequest;
-   pBipRequest->setInterleaveFormat(BIP);
-   pBipRequest->setRows(pOrigDesc->getActiveRow(rowOffset), pOrigDesc->getActiveRow(rowOffset + mnfNumRows - 1), 1);
-   pBipRequest->setColumns(pOrigDesc->getActiveColumn(colOffset),
-      pOrigDesc->getActiveColumn(colOffset + mnfNumCols - 1), mnfNumCols);
-   DataAccessor origAccessor = mpRaster->getDataAccessor(pBipRequest.release());
-   if (!origAccessor.isValid())
+   // Store the coefficients of the requested components contiguously, one component per row.
+   std::vector<double> coefficients(mNumComponentsToUse * mNumBands);
+   for (unsigned int comp = 0; comp < mNumComponentsToUse; ++comp)
    {
-      mMessage = "Could not get the pixels in the original cube!";
-      if (mpProgress != NULL)
+      for (unsigned int band = 0; band < mNumBands; ++band)
       {
-         mpProgress->updateProgress(mMessage, currentProgress, ERRORS);
+         coefficients[comp * mNumBands + band] = mpMnfTransformMatrix[band][comp];
       }
-
-      mpStep->finalize(Message::Failure, mMessage);
-      return false;
    }
 
-   FactoryResource<DataRequest> pBipWritableRequest;
-   pBipWritableRequest->setWritable(true);
-   pBipWritableRequest->setInterleaveFormat(BIP);
-   pBipWritableRequest->setRows(pMnfDesc->getActiveRow(0), pMnfDesc->getActiveRow(mnfNumRows - 1), 1);
-   pBipWritableRequest->setColumns(pMnfDesc->getActiveColumn(0),
-      pMnfDesc->getActiveColumn(mnfNumCols - 1), mnfNumCols);
-   DataAccessor mnfAccessor = mpMnfRaster->getDataAccessor(pBipWritableRequest.release());
-   if (!mnfAccessor.isValid())
+   // A few ranges of rows per thread balance the load.
+   const unsigned int blockHeight = std::max(1U,
+      mnfNumRows / (4 * static_cast<unsigned int>(std::max(1, QThread::idealThreadCount()))));
+   QList<QPair<unsigned int, unsigned int> > blocks;
+   for (unsigned int row = 0; row < mnfNumRows; row += blockHeight)
    {
-      mMessage = "MNF could not obtain an accessor to the MNF RasterElement";
-      if (mpProgress != NULL)
-      {
-         mpProgress->updateProgress(mMessage, 0, ERRORS);
-      }
-
-      mpStep->finalize(Message::Failure, mMessage);
-      return false;
+      blocks.push_back(qMakePair(row, std::min(mnfNumRows - 1, row + blockHeight - 1)));
    }
 
-   double* pValues = NULL;
-   for (unsigned int row = 0; row < mnfNumRows; ++row)
+   MnfTransformMap transformMap(mpRaster, mpMnfRaster.get(), pMask, coefficients, rowOffset, colOffset);
+   QFuture<bool> transform = QtConcurrent::mapped(blocks, transformMap);
+   while (transform.isRunning())
    {
       if (isAborted())
       {
+         transform.cancel();
+         transform.waitForFinished();
          break;
       }
 
-      VERIFY(origAccessor.isValid());
-      VERIFY(mnfAccessor.isValid());
-      if (pMask == NULL)
-      {
-         pOrigData = origAccessor->getRow();
-         pValues = reinterpret_cast<double*>(mnfAccessor->getRow());
-         switchOnEncoding(eDataType, computeMnfRow, pOrigData, pValues,
-            mpMnfTransformMatrix, mNumColumns, mNumBands, mNumComponentsToUse);
-      }
-      else
-      {
-         for (unsigned int col = 0; col < mnfNumCols; ++col)
-         {
-            if (pMask->getPixel(col + colOffset, row + rowOffset))
-            {
-               pOrigData = origAccessor->getColumn();
-               pValues = reinterpret_cast<double*>(mnfAccessor->getColumn());
-               switchOnEncoding(eDataType, computeMnfColumn, pOrigData, pValues,
-                  mpMnfTransformMatrix, mNumBands, mNumComponentsToUse);
-            }
-            origAccessor->nextColumn();
-            mnfAccessor->nextColumn();
-         }
-      }
-      origAccessor->nextRow();
-      mnfAccessor->nextRow();
-
-      currentProgress = 100 * (row + 1) / mnfNumRows;
+      currentProgress = (transform.progressValue() - transform.progressMinimum()) * 100 /
+         std::max(1, transform.progressMaximum() - transform.progressMinimum());
       if (mpProgress != NULL)
       {
          mpProgress->updateProgress("Generating MNF data cube...", currentProgress, NORMAL);
       }
+      QThread::yieldCurrentThread();
    }
 
    if (isAborted())
@@ -897,6 +1138,17 @@ bool Mnf::computeMnfValues()
       mpStep->finalize(Message::Abort);
       return false;
    }
+   if (transform.results().contains(false))
+   {
+      mMessage = "Could not access the pixels of the original cube or the MNF RasterElement.";
+      if (mpProgress != NULL)
+      {
+         mpProgress->updateProgress(mMessage, currentProgress, ERRORS);
+      }
+
+      mpStep->finalize(Message::Failure, mMessage);
+      return false;
+   }
    if (mpProgress != NULL)
    {
       mpProgress->updateProgress("MNF computations complete!", 100, NORMAL);
@@ -2057,9 +2309,7 @@ bool Mnf::computeCovarianceMatrix(RasterElement* pRaster, double **pMatrix, std:
    const RasterDataDescriptor* pDesc = dynamic_cast<const RasterDataDescriptor*>(pRaster->getDataDescriptor());
    VERIFY(pDesc != NULL);
    unsigned int numRows = pDesc->getRowCount();
-   unsigned int numCols = pDesc->getColumnCount();
    unsigned int numBands = pDesc->getBandCount();
-   EncodingType eType = pDesc->getDataType();
 
    const BitMask* pMask(NULL);
    if (pAoi != NULL)
@@ -2082,9 +2332,6 @@ bool Mnf::computeCovarianceMatrix(RasterElement* pRaster, double **pMatrix, std:
       }
    }
 
-   unsigned int row, col;
-   unsigned int band1, band2;
-
    if (rowFactor < 1)
    {
       rowFactor = 1;
@@ -2094,143 +2341,62 @@ bool Mnf::computeCovarianceMatrix(RasterElement* pRaster, double **pMatrix, std:
       columnFactor = 1;
    }
 
-   vector<double> means(numBands, 0.0);
-   double* pMeans = &means.front();
-
-   // calculate mean band values
-   float progScale = 100.0f / static_cast<float>(numRows);
-   FactoryResource<DataRequest> pRequest;
-   pRequest->setInterleaveFormat(BIP);
-   DataAccessor accessor = pRaster->getDataAccessor(pRequest.release());
-   unsigned int pixCount = 0;
-   void* pData(NULL);
-   unsigned int currentRow = 0;
-   unsigned int currentCol = 0;
-   for (row = 0; row < numRows; row += rowFactor)
+   // The means and covariance are accumulated in a single pass over ranges of sampled rows, a few per thread.
+   const unsigned int numSampledRows = (numRows + rowFactor - 1) / rowFactor;
+   const unsigned int blockHeight = rowFactor * std::max(1U,
+      numSampledRows / (4 * static_cast<unsigned int>(std::max(1, QThread::idealThreadCount()))));
+   QList<QPair<unsigned int, unsigned int> > blocks;
+   for (unsigned int row = 0; row < numRows; row += blockHeight)
    {
-      while (row > currentRow)  // need to account for skip factor
-      {
-         accessor->nextRow();
-         ++currentRow;
-      }
-      VERIFY(accessor.isValid());
-      if (mpProgress != NULL)
-      {
-         if (isAborted() == false)
-         {
-            mpProgress->updateProgress ("Computing mean band values for " + info +
-               "...", int(progScale*row), NORMAL);
-         }
-         else
-         {
-            break;
-         }
-      }
-      currentCol = 0;
-      for (col = 0; col < numCols; col += columnFactor)
-      {
-         while (col > currentCol)  // need to account for skip factor
-         {
-            accessor->nextColumn();
-            ++currentCol;
-         }
-
-         if (pMask == NULL || pMask->getPixel(col, row))
-         {
-            ++pixCount;
-            pData = accessor->getColumn();
-            switchOnEncoding(eType, sumBandValues, NULL, pData, pMeans, numBands);
-         }
-      }
+      blocks.push_back(qMakePair(row, std::min(numRows - 1, row + blockHeight - 1)));
    }
 
-   unsigned int pixCount2 = 0;
-   if (isAborted() == false)
+   CovarianceMap covarianceMap(pRaster, pMask, rowFactor, columnFactor);
+   QFuture<CovarianceTotals> moments = QtConcurrent::mappedReduced(blocks, covarianceMap, covarianceReduce,
+      QtConcurrent::UnorderedReduce);
+   while (moments.isRunning())
    {
-      // divide band sums by number of pixels
-      for (band1 = 0; band1 < numBands; ++band1)
+      if (isAborted() == true)
       {
-         pMeans[band1] /= static_cast<double>(pixCount);
+         moments.cancel();
+         moments.waitForFinished();
+         break;
       }
-   }
-
-   // check if aborted
-   if (isAborted() == false)
-   {
-      // compute the covariance
-      FactoryResource<DataRequest> pRequest2;
-      pRequest2->setInterleaveFormat(BIP);
-      accessor = pRaster->getDataAccessor(pRequest2.release());
-
-      pixCount2 = 0;
-      currentRow = 0;
-      currentCol = 0;
-      for (row = 0; row < numRows; row += rowFactor)
+      if (mpProgress != NULL)
       {
-         while (row > currentRow)  // need to account for skip factor
-         {
-            accessor->nextRow();
-            ++currentRow;
-         }
-         VERIFY(accessor.isValid());
-         if (mpProgress != NULL)
-         {
-            if (isAborted() == false)
-            {
-               mpProgress->updateProgress("Computing Covariance Matrix for " + info +
-                  "...", int(progScale * row), NORMAL);
-            }
-            else
-            {
-               break;
-            }
-         }
-         currentCol = 0;
-         for (col = 0; col < numCols; col += columnFactor)
-         {
-            while (col > currentCol)  // need to account for skip factor
-            {
-               accessor->nextColumn();
-               ++currentCol;
-            }
-            if (pMask == NULL || pMask->getPixel(col, row))
-            {
-               ++pixCount2;
-               pData = accessor->getColumn();
-               switchOnEncoding(eType, computeCovarValue,
-                  pData, pMeans, pMatrix, numBands);
-            }
-         }
+         mpProgress->updateProgress("Computing Covariance Matrix for " + info + "...",
+            (moments.progressValue() - moments.progressMinimum()) * 100 /
+            std::max(1, moments.progressMaximum() - moments.progressMinimum()), NORMAL);
       }
+      QThread::yieldCurrentThread();
    }
 
-   // check if aborted
+   vector<double> means(numBands, 0.0);
    if (isAborted() == false)
    {
-      // Check pixel count still same
-      if (pixCount != pixCount2)
+      CovarianceTotals totals = moments.result();
+      if (totals.mValid == false)
       {
-         mMessage = "Error occurred in computing the covariance - mismatch in number of pixels to sample.";
+         mMessage = "Unable to access the data for " + info + " covariance computation.";
          return false;
       }
-
-      // Get mean covariances
-      for (band2 = 0; band2 < numBands; ++band2)
+      if (totals.mCount < 2)
       {
-         for (band1 = band2; band1 < numBands; ++band1)
-         {
-            pMatrix[band2][band1] /= pixCount2 - 1;
-         }
+         mMessage = "Too few pixels to compute the covariance for " + info + ".";
+         return false;
       }
 
-      // Fill other half of triangle
-      for (band2 = 0; band2 < numBands; ++band2)
+      // Get mean covariances and fill the other half of the triangle
+      const double divisor = static_cast<double>(totals.mCount - 1);
+      for (unsigned int band1 = 0; band1 < numBands; ++band1)
       {
-         for (band1 = band2 + 1; band1 < numBands; ++band1)
+         for (unsigned int band2 = band1; band2 < numBands; ++band2)
          {
-            pMatrix[band1][band2] = pMatrix[band2][band1];
+            pMatrix[band1][band2] = totals.mComoments[band1 * numBands + band2] / divisor;
+            pMatrix[band2][band1] = pMatrix[band1][band2];
          }
       }
+      means.swap(totals.mMeans);
    }
 
    // if calculating for mpRaster, then save the band means
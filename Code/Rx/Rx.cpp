@@ -35,7 +35,11 @@
 #include "SpectralVersion.h"
 #include "ThresholdLayer.h"
 #include "UtilityServices.h"
+#include <cmath>
+#include <limits>
 #include <memory>
+#include <utility>
+#include <QtCore/QTime>
 
 REGISTER_PLUGIN_BASIC(RxModule, Rx);
 
@@ -130,9 +134,128 @@ namespace
       }
    }
 
+   // collects the runs of selected columns in [firstCol, lastCol] of a row as [first, last] pairs
+   void getSelectedSpans(const BitMaskIterator& check, int row, int firstCol, int lastCol,
+      std::vector<std::pair<int, int> >& spans)
+   {
+      spans.clear();
+      if (check.useAllPixels())
+      {
+         if (firstCol <= lastCol)
+         {
+            spans.push_back(std::make_pair(firstCol, lastCol));
+         }
+         return;
+      }
+      int spanStart = -1;
+      for (int col = firstCol; col <= lastCol; ++col)
+      {
+         if (check.getPixel(col, row))
+         {
+            if (spanStart < 0)
+            {
+               spanStart = col;
+            }
+         }
+         else if (spanStart >= 0)
+         {
+            spans.push_back(std::make_pair(spanStart, col - 1));
+            spanStart = -1;
+         }
+      }
+      if (spanStart >= 0)
+      {
+         spans.push_back(std::make_pair(spanStart, lastCol));
+      }
+   }
+
+   /**
+    * Builds the whitening matrix for subspace RX.
+    *
+    * The columns are the eigen vectors of the covariance, less the leading components,
+    * scaled by the inverse square root of their eigen values.  The squared norm of a
+    * centered pixel multiplied by this matrix is its RX score after the leading components
+    * are projected out, which is what running RX on the reconstructed data computes.
+    * Components with negligible variance are skipped as a pseudo-inverse would.
+    */
+   bool computeSubspaceWhitening(const cv::Mat& covMat, unsigned int components, cv::Mat& whitening)
+   {
+      cv::Mat eigenValues;
+      cv::Mat eigenVectors;
+      if (!cv::eigen(covMat, eigenValues, eigenVectors))
+      {
+         return false;
+      }
+      cv::Mat sortedIndices;
+      cv::sortIdx(eigenValues, sortedIndices, CV_SORT_DESCENDING | CV_SORT_EVERY_COLUMN);
+      const double tolerance = eigenValues.at<double>(sortedIndices.at<int>(0)) * covMat.rows *
+         std::numeric_limits<double>::epsilon();
+
+      std::vector<int> kept;
+      for (int i = static_cast<int>(components); i < eigenValues.rows; ++i)
+      {
+         if (eigenValues.at<double>(sortedIndices.at<int>(i)) > tolerance)
+         {
+            kept.push_back(sortedIndices.at<int>(i));
+         }
+      }
+      if (kept.empty())
+      {
+         return false;
+      }
+
+      whitening.create(covMat.rows, static_cast<int>(kept.size()), CV_64F);
+      for (std::vector<int>::size_type column = 0; column < kept.size(); ++column)
+      {
+         const double scale = 1.0 / std::sqrt(eigenValues.at<double>(kept[column]));
+         for (int band = 0; band < covMat.rows; ++band)
+         {
+            whitening.at<double>(band, static_cast<int>(column)) = eigenVectors.at<double>(kept[column], band) * scale;
+         }
+      }
+      return true;
+   }
+
+   template<typename T, typename U>
+   void centerBandData(T* pPtr, const double* pMeans, U* pOutput, int bands)
+   {
+      for (int band = 0; band < bands; ++band)
+      {
+         pOutput[band] = static_cast<U>(static_cast<double>(pPtr[band]) - pMeans[band]);
+      }
+   }
+
+   // stores a score in a result element created as either FLT4BYTES or FLT8BYTES
+   void setScore(DataAccessor& resacc, EncodingType resultType, double score)
+   {
+      if (resultType == FLT4BYTES)
+      {
+         *reinterpret_cast<float*>(resacc->getColumn()) = static_cast<float>(score);
+      }
+      else
+      {
+         *reinterpret_cast<double*>(resacc->getColumn()) = score;
+      }
+   }
+
+   /**
+    * Calculates global RX over a block of rows.
+    *
+    * The selected pixels of each row are read in their native type and centered into a
+    * block, the block is multiplied by the inverse covariance with a single GEMM and each
+    * score is the dot product of a centered pixel with its row of the product.
+    *
+    * For subspace RX the matrix is instead the whitening matrix from
+    * computeSubspaceWhitening() and each score is the squared norm of a row of the product,
+    * so the leading components are removed and the pixels are scored in the same pass.
+    *
+    * The block is computed in the precision of the matrix, so passing a CV_32F matrix
+    * halves the memory traffic of the GEMM.  The means are removed in double precision
+    * before the narrowing so large offsets don't cost the centered values their precision.
+    */
    struct RxMap
    {
-      typedef QPair<int, QList<int> > input_type;
+      typedef QPair<int, int> input_type;
       // result_type is typedef'd to int in order to work around QFuture restriction where exceptions
       // in threads can only be thrown in the main thread by calling one of the result() methods on the QFuture.
       // void would be a preferable typedef, but QFuture<void> does not have result() methods available
@@ -145,123 +268,487 @@ namespace
       LocationType mStart;
       int mBands;
       EncodingType mEncoding;
+      EncodingType mResultType;
+      const BitMaskIterator& mCheck;
       cv::Mat& mCovMat;
       cv::Mat& mMuMat;
-      unsigned int mLocalWidthOffset;
-      unsigned int mLocalHeightOffset;
-      bool mLocal;
+      bool mWhitened;
 
-      RxMap(RasterElement* pElement, RasterElement* pResult, LocationType start,
-            cv::Mat& covMat, cv::Mat& muMat, unsigned int localWidthOffset, unsigned int localHeightOffset) :
+      // the number of pixels multiplied at once, sized so a block and its product stay in cache
+      static const int sBlockPixels = 256;
+
+      RxMap(RasterElement* pElement, RasterElement* pResult, LocationType start, const BitMaskIterator& check,
+            cv::Mat& covMat, cv::Mat& muMat, bool whitened) :
                mpElement(pElement),
                mpResult(pResult),
                mStart(start),
+               mCheck(check),
                mCovMat(covMat),
                mMuMat(muMat),
+               mWhitened(whitened)
+      {
+         mpDesc = static_cast<const RasterDataDescriptor*>(mpElement->getDataDescriptor());
+         mpResDesc = static_cast<const RasterDataDescriptor*>(mpResult->getDataDescriptor());
+         mBands = mpDesc->getBandCount();
+         mEncoding = mpDesc->getDataType();
+         mResultType = mpResDesc->getDataType();
+      }
+
+      result_type operator()(const input_type& rows)
+      {
+         const int firstCol = static_cast<int>(mStart.mX);
+         const int lastCol = firstCol + static_cast<int>(mpResDesc->getColumnCount()) - 1;
+
+         FactoryResource<DataRequest> pReq;
+         pReq->setInterleaveFormat(BIP);
+         pReq->setRows(mpDesc->getActiveRow(rows.first), mpDesc->getActiveRow(rows.second));
+         pReq->setColumns(mpDesc->getActiveColumn(firstCol), mpDesc->getActiveColumn(lastCol));
+         DataAccessor acc(mpElement->getDataAccessor(pReq.release()));
+         ENSURE(acc.isValid());
+
+         FactoryResource<DataRequest> pResReq;
+         pResReq->setRows(mpResDesc->getActiveRow(rows.first - static_cast<int>(mStart.mY)),
+            mpResDesc->getActiveRow(rows.second - static_cast<int>(mStart.mY)));
+         pResReq->setWritable(true);
+         DataAccessor resacc(mpResult->getDataAccessor(pResReq.release()));
+         ENSURE(resacc.isValid());
+
+         cv::Mat centered;
+         cv::Mat product;
+         try
+         {
+            centered = cv::Mat(sBlockPixels, mBands, mCovMat.type());
+            product = cv::Mat(sBlockPixels, mCovMat.cols, mCovMat.type());
+         }
+         catch (const cv::Exception& e)
+         {
+            throw CvExceptionWrapper(e.code);
+         }
+         const double* pMeans = mMuMat.ptr<double>();
+         std::vector<int> blockCols;
+         blockCols.reserve(sBlockPixels);
+         std::vector<std::pair<int, int> > spans;
+         for (int row = rows.first; row <= rows.second; ++row)
+         {
+            getSelectedSpans(mCheck, row, firstCol, lastCol, spans);
+            for (std::vector<std::pair<int, int> >::const_iterator span = spans.begin(); span != spans.end(); ++span)
+            {
+               acc->toPixel(row, span->first);
+               for (int col = span->first; col <= span->second; ++col)
+               {
+                  ENSURE(acc.isValid());
+                  if (centered.depth() == CV_32F)
+                  {
+                     switchOnEncoding(mEncoding, centerBandData, acc->getColumn(), pMeans,
+                        centered.ptr<float>(static_cast<int>(blockCols.size())), mBands);
+                  }
+                  else
+                  {
+                     switchOnEncoding(mEncoding, centerBandData, acc->getColumn(), pMeans,
+                        centered.ptr<double>(static_cast<int>(blockCols.size())), mBands);
+                  }
+                  blockCols.push_back(col);
+                  if (static_cast<int>(blockCols.size()) == sBlockPixels)
+                  {
+                     scoreBlock(row, blockCols, centered, product, resacc);
+                     blockCols.clear();
+                  }
+                  acc->nextColumn();
+               }
+            }
+            if (!blockCols.empty())
+            {
+               scoreBlock(row, blockCols, centered, product, resacc);
+               blockCols.clear();
+            }
+         }
+         return 0;
+      }
+
+   private:
+      void scoreBlock(int row, const std::vector<int>& cols, cv::Mat& centered, cv::Mat& product,
+         DataAccessor& resacc) const
+      {
+         const int count = static_cast<int>(cols.size());
+         cv::Mat block = centered.rowRange(0, count);
+         cv::Mat result = product.rowRange(0, count);
+         try
+         {
+            cv::gemm(block, mCovMat, 1.0, cv::Mat(), 0.0, result);
+         }
+         catch (const cv::Exception& e)
+         {
+            throw CvExceptionWrapper(e.code);
+         }
+         for (int index = 0; index < count; ++index)
+         {
+            resacc->toPixel(row - static_cast<int>(mStart.mY), cols[index] - static_cast<int>(mStart.mX));
+            setScore(resacc, mResultType,
+               (mWhitened ? result.row(index) : block.row(index)).dot(result.row(index)));
+         }
+      }
+   };
+
+   // adds sign * values to a running sum
+   void accumulate(const double* pValues, double sign, std::vector<double>::size_type count, double* pSum)
+   {
+      for (std::vector<double>::size_type index = 0; index < count; ++index)
+      {
+         pSum[index] += sign * pValues[index];
+      }
+   }
+
+   // adds sign * xx' to the packed upper triangle of a running outer product sum
+   void accumulateOuter(const std::vector<double>& pixel, double sign, double* pOuter)
+   {
+      for (std::vector<double>::size_type i = 0; i < pixel.size(); ++i)
+      {
+         const double scaled = sign * pixel[i];
+         for (std::vector<double>::size_type j = i; j < pixel.size(); ++j)
+         {
+            *pOuter++ += scaled * pixel[j];
+         }
+      }
+   }
+
+   /**
+    * Calculates local RX over a block of rows.
+    *
+    * Rather than collecting every neighbor of every pixel, the local statistics are
+    * kept as running sums of x and xx'.  The image is processed in strips of columns.
+    * For each strip the sums over the window rows are kept for every column and slid
+    * down the block one row at a time, then slid across each row one column at a time
+    * to form the window sums.  Each update is O(bands^2) no matter how large the window
+    * is, leaving the inversion of the local covariance as the main per pixel cost.
+    * The sums are differenced to form each covariance so they stay in double precision
+    * even when the results are single precision.
+    */
+   struct LocalRxMap
+   {
+      typedef QPair<int, int> input_type;
+      // see RxMap for why this is not void
+      typedef int result_type;
+
+      RasterElement* mpElement;
+      RasterElement* mpResult;
+      const RasterDataDescriptor* mpDesc;
+      const RasterDataDescriptor* mpResDesc;
+      LocationType mStart;
+      int mBands;
+      EncodingType mEncoding;
+      EncodingType mResultType;
+      const BitMaskIterator& mCheck;
+      int mLocalWidthOffset;
+      int mLocalHeightOffset;
+
+      LocalRxMap(RasterElement* pElement, RasterElement* pResult, LocationType start,
+            const BitMaskIterator& check, int localWidthOffset, int localHeightOffset) :
+               mpElement(pElement),
+               mpResult(pResult),
+               mStart(start),
+               mCheck(check),
                mLocalWidthOffset(localWidthOffset),
-               mLocalHeightOffset(localHeightOffset),
-               mLocal(localWidthOffset > 0 && localHeightOffset > 0)
+               mLocalHeightOffset(localHeightOffset)
       {
          mpDesc = static_cast<const RasterDataDescriptor*>(mpElement->getDataDescriptor());
          mpResDesc = static_cast<const RasterDataDescriptor*>(mpResult->getDataDescriptor());
          mBands = mpDesc->getBandCount();
          mEncoding = mpDesc->getDataType();
+         mResultType = mpResDesc->getDataType();
       }
 
-      result_type operator()(const input_type& locList)
+      // the number of rows in each block, the window sums are rebuilt once per block and strip
+      static int getBlockHeight(int localHeightOffset)
       {
-         int startRow = locList.first;
-         int endRow = locList.first;
+         return std::max(16, 2 * (2 * localHeightOffset + 1));
+      }
 
-         if (mLocal)
+      result_type operator()(const input_type& rows)
+      {
+         const int numRows = static_cast<int>(mpDesc->getRowCount());
+         const int numCols = static_cast<int>(mpDesc->getColumnCount());
+         const std::vector<double>::size_type bands = mBands;
+         const std::vector<double>::size_type packedSize = bands * (bands + 1) / 2;
+
+         // find the selected columns in the block
+         const int boxFirstCol = static_cast<int>(mStart.mX);
+         const int boxLastCol = boxFirstCol + static_cast<int>(mpResDesc->getColumnCount()) - 1;
+         int firstCol = numCols;
+         int lastCol = -1;
+         std::vector<std::pair<int, int> > spans;
+         for (int row = rows.first; row <= rows.second; ++row)
          {
-            startRow = std::max<int>(0, startRow - mLocalHeightOffset);
-            endRow = std::min<int>(mpDesc->getRowCount() - 1, endRow + mLocalHeightOffset);
+            getSelectedSpans(mCheck, row, boxFirstCol, boxLastCol, spans);
+            if (!spans.empty())
+            {
+               firstCol = std::min(firstCol, spans.front().first);
+               lastCol = std::max(lastCol, spans.back().second);
+            }
          }
+         if (lastCol < firstCol)
+         {
+            return 0;
+         }
+
          FactoryResource<DataRequest> pReq;
          pReq->setInterleaveFormat(BIP);
-         pReq->setRows(mpDesc->getActiveRow(startRow), mpDesc->getActiveRow(endRow));
+         pReq->setRows(mpDesc->getActiveRow(std::max(0, rows.first - mLocalHeightOffset)),
+            mpDesc->getActiveRow(std::min(numRows - 1, rows.second + mLocalHeightOffset)));
          DataAccessor acc(mpElement->getDataAccessor(pReq.release()));
          ENSURE(acc.isValid());
 
-         DimensionDescriptor resRowDesc = mpResDesc->getActiveRow(locList.first - mStart.mY);
          FactoryResource<DataRequest> pResReq;
-         pResReq->setRows(resRowDesc, resRowDesc);
+         pResReq->setRows(mpResDesc->getActiveRow(rows.first - mStart.mY),
+            mpResDesc->getActiveRow(rows.second - mStart.mY));
+         pResReq->setWritable(true);
          DataAccessor resacc(mpResult->getDataAccessor(pResReq.release()));
          ENSURE(resacc.isValid());
 
-         cv::Mat pixelMat(mBands, 1, CV_64F);
-         foreach(int col, locList.second)
+         std::vector<double> shift(bands);
+         std::vector<double> pixel(bands);
+         std::vector<double> windowSum(bands);
+         std::vector<double> windowOuter(packedSize);
+         std::vector<double> localSum(bands);
+         std::vector<double> localOuter(packedSize);
+         cv::Mat covMat(mBands, mBands, CV_64F);
+         cv::Mat invCovMat(mBands, mBands, CV_64F);
+         cv::Mat diffMat(mBands, 1, CV_64F);
+         cv::Mat tempMat(mBands, 1, CV_64F);
+
+         // wide strips amortize the window margin, narrow strips bound the memory for the column sums
+         const int stripWidth = std::max(64, 2 * (2 * mLocalWidthOffset + 1));
+         for (int stripStart = firstCol; stripStart <= lastCol; stripStart += stripWidth)
          {
-            cv::Mat localCovMat;
-            cv::Mat localMuMat;
-            if (mLocal)
+            const int stripEnd = std::min(lastCol, stripStart + stripWidth - 1);
+            const int windowFirstCol = std::max(0, stripStart - mLocalWidthOffset);
+            const int windowLastCol = std::min(numCols - 1, stripEnd + mLocalWidthOffset);
+            const int stripCols = windowLastCol - windowFirstCol + 1;
+
+            // samples are accumulated relative to a pixel in the strip so the sums of xx' stay
+            // close in magnitude to the covariance and the subtraction of the mean loses little
+            readPixel(acc, rows.first, stripStart, pixel);
+            shift = pixel;
+
+            std::vector<double> columnSums(stripCols * bands, 0.0);
+            std::vector<double> columnOuters(stripCols * packedSize, 0.0);
+            for (int row = std::max(0, rows.first - mLocalHeightOffset);
+               row <= std::min(numRows - 1, rows.first + mLocalHeightOffset); ++row)
             {
-               // calculate local statistics
-               int startCol = std::max<int>(0, col - mLocalWidthOffset);
-               int endCol = std::min<int>(mpDesc->getColumnCount() - 1, col + mLocalWidthOffset);
-               cv::Mat samples;
-               try
+               accumulateRow(acc, row, windowFirstCol, stripCols, shift, 1.0, pixel, columnSums, columnOuters);
+            }
+
+            for (int row = rows.first; row <= rows.second; ++row)
+            {
+               if (row > rows.first)
                {
-                  samples = cv::Mat(mBands, (endRow - startRow + 1) * (endCol - startCol + 1) - 1, CV_64F);
+                  // slide the column sums down one row
+                  if (row - mLocalHeightOffset - 1 >= 0)
+                  {
+                     accumulateRow(acc, row - mLocalHeightOffset - 1, windowFirstCol, stripCols, shift, -1.0,
+                        pixel, columnSums, columnOuters);
+                  }
+                  if (row + mLocalHeightOffset < numRows)
+                  {
+                     accumulateRow(acc, row + mLocalHeightOffset, windowFirstCol, stripCols, shift, 1.0,
+                        pixel, columnSums, columnOuters);
+                  }
                }
-               catch (const cv::Exception &e)
+
+               getSelectedSpans(mCheck, row, stripStart, stripEnd, spans);
+               if (spans.empty())
                {
-                  throw CvExceptionWrapper(e.code);
+                  continue;
                }
-               int curSample = 0;
-               for (int subRow = startRow; subRow <= endRow; ++subRow)
+               const int windowRows = std::min(numRows - 1, row + mLocalHeightOffset) -
+                  std::max(0, row - mLocalHeightOffset) + 1;
+
+               // the window sums cover columns [windowFirst, windowLast] and slide right with the pixel
+               int windowFirst = windowFirstCol;
+               int windowLast = windowFirstCol - 1;
+               std::fill(windowSum.begin(), windowSum.end(), 0.0);
+               std::fill(windowOuter.begin(), windowOuter.end(), 0.0);
+               for (std::vector<std::pair<int, int> >::const_iterator span = spans.begin(); span != spans.end();
+                  ++span)
                {
-                  for (int subCol = startCol; subCol <= endCol; ++subCol)
+                  for (int col = span->first; col <= span->second; ++col)
                   {
-                     if (subRow == locList.first && subCol == col)
+                     const int first = std::max(0, col - mLocalWidthOffset);
+                     const int last = std::min(numCols - 1, col + mLocalWidthOffset);
+                     for (; windowLast < last; ++windowLast)
                      {
-                        continue;
+                        const int index = windowLast + 1 - windowFirstCol;
+                        accumulate(&columnSums[index * bands], 1.0, bands, &windowSum.front());
+                        accumulate(&columnOuters[index * packedSize], 1.0, packedSize, &windowOuter.front());
                      }
-                     acc->toPixel(subRow, subCol);
-                     for (int band = 0; band < mBands; ++band)
+                     for (; windowFirst < first; ++windowFirst)
+                     {
+                        const int index = windowFirst - windowFirstCol;
+                        accumulate(&columnSums[index * bands], -1.0, bands, &windowSum.front());
+                        accumulate(&columnOuters[index * packedSize], -1.0, packedSize, &windowOuter.front());
+                     }
+
+                     // remove the pixel under test from its own statistics
+                     readPixel(acc, row, col, pixel);
+                     accumulate(&shift.front(), -1.0, bands, &pixel.front());
+                     localSum = windowSum;
+                     localOuter = windowOuter;
+                     accumulate(&pixel.front(), -1.0, bands, &localSum.front());
+                     accumulateOuter(pixel, -1.0, &localOuter.front());
+
+                     const double count = windowRows * (last - first + 1) - 1;
+                     std::vector<double>::const_iterator outer = localOuter.begin();
+                     for (std::vector<double>::size_type i = 0; i < bands; ++i)
                      {
-                        double val = Service<ModelServices>()->getDataValue(mEncoding, acc->getColumn(), band);
-                        samples.at<double>(band, curSample) = val;
+                        const double meanI = localSum[i] / count;
+                        diffMat.at<double>(i, 0) = pixel[i] - meanI;
+                        for (std::vector<double>::size_type j = i; j < bands; ++j, ++outer)
+                        {
+                           double value = *outer / count - meanI * localSum[j] / count;
+                           covMat.at<double>(i, j) = value;
+                           covMat.at<double>(j, i) = value;
+                        }
                      }
-                     curSample++;
+
+                     double result = 0.0;
+                     try
+                     {
+                        // a window with more samples than bands normally has a positive definite covariance
+                        // so a Cholesky solve is enough, small or degenerate windows need the pseudo-inverse
+                        if (count <= bands || !cv::solve(covMat, diffMat, tempMat, cv::DECOMP_CHOLESKY))
+                        {
+                           cv::invert(covMat, invCovMat, cv::DECOMP_SVD);
+                           cv::gemm(invCovMat, diffMat, 1.0, cv::Mat(), 0.0, tempMat);
+                        }
+                        result = diffMat.dot(tempMat);
+                     }
+                     catch (const cv::Exception& e)
+                     {
+                        throw CvExceptionWrapper(e.code);
+                     }
+                     resacc->toPixel(row - mStart.mY, col - mStart.mX);
+                     setScore(resacc, mResultType, result);
                   }
                }
-               try
-               {
-                  localCovMat = cv::Mat(mBands, mBands, CV_64F);
-                  localMuMat = cv::Mat(mBands, 1, CV_64F);
-                  cv::calcCovarMatrix(samples, localCovMat, localMuMat, CV_COVAR_NORMAL | CV_COVAR_COLS);
-               }
-               catch (const cv::Exception& e)
-               {
-                  throw CvExceptionWrapper(e.code);
-               }
             }
-            acc->toPixel(locList.first, col);
-            resacc->toPixel(locList.first - mStart.mY, col - mStart.mX);
-            for (int band = 0; band < mBands; ++band)
-            {
-               double val = Service<ModelServices>()->getDataValue(mEncoding, acc->getColumn(), band);
-               pixelMat.at<double>(band, 0) = val;
-            }
-
-            pixelMat -= mLocal ? localMuMat : mMuMat;
-            cv::Mat tempMat(1, mBands, CV_64F);
-            cv::Mat resMat(1, 1, CV_64F);
-            try
-            {
-               cv::gemm(pixelMat, mLocal ? localCovMat : mCovMat, 1.0, cv::Mat(), 0.0, tempMat, cv::GEMM_1_T);
-               cv::gemm(tempMat, pixelMat, 1.0, cv::Mat(), 0.0, resMat);
-            }
-            catch (const cv::Exception& e)
-            {
-               throw CvExceptionWrapper(e.code);
-            }
-            *reinterpret_cast<double*>(resacc->getColumn()) = resMat.at<double>(0,0);
          }
          return 0;
       }
+
+   private:
+      void readPixel(DataAccessor& acc, int row, int col, std::vector<double>& pixel) const
+      {
+         acc->toPixel(row, col);
+         ENSURE(acc.isValid());
+         switchOnEncoding(mEncoding, readBandData, acc->getColumn(), pixel);
+      }
+
+      // adds or removes one row of a strip to the per column sums
+      void accumulateRow(DataAccessor& acc, int row, int firstCol, int stripCols, const std::vector<double>& shift,
+         double sign, std::vector<double>& pixel, std::vector<double>& columnSums,
+         std::vector<double>& columnOuters) const
+      {
+         const std::vector<double>::size_type bands = pixel.size();
+         const std::vector<double>::size_type packedSize = bands * (bands + 1) / 2;
+         for (int index = 0; index < stripCols; ++index)
+         {
+            readPixel(acc, row, firstCol + index, pixel);
+            accumulate(&shift.front(), -1.0, bands, &pixel.front());
+            accumulate(&pixel.front(), sign, bands, &columnSums[index * bands]);
+            accumulateOuter(pixel, sign, &columnOuters[index * packedSize]);
+         }
+      }
+   };
+
+   template<typename T>
+   void copyBandData(T* pPtr, double* pOutput, int bands)
+   {
+      for (int band = 0; band < bands; ++band)
+      {
+         pOutput[band] = static_cast<double>(pPtr[band]);
+      }
+   }
+
+   /**
+    * Maintains the background statistics for causal RX.
+    *
+    * Each line is scored against the statistics of the lines before it and is then added
+    * to them, so only the current line and the bands x bands sums are held in memory.
+    * The sums of x and xx' are scaled by the forgetting factor before a line is added so
+    * older lines can be down weighted when the background drifts along track.
+    */
+   class CausalRxStatistics
+   {
+   public:
+      CausalRxStatistics(int bands, double forgettingFactor) :
+         mForgettingFactor(forgettingFactor),
+         mWeight(0.0),
+         mShift(1, bands, CV_64F, cv::Scalar(0.0)),
+         mSum(1, bands, CV_64F, cv::Scalar(0.0)),
+         mOuter(bands, bands, CV_64F, cv::Scalar(0.0))
+      {
+      }
+
+      bool isReady() const
+      {
+         return mWeight > 0.0;
+      }
+
+      // pixels holds one pixel per row
+      void addLine(const cv::Mat& pixels)
+      {
+         if (mWeight == 0.0)
+         {
+            // the sums are kept relative to the first pixel so xx' stays close in magnitude
+            // to the covariance and little is lost when the mean is removed
+            pixels.row(0).copyTo(mShift);
+         }
+         center(pixels, mShift);
+
+         cv::Mat lineSum;
+         cv::Mat lineOuter;
+         cv::reduce(mCentered, lineSum, 0, CV_REDUCE_SUM);
+         cv::gemm(mCentered, mCentered, 1.0, cv::Mat(), 0.0, lineOuter, cv::GEMM_1_T);
+         cv::addWeighted(mSum, mForgettingFactor, lineSum, 1.0, 0.0, mSum);
+         cv::addWeighted(mOuter, mForgettingFactor, lineOuter, 1.0, 0.0, mOuter);
+         mWeight = mForgettingFactor * mWeight + pixels.rows;
+      }
+
+      void score(const cv::Mat& pixels, std::vector<double>& scores)
+      {
+         // the inverse is refreshed from the recursive sums once per line, which costs less
+         // than scoring the line and does not drift the way chained rank one updates can
+         cv::Mat mean = mSum / mWeight;
+         cv::Mat covMat = mOuter / mWeight - mean.t() * mean;
+         cv::Mat invCovMat;
+         cv::invert(covMat, invCovMat, cv::DECOMP_SVD);
+         center(pixels, mShift + mean);
+
+         cv::Mat product;
+         cv::gemm(mCentered, invCovMat, 1.0, cv::Mat(), 0.0, product);
+         scores.resize(pixels.rows);
+         for (int index = 0; index < pixels.rows; ++index)
+         {
+            scores[index] = mCentered.row(index).dot(product.row(index));
+         }
+      }
+
+   private:
+      void center(const cv::Mat& pixels, const cv::Mat& origin)
+      {
+         mCentered.create(pixels.rows, pixels.cols, CV_64F);
+         for (int index = 0; index < pixels.rows; ++index)
+         {
+            cv::Mat centeredRow = mCentered.row(index);
+            cv::subtract(pixels.row(index), origin, centeredRow);
+         }
+      }
+
+      double mForgettingFactor;
+      double mWeight;
+      cv::Mat mShift;
+      cv::Mat mSum;
+      cv::Mat mOuter;
+      cv::Mat mCentered;
    };
 }
 
@@ -301,6 +788,15 @@ bool Rx::getInputSpecification(PlugInArgList*& pArgList)
    VERIFY(pArgList->addArg<unsigned int>("Subspace Components", 
                                     "Number of components to strip for subspace RX. "
                                     "If this is not set or is set to 0, use standard RX."));
+   VERIFY(pArgList->addArg<bool>("Causal", false, "If true, process the rows in order and score each row against "
+                                    "the statistics of the rows before it. This can not be combined with local "
+                                    "statistics."));
+   VERIFY(pArgList->addArg<double>("Forgetting Factor", 1.0, "Weight kept by the previous rows each time a row is "
+                                    "added to the causal statistics. Must be greater than 0 and at most 1. "
+                                    "1 weights all rows equally."));
+   VERIFY(pArgList->addArg<bool>("Single Precision", false, "If true, global RX is calculated in single precision and "
+                                    "all results are stored as 4 byte floats, halving the memory used by the results. "
+                                    "Local and causal statistics are always accumulated in double precision."));
    return true;
 }
 
@@ -335,6 +831,12 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    useLocal = useLocal && pInArgList->getPlugInArgValue("Local Height", localHeight);
    unsigned int components = 0;
    bool useSubspace = pInArgList->getPlugInArgValue("Subspace Components", components);
+   bool useCausal = false;
+   pInArgList->getPlugInArgValue("Causal", useCausal);
+   double forgettingFactor = 1.0;
+   pInArgList->getPlugInArgValue("Forgetting Factor", forgettingFactor);
+   bool singlePrecision = false;
+   pInArgList->getPlugInArgValue("Single Precision", singlePrecision);
 
    // display options dialog
    if (!isBatch())
@@ -359,6 +861,9 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       dlg.setLocalSize(localWidth, localHeight);
       dlg.setSubspace(useSubspace);
       dlg.setSubspaceComponents(components);
+      dlg.setCausal(useCausal);
+      dlg.setForgettingFactor(forgettingFactor);
+      dlg.setSinglePrecision(singlePrecision);
       if (dlg.exec() == QDialog::Rejected)
       {
          progress.report("Canceled by user", 100, ABORT, true);
@@ -373,6 +878,9 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       dlg.getLocalSize(localWidth, localHeight);
       useSubspace = dlg.isSubspace();
       components = dlg.getSubspaceComponents();
+      useCausal = dlg.isCausal();
+      forgettingFactor = dlg.getForgettingFactor();
+      singlePrecision = dlg.isSinglePrecision();
    }
 
    if (pAoi != NULL)
@@ -402,6 +910,16 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
          0, ERRORS, true);
       return false;
    }
+   if (useCausal && useLocal)
+   {
+      progress.report("Causal RX can not be combined with local statistics.", 0, ERRORS, true);
+      return false;
+   }
+   if (useCausal && (forgettingFactor <= 0.0 || forgettingFactor > 1.0))
+   {
+      progress.report("Invalid forgetting factor. Must be greater than 0 and at most 1.", 0, ERRORS, true);
+      return false;
+   }
    if (useSubspace && (components <= 0 || components >= pDesc->getBandCount()))
    {
       progress.report("Invalid number of subspace components. Must be 1 or more and less than the number of bands.", 
@@ -419,8 +937,12 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    string filterInputName = "RX Filtered Input";
    string resultsName = "RX Results";
 
+   // Global subspace RX removes the leading components while scoring. Local and causal RX need
+   // the neighbors or earlier rows of the reconstructed data so they run on a filtered copy.
+   bool fusedSubspace = useSubspace && !useLocal && !useCausal;
+
    // Calculate PCA, remove "components" and invert the PCA...the result will be pRaster
-   if (useSubspace)
+   if (useSubspace && !fusedSubspace)
    {
       //retrieve the input bitmask iterator, a separate one is created because
       //we'll have to output a new AOI relative to the selected area
@@ -797,7 +1319,7 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
 
    // calculate global covariance matrix
    RasterElement* pCov = NULL;
-   if (!useLocal)
+   if (!useLocal && !useCausal)
    {
       bool success = true;
       ExecutableResource covar("Covariance", std::string(), progress.getCurrentProgress(), isBatch());
@@ -807,9 +1329,15 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       {
          success &= covar->getInArgList().setPlugInArgValue("AOI", pAoi);
       }
+      if (fusedSubspace)
+      {
+         // subspace RX whitens with the eigen vectors of the covariance instead of its inverse
+         bool bInverse = false;
+         success &= covar->getInArgList().setPlugInArgValue("ComputeInverse", &bInverse);
+      }
       success &= covar->execute();
       pCov = static_cast<RasterElement*>(
-         Service<ModelServices>()->getElement("Inverse Covariance Matrix", 
+         Service<ModelServices>()->getElement(fusedSubspace ? "Covariance Matrix" : "Inverse Covariance Matrix",
          TypeConverter::toString<RasterElement>(), pElement));
       success &= pCov != NULL;
       if (!success)
@@ -828,34 +1356,62 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       return false;
    }
 
-   FactoryResource<DataRequest> pReq;
-   pReq->setInterleaveFormat(BIP);
-   pReq->setRows(pDesc->getActiveRow(iter.getBoundingBoxStartRow()), pDesc->getActiveRow(iter.getBoundingBoxEndRow()));
-   pReq->setColumns(pDesc->getActiveColumn(iter.getBoundingBoxStartColumn()), 
-                    pDesc->getActiveColumn(iter.getBoundingBoxEndColumn()));
-   DataAccessor acc(pElement->getDataAccessor(pReq.release()));
-
    // create results element
    ModelResource<RasterElement> pResult(createResults(iter.getNumSelectedRows(), iter.getNumSelectedColumns(), 1, 
-      resultsName, FLT8BYTES, pElement));
+      resultsName, singlePrecision ? FLT4BYTES : FLT8BYTES, pElement));
    if (pResult.get() == NULL)
    {
       progress.report("Unable to create results.", 0, ERRORS, true);
       return false;
    }
 
-   // setup write data accessor
-   FactoryResource<DataRequest> pResReq;
-   pResReq->setWritable(true);
-   DataAccessor resacc(pResult->getDataAccessor(pResReq.release()));
-   if (!acc.isValid() || !resacc.isValid())
+   // execute Rx
+   ThresholdLayer* pLayer = NULL;
+   if (useCausal)
    {
-      progress.report("Unable to access data.", 0, ERRORS, true);
-      return false;
+      // causal RX scores each row as it arrives so the results are displayed and output before it runs
+      if (!isBatch())
+      {
+         pLayer = createResultsLayer(pView, pResult.get(), LocationType(iter.getBoundingBoxStartColumn() + startCol,
+            iter.getBoundingBoxStartRow() + startRow));
+      }
+      if (pOutArgList != NULL)
+      {
+         pOutArgList->setPlugInArgValue<RasterElement>("Results", pResult.get());
+      }
+      if (!executeCausal(pElement, iter, pResult.get(), forgettingFactor, progress))
+      {
+         // the results are destroyed on return so nothing may be left referring to them
+         if (pLayer != NULL)
+         {
+            pView->deleteLayer(pLayer);
+         }
+         if (pOutArgList != NULL)
+         {
+            pOutArgList->setPlugInArgValue<RasterElement>("Results", NULL);
+         }
+         return false;
+      }
    }
-
-   // execute Rx
+   else
    { // scope temp matrices
+      // setup read and write data accessors
+      FactoryResource<DataRequest> pReq;
+      pReq->setInterleaveFormat(BIP);
+      pReq->setRows(pDesc->getActiveRow(iter.getBoundingBoxStartRow()),
+         pDesc->getActiveRow(iter.getBoundingBoxEndRow()));
+      pReq->setColumns(pDesc->getActiveColumn(iter.getBoundingBoxStartColumn()), 
+                       pDesc->getActiveColumn(iter.getBoundingBoxEndColumn()));
+      DataAccessor acc(pElement->getDataAccessor(pReq.release()));
+      FactoryResource<DataRequest> pResReq;
+      pResReq->setWritable(true);
+      DataAccessor resacc(pResult->getDataAccessor(pResReq.release()));
+      if (!acc.isValid() || !resacc.isValid())
+      {
+         progress.report("Unable to access data.", 0, ERRORS, true);
+         return false;
+      }
+
       int bands = pDesc->getBandCount();
       EncodingType encoding = pDesc->getDataType();
       cv::Mat covMat;
@@ -872,6 +1428,23 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
             progress.report("OpenCV exception: " + std::string(e.what()), 0, ERRORS);
             return false;
          }
+         if (fusedSubspace)
+         {
+            cv::Mat whitening;
+            if (!computeSubspaceWhitening(covMat, components, whitening))
+            {
+               progress.report("Unable to calculate eigen vectors.", 0, ERRORS, true);
+               return false;
+            }
+            covMat = whitening;
+         }
+         if (singlePrecision)
+         {
+            // the matrix is inverted or decomposed in double precision and only narrowed for scoring
+            cv::Mat narrowed;
+            covMat.convertTo(narrowed, CV_32F);
+            covMat = narrowed;
+         }
 
          std::vector<double> meansVector = SpectralUtilities::calculateMeans(pElement, iter,
             progress, &mAborted);
@@ -881,32 +1454,44 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
             //user canceled
             return false;
          }
-         muMat = cv::Mat(bands, 1, CV_64F, &meansVector[0]);
+         // copy the means since the vector goes out of scope before the map runs
+         muMat = cv::Mat(bands, 1, CV_64F, &meansVector[0]).clone();
       }
 
-      // generate location index map from the bitmask iterator
-      QMap<int, QList<int> > locationMap;
-      for (; iter != iter.end(); ++iter)
+      // work is split in to contiguous ranges of rows and each worker finds the selected
+      // pixels of its rows directly from the bitmask
+      int firstRow = iter.getBoundingBoxStartRow();
+      int lastRow = iter.getBoundingBoxEndRow();
+      LocationType start(iter.getBoundingBoxStartColumn(), iter.getBoundingBoxStartRow());
+      QFuture<int> rx;
+      if (useLocal)
       {
-         LocationType loc;
-         iter.getPixelLocation(loc);
-         locationMap[loc.mY].push_back(loc.mX);
+         // the local statistics are slid through blocks of rows so each thread gets a block
+         int localWidthOffset = (localWidth - 1) / 2;
+         int localHeightOffset = (localHeight - 1) / 2;
+         int blockHeight = LocalRxMap::getBlockHeight(localHeightOffset);
+         QList<QPair<int, int> > blocks;
+         for (int row = firstRow; row <= lastRow; row += blockHeight)
+         {
+            blocks.push_back(qMakePair(row, std::min(lastRow, row + blockHeight - 1)));
+         }
+         LocalRxMap localRxMap(pElement, pResult.get(), start, iter, localWidthOffset, localHeightOffset);
+         rx = QtConcurrent::mapped(blocks, localRxMap);
       }
-
-      // arrange the location index map by row with a list of columns
-      QList<QPair<int, QList<int> > > locations;
-      foreach(int key, locationMap.keys())
+      else
       {
-         locations.push_back(qMakePair(key, locationMap[key]));
+         // a few ranges per thread balance the load when the AOI is uneven
+         int blockHeight = std::max(1, (lastRow - firstRow + 1) / (4 * std::max(1, QThread::idealThreadCount())));
+         QList<QPair<int, int> > blocks;
+         for (int row = firstRow; row <= lastRow; row += blockHeight)
+         {
+            blocks.push_back(qMakePair(row, std::min(lastRow, row + blockHeight - 1)));
+         }
+
+         // setup and run the Rx map-reduce
+         RxMap rxMap(pElement, pResult.get(), start, iter, covMat, muMat, fusedSubspace);
+         rx = QtConcurrent::mapped(blocks, rxMap);
       }
-      // setup and run the Rx map-reduce
-      int localWidthOffset = useLocal ? ((localWidth - 1) / 2) : 0;
-      int localHeightOffset = useLocal ? ((localHeight - 1) / 2) : 0;
-      RxMap rxMap(pElement, pResult.get(),
-         LocationType(iter.getBoundingBoxStartColumn(), iter.getBoundingBoxStartRow()), covMat, muMat,
-         localWidthOffset, localHeightOffset);
-      QFuture<int> rx;
-      rx = QtConcurrent::mapped(locations, rxMap);
       bool isCancelling = false;
       while (rx.isRunning())
       {
@@ -961,14 +1546,15 @@ bool Rx::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    // display results
    if (!isBatch())
    {
-      ThresholdLayer* pLayer = static_cast<ThresholdLayer*>(pView->createLayer(THRESHOLD, pResult.get()));
-      pLayer->setXOffset(iter.getBoundingBoxStartColumn() + startCol);
-      pLayer->setYOffset(iter.getBoundingBoxStartRow() + startRow);
-      pLayer->setPassArea(UPPER);
-      pLayer->setRegionUnits(STD_DEV);
+      if (pLayer == NULL)
+      {
+         pLayer = createResultsLayer(pView, pResult.get(), LocationType(iter.getBoundingBoxStartColumn() + startCol,
+            iter.getBoundingBoxStartRow() + startRow));
+      }
+      // the threshold is in standard deviations of the scores so it is set once they are all available
       pLayer->setFirstThreshold(pLayer->convertThreshold(STD_DEV, threshold, RAW_VALUE));
    }
-   if (pOutArgList != NULL)
+   if (pOutArgList != NULL && !useCausal)
    {
       pOutArgList->setPlugInArgValue<RasterElement>("Results", pResult.get());
    }
@@ -998,6 +1584,120 @@ RasterElement* Rx::createResults(int numRows, int numColumns, int numBands, cons
    return pResult.release();
 }
 
+ThresholdLayer* Rx::createResultsLayer(SpatialDataView* pView, RasterElement* pResult, const LocationType& offset)
+{
+   ThresholdLayer* pLayer = static_cast<ThresholdLayer*>(pView->createLayer(THRESHOLD, pResult));
+   pLayer->setXOffset(offset.mX);
+   pLayer->setYOffset(offset.mY);
+   pLayer->setPassArea(UPPER);
+   pLayer->setRegionUnits(STD_DEV);
+   return pLayer;
+}
+
+bool Rx::executeCausal(RasterElement* pElement, const BitMaskIterator& iter, RasterElement* pResult,
+   double forgettingFactor, ProgressTracker& progress)
+{
+   const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+   const RasterDataDescriptor* pResDesc = static_cast<const RasterDataDescriptor*>(pResult->getDataDescriptor());
+   int bands = pDesc->getBandCount();
+   EncodingType encoding = pDesc->getDataType();
+   EncodingType resultType = pResDesc->getDataType();
+   int firstRow = iter.getBoundingBoxStartRow();
+   int lastRow = iter.getBoundingBoxEndRow();
+   int firstCol = iter.getBoundingBoxStartColumn();
+   int lastCol = iter.getBoundingBoxEndColumn();
+
+   CausalRxStatistics statistics(bands, forgettingFactor);
+   cv::Mat line;
+   try
+   {
+      line = cv::Mat(lastCol - firstCol + 1, bands, CV_64F);
+   }
+   catch (const cv::Exception& e)
+   {
+      progress.report("OpenCV exception: " + std::string(e.what()), 0, ERRORS);
+      return false;
+   }
+   std::vector<int> lineCols;
+   std::vector<double> scores;
+   std::vector<std::pair<int, int> > spans;
+   QTime lastUpdate;
+   lastUpdate.start();
+   for (int row = firstRow; row <= lastRow; ++row)
+   {
+      // only the current row is requested so memory stays bounded for long collections
+      FactoryResource<DataRequest> pReq;
+      pReq->setInterleaveFormat(BIP);
+      pReq->setRows(pDesc->getActiveRow(row), pDesc->getActiveRow(row));
+      pReq->setColumns(pDesc->getActiveColumn(firstCol), pDesc->getActiveColumn(lastCol));
+      DataAccessor acc(pElement->getDataAccessor(pReq.release()));
+      FactoryResource<DataRequest> pResReq;
+      pResReq->setRows(pResDesc->getActiveRow(row - firstRow), pResDesc->getActiveRow(row - firstRow));
+      pResReq->setWritable(true);
+      DataAccessor resacc(pResult->getDataAccessor(pResReq.release()));
+      if (!acc.isValid() || !resacc.isValid())
+      {
+         progress.report("Unable to access data.", 0, ERRORS, true);
+         return false;
+      }
+
+      lineCols.clear();
+      getSelectedSpans(iter, row, firstCol, lastCol, spans);
+      for (std::vector<std::pair<int, int> >::const_iterator span = spans.begin(); span != spans.end(); ++span)
+      {
+         acc->toPixel(row, span->first);
+         for (int col = span->first; col <= span->second; ++col)
+         {
+            switchOnEncoding(encoding, copyBandData, acc->getColumn(),
+               line.ptr<double>(static_cast<int>(lineCols.size())), bands);
+            lineCols.push_back(col);
+            acc->nextColumn();
+         }
+      }
+
+      if (!lineCols.empty())
+      {
+         cv::Mat pixels = line.rowRange(0, static_cast<int>(lineCols.size()));
+         try
+         {
+            // the first row has no background to be scored against
+            scores.assign(lineCols.size(), 0.0);
+            if (statistics.isReady())
+            {
+               statistics.score(pixels, scores);
+            }
+            statistics.addLine(pixels);
+         }
+         catch (const cv::Exception& e)
+         {
+            progress.report("OpenCV exception: " + std::string(e.what()), 0, ERRORS);
+            return false;
+         }
+         for (std::vector<int>::size_type index = 0; index < lineCols.size(); ++index)
+         {
+            resacc->toPixel(row - firstRow, lineCols[index] - firstCol);
+            setScore(resacc, resultType, scores[index]);
+         }
+      }
+
+      // each row is available as soon as it is scored but notifications are limited so
+      // redrawing and statistics updates don't dominate the processing
+      if (lastUpdate.elapsed() > 1000)
+      {
+         pResult->updateData();
+         lastUpdate.restart();
+      }
+      progress.report("Calculating causal RX", (row - firstRow) * 99 / (lastRow - firstRow + 1), NORMAL);
+      if (isAborted())
+      {
+         progress.report("User canceled operation.", 100, ABORT, true);
+         return false;
+      }
+   }
+   pResult->updateData();
+   return true;
+}
+
 void Rx::clearPreviousResults(const string& sigName, RasterElement* pElement)
 {
    ModelResource<RasterElement> pResult(static_cast<RasterElement*>(
@@ -13,11 +13,16 @@
 #include <string>
 
 #include "AlgorithmShell.h"
+#include "LocationType.h"
 #include "TypesFile.h"
 
 #include <QtCore/QtConcurrentMap>
 
+class BitMaskIterator;
+class ProgressTracker;
 class RasterElement;
+class SpatialDataView;
+class ThresholdLayer;
 
 class Rx : public AlgorithmShell
 {
@@ -33,6 +38,9 @@ private:
    RasterElement* createResults(int numRows, int numColumns, int numBands, const std::string& sigName, 
       EncodingType eType, RasterElement* pElement);
    void clearPreviousResults(const std::string& sigName, RasterElement* pElement);
+   ThresholdLayer* createResultsLayer(SpatialDataView* pView, RasterElement* pResult, const LocationType& offset);
+   bool executeCausal(RasterElement* pElement, const BitMaskIterator& iter, RasterElement* pResult,
+      double forgettingFactor, ProgressTracker& progress);
 };
 
 // This subclass of QtConcurrent::Exception is required to do proper exception
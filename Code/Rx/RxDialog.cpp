@@ -61,6 +61,21 @@ void RxDialog::setSubspaceComponents(unsigned int components)
    mpComponents->setValue(components);
 }
 
+void RxDialog::setCausal(bool enabled)
+{
+   mpCausalGroup->setChecked(enabled);
+}
+
+void RxDialog::setForgettingFactor(double factor)
+{
+   mpForgettingFactor->setValue(factor);
+}
+
+void RxDialog::setSinglePrecision(bool enabled)
+{
+   mpSinglePrecision->setChecked(enabled);
+}
+
 double RxDialog::getThreshold() const
 {
    return mpThreshold->value();
@@ -96,3 +111,18 @@ unsigned int RxDialog::getSubspaceComponents() const
 {
    return mpComponents->value();
 }
+
+bool RxDialog::isCausal() const
+{
+   return mpCausalGroup->isChecked();
+}
+
+double RxDialog::getForgettingFactor() const
+{
+   return mpForgettingFactor->value();
+}
+
+bool RxDialog::isSinglePrecision() const
+{
+   return mpSinglePrecision->isChecked();
+}
@@ -29,6 +29,9 @@ public:
    void setLocalSize(unsigned int width, unsigned int height);
    void setSubspace(bool enabled);
    void setSubspaceComponents(unsigned int components);
+   void setCausal(bool enabled);
+   void setForgettingFactor(double factor);
+   void setSinglePrecision(bool enabled);
 
    double getThreshold() const;
    QString getAoi() const;
@@ -36,6 +39,9 @@ public:
    void getLocalSize(unsigned int& width, unsigned int& height) const;
    bool isSubspace() const;
    unsigned int getSubspaceComponents() const;
+   bool isCausal() const;
+   double getForgettingFactor() const;
+   bool isSinglePrecision() const;
 };
 
 #endif
\ No newline at end of file
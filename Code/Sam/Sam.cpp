@@ -23,6 +23,7 @@
 #include "PlugInRegistration.h"
 #include "PlugInResource.h"
 #include "ProgressTracker.h"
+#include "PseudocolorMerger.h"
 #include "RasterDataDescriptor.h"
 #include "RasterElement.h"
 #include "RasterUtilities.h"
@@ -31,6 +32,7 @@
 #include "SamDlg.h"
 #include "SamErr.h"
 #include "Signature.h"
+#include "SpectralKernels.h"
 #include "SpectralUtilities.h"
 #include "SpectralVersion.h"
 #include "Statistics.h"
@@ -41,6 +43,19 @@
 
 using namespace std;
 
+namespace
+{
+   double computeSpectrumMagnitude(const vector<double>& spectrum)
+   {
+      double spectrumMag = 0.0;
+      for (vector<double>::size_type index = 0; index < spectrum.size(); ++index)
+      {
+         spectrumMag += spectrum[index] * spectrum[index];
+      }
+      return sqrt(spectrumMag);
+   }
+}
+
 REGISTER_PLUGIN_BASIC(SpectralSam, Sam);
 
 Sam::Sam() : AlgorithmPlugIn(&mInputs), mpSamGui(NULL), mpSamAlg(NULL), mpProgress(NULL)
@@ -77,6 +92,17 @@ bool Sam::populateBatchInputArgList(PlugInArgList* pInArgList)
    VERIFY(pInArgList->addArg<bool>("Create Pseudocolor", mInputs.mbCreatePseudocolor, "Flag for whether a single "
       "pseudocolor layer should be created instead of multiple threshold layers if multiple target signatures are "
       "used and the results are displayed.  A pseudocolor layer is created by default if results are displayed."));
+   VERIFY(pInArgList->addArg<bool>("Single Pass", mInputs.mbSinglePass, "Flag for whether all target signatures "
+      "should be scored in a single pass through the cube.  The spectral angles are written to one raster element "
+      "with a band per signature and the best match for each pixel is written to a separate class map.  Signatures "
+      "are processed one at a time by default."));
+   VERIFY(pInArgList->addArg<bool>("Classification Only", mInputs.mbClassifyOnly, "Flag for whether only the "
+      "best matching signature within the threshold should be saved for each pixel.  The per signature angles "
+      "are not saved and a compact 8 or 16 bit class map is created in a single pass through the cube.  The "
+      "per signature angles are saved by default."));
+   VERIFY(pInArgList->addArg<bool>("Create Best Angle Band", mInputs.mbBestAngle, "Flag for whether the angle of "
+      "the best matching signature should be saved for each pixel when \"Classification Only\" is set.  The "
+      "best angle is not saved by default."));
    return true;
 }
 
@@ -92,7 +118,11 @@ bool Sam::populateInteractiveInputArgList(PlugInArgList* pInArgList)
 bool Sam::populateDefaultOutputArgList(PlugInArgList* pOutArgList)
 {
    VERIFY(pOutArgList->addArg<RasterElement>("Sam Results", NULL, "Raster element resulting from the "
-      "SAM operation."));
+      "SAM operation.  When only classifying pixels this is the best angle band if one was requested or the "
+      "class map."));
+   VERIFY(pOutArgList->addArg<RasterElement>("Sam Class Map", NULL, "Raster element containing the 1-based index "
+      "of the best matching signature for each pixel or 0 if no signature is within the threshold.  This is only "
+      "created when SAM is run in single pass or classification only mode."));
    return true;
 }
 
@@ -132,6 +162,9 @@ bool Sam::parseInputArgList(PlugInArgList* pInArgList)
       VERIFY(pInArgList->getPlugInArgValue("Display Results", mInputs.mbDisplayResults));
       VERIFY(pInArgList->getPlugInArgValue("Results Name", mInputs.mResultsName));
       VERIFY(pInArgList->getPlugInArgValue("Create Pseudocolor", mInputs.mbCreatePseudocolor));
+      VERIFY(pInArgList->getPlugInArgValue("Single Pass", mInputs.mbSinglePass));
+      VERIFY(pInArgList->getPlugInArgValue("Classification Only", mInputs.mbClassifyOnly));
+      VERIFY(pInArgList->getPlugInArgValue("Create Best Angle Band", mInputs.mbBestAngle));
 
       mInputs.mSignatures = SpectralUtilities::extractSignatures(vector<Signature*>(1, pSignatures));
    }
@@ -148,6 +181,7 @@ bool Sam::parseInputArgList(PlugInArgList* pInArgList)
 bool Sam::setActualValuesInOutputArgList(PlugInArgList* pOutArgList)
 {
    VERIFY(pOutArgList->setPlugInArgValue("Sam Results", mpSamAlg->getResults()));
+   VERIFY(pOutArgList->setPlugInArgValue("Sam Class Map", mpSamAlg->getClassMap()));
    mProgress.upALevel(); // make sure the top-level step is successfull
    return true;
 }
@@ -195,6 +229,7 @@ bool Sam::extractFromGui()
 SamAlgorithm::SamAlgorithm(RasterElement* pElement, Progress* pProgress, bool interactive, const BitMask* pAoi) :
                AlgorithmPattern(pElement, pProgress, interactive, pAoi),
                mpResults(NULL),
+               mpClassMap(NULL),
                mAbortFlag(false)
 {
 }
@@ -243,6 +278,20 @@ bool SamAlgorithm::processAll()
    }
    int iSignatureCount = mInputs.mSignatures.size();
 
+   if (mInputs.mbSinglePass || mInputs.mbClassifyOnly)
+   {
+      if (!processSinglePass(progress, pWavelengths.get()))
+      {
+         return false;
+      }
+      progress.getCurrentStep()->addProperty("Display Layer", mInputs.mbDisplayResults);
+      progress.getCurrentStep()->addProperty("Threshold", mInputs.mThreshold);
+      progress.getCurrentStep()->addProperty("Single Pass", true);
+      progress.getCurrentStep()->addProperty("Classification Only", mInputs.mbClassifyOnly);
+      progress.upALevel();
+      return true;
+   }
+
    // Get colors for all the signatures
    vector<ColorType> layerColors, excludeColors;
    excludeColors.push_back(ColorType(0, 0, 0));
@@ -259,76 +308,14 @@ bool SamAlgorithm::processAll()
    // to combined multiple results in one pseudocolor output layer
    if (iSignatureCount > 1 && mInputs.mbCreatePseudocolor)
    {
-      pPseudocolorMatrix = ModelResource<RasterElement>(createResults(numRows, numColumns, mInputs.mResultsName));
-      pLowestSAMValueMatrix = ModelResource<RasterElement>(createResults(numRows, numColumns, "LowestSAMValue"));
+      pPseudocolorMatrix = ModelResource<RasterElement>(createResults(numRows, numColumns, 1, mInputs.mResultsName));
+      pLowestSAMValueMatrix = ModelResource<RasterElement>(createResults(numRows, numColumns, 1, "LowestSAMValue"));
 
       if (pPseudocolorMatrix.get() == NULL || pLowestSAMValueMatrix.get() == NULL )
       {
          progress.report(SAMERR007, 0, ERRORS, true);
          return false;
       }
-
-      FactoryResource<DataRequest> pseudoRequest;
-      pseudoRequest->setWritable(true);
-      string failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-      DataAccessor pseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-      if (!pseudoAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      FactoryResource<DataRequest> lsvRequest;
-      lsvRequest->setWritable(true);
-      failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(lsvRequest.get(), pLowestSAMValueMatrix.get());
-      DataAccessor lowestSamValueAccessor = pLowestSAMValueMatrix->getDataAccessor(lsvRequest.release());
-      if (!lowestSamValueAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      //Lets zero out all the results incase we connect to an existing matrix.
-      float* pPseudoValue = NULL;
-      float* pLowestValue = NULL;
-
-      for (unsigned int row_ctr = 0; row_ctr < numRows; row_ctr++)
-      {
-         for (unsigned int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-         {
-            if (!pseudoAccessor.isValid() || !lowestSamValueAccessor.isValid())
-            {
-               progress.report("Unable to access results.", 0, ERRORS, true);
-               return false;
-            }
-
-            pLowestValue = reinterpret_cast<float*>(lowestSamValueAccessor->getColumn());
-            pPseudoValue = reinterpret_cast<float*>(pseudoAccessor->getColumn());
-
-            //Initialize the matrices
-            *pPseudoValue = 0.0f;
-            *pLowestValue = 180.0f;
-
-            pseudoAccessor->nextColumn();
-            lowestSamValueAccessor->nextColumn();
-         }
-         pseudoAccessor->nextRow();
-         lowestSamValueAccessor->nextRow();
-      }
    }
    ModelResource<RasterElement> pResults(reinterpret_cast<RasterElement*>(NULL));
 
@@ -353,7 +340,7 @@ bool SamAlgorithm::processAll()
 
       if (mInputs.mbCreatePseudocolor == false || pResults.get() == NULL)
       {
-         pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, rname));
+         pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, 1, rname));
       }
       if (pResults.get() == NULL)
       {
@@ -383,7 +370,15 @@ bool SamAlgorithm::processAll()
       {
          BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
 
-         SamAlgInput samInput(pElement, pResults.get(), spectrumValues, &mAbortFlag, iterChecker, resampledBands);
+         // a single signature is scored as a group of one
+         vector<SamSignatureGroup> groups(1);
+         groups.front().mResampledBands = resampledBands;
+         groups.front().mSignatureIndices.push_back(0);
+         groups.front().mSpectra = spectrumValues;
+         groups.front().mSpectrumMags.push_back(computeSpectrumMagnitude(spectrumValues));
+
+         SamAlgInput samInput(pElement, pResults.get(), NULL, groups, 1, mInputs.mThreshold, false,
+            &mAbortFlag, iterChecker, pPseudocolorMatrix.get(), pLowestSAMValueMatrix.get(), sig_index);
 
          //Output Structure
          SamAlgOutput samOutput;
@@ -413,95 +408,23 @@ bool SamAlgorithm::processAll()
             return false;
          }
 
-         if (isInteractive() || mInputs.mbDisplayResults)
+         // The threads merge each signature in to the pseudocolor output layer as it is computed,
+         // so the temporary results are reused for the next signature
+         bool bMerged = (iSignatureCount > 1 && mInputs.mbCreatePseudocolor);
+         if (!bMerged && (isInteractive() || mInputs.mbDisplayResults))
          {
-            if (iSignatureCount > 1 && mInputs.mbCreatePseudocolor)
+            ColorType color;
+            if (sig_index <= static_cast<int>(layerColors.size()))
             {
-               // Merges results in to one output layer if a Pseudocolor
-               // output layer has been selected
-               FactoryResource<DataRequest> pseudoRequest, currentRequest, lowestRequest;
-               pseudoRequest->setWritable(true);
-               string failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-               DataAccessor daPseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-               if (!daPseudoAccessor.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
-
-               DataAccessor daCurrentAccessor = pResults->getDataAccessor(currentRequest.release());
-
-               lowestRequest->setWritable(true);
-               failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(lowestRequest.get(), pLowestSAMValueMatrix.get());
-               DataAccessor daLowestSAMValue = pLowestSAMValueMatrix->getDataAccessor(lowestRequest.release());
-               if (!daLowestSAMValue.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
-
-               float* pPseudoValue = NULL;
-               float* pCurrentValue = NULL;
-               float* pLowestValue = NULL; 
-
-               for (unsigned  int row_ctr = 0; row_ctr < numRows; row_ctr++)
-               {
-                  for (unsigned  int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-                  {
-                     if (!daPseudoAccessor.isValid() || !daCurrentAccessor.isValid())
-                     {
-                        progress.report("Unable to access data.", 0, ERRORS, true);
-                        return false;
-                     }
-                     daPseudoAccessor->toPixel(row_ctr, col_ctr);
-                     daCurrentAccessor->toPixel(row_ctr, col_ctr);
-
-                     pPseudoValue = reinterpret_cast<float*>(daPseudoAccessor->getColumn());
-                     pCurrentValue = reinterpret_cast<float*>(daCurrentAccessor->getColumn());
-
-                     daLowestSAMValue->toPixel(row_ctr, col_ctr);
-                     pLowestValue = reinterpret_cast<float*>(daLowestSAMValue->getColumn());
-
-                     if (*pCurrentValue <= mInputs.mThreshold)
-                     {
-                        if (*pCurrentValue < *pLowestValue)
-                        {
-                           *pPseudoValue = sig_index+1;
-                           *pLowestValue = *pCurrentValue;
-                        }
-                     }
-                  }
-               }
+               color = layerColors[sig_index];
             }
-            else
-            {
-               ColorType color;
-               if (sig_index <= static_cast<int>(layerColors.size()))
-               {
-                  color = layerColors[sig_index];
-               }
 
-               double dMaxValue = pResults->getStatistics()->getMax();
+            double dMaxValue = pResults->getStatistics()->getMax();
 
-               // Displays results for current signature
-               displayThresholdResults(pResults.release(), color, LOWER, mInputs.mThreshold, dMaxValue, layerOffset);
-            }
+            // Displays results for current signature
+            displayThresholdResults(pResults.release(), color, LOWER, mInputs.mThreshold, dMaxValue, layerOffset);
          }
-         else
+         else if (!bMerged)
          {
             pResults.release();
          }
@@ -553,6 +476,149 @@ bool SamAlgorithm::processAll()
    return bSuccess;
 }
 
+bool SamAlgorithm::processSinglePass(ProgressTracker& progress, Wavelengths* pWavelengths)
+{
+   RasterElement* pElement = getRasterElement();
+   VERIFY(pElement != NULL);
+
+   BitMaskIterator iter(getPixelsToProcess(), pElement);
+   unsigned int numRows = iter.getNumSelectedRows();
+   unsigned int numColumns = iter.getNumSelectedColumns();
+   Opticks::PixelOffset layerOffset(iter.getColumnOffset(), iter.getRowOffset());
+   unsigned int signatureCount = mInputs.mSignatures.size();
+
+   // Resample every signature up front and group the signatures which cover the same bands
+   // so each group is scored with a single product per pixel
+   vector<string> sigNames;
+   vector<SamSignatureGroup> groups;
+   for (unsigned int sig_index = 0; sig_index < signatureCount && !mAbortFlag; ++sig_index)
+   {
+      Signature* pSignature = mInputs.mSignatures[sig_index];
+      sigNames.push_back(pSignature->getName());
+
+      vector<double> spectrumValues;
+      vector<int> resampledBands;
+      if (!resampleSpectrum(pSignature, spectrumValues, pWavelengths, resampledBands))
+      {
+         progress.report("Unable to resample signature " + sigNames.back() + ".", 0, ERRORS, true);
+         return false;
+      }
+
+      // Check for limited spectral coverage and warning log 
+      if (pWavelengths->hasCenterValues() && resampledBands.size() != pWavelengths->getCenterValues().size())
+      {
+         QString buf = QString("Warning SamAlg014: The spectrum %1 only provides spectral coverage for %2 of %3 bands.")
+            .arg(QString::fromStdString(sigNames.back())).arg(resampledBands.size())
+            .arg(pWavelengths->getCenterValues().size());
+         progress.report(buf.toStdString(), 0, WARNING, true);
+      }
+
+      vector<SamSignatureGroup>::size_type group_index = 0;
+      while (group_index < groups.size() && groups[group_index].mResampledBands != resampledBands)
+      {
+         ++group_index;
+      }
+      if (group_index == groups.size())
+      {
+         groups.push_back(SamSignatureGroup());
+         groups.back().mResampledBands = resampledBands;
+      }
+      groups[group_index].mSignatureIndices.push_back(sig_index);
+      groups[group_index].mSpectrumMags.push_back(computeSpectrumMagnitude(spectrumValues));
+      groups[group_index].mSpectra.insert(groups[group_index].mSpectra.end(),
+         spectrumValues.begin(), spectrumValues.end());
+   }
+
+   // When only classifying, the per signature angles are never stored
+   ModelResource<RasterElement> pResults(reinterpret_cast<RasterElement*>(NULL));
+   if (!mInputs.mbClassifyOnly)
+   {
+      pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, signatureCount,
+         mInputs.mResultsName));
+   }
+   else if (mInputs.mbBestAngle)
+   {
+      pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, 1,
+         mInputs.mResultsName + " Best Angle"));
+   }
+   ModelResource<RasterElement> pClassMap(createClassMap(numRows, numColumns, signatureCount,
+      mInputs.mResultsName + " Classes"));
+   if ((pResults.get() == NULL && (!mInputs.mbClassifyOnly || mInputs.mbBestAngle)) || pClassMap.get() == NULL)
+   {
+      progress.report(SAMERR017, 0, ERRORS, true);
+      return false;
+   }
+   DynamicObject* pClassMetadata = pClassMap->getMetadata();
+   if (pClassMetadata != NULL)
+   {
+      pClassMetadata->setAttribute("Signature Names", sigNames);
+   }
+   if (pResults.get() != NULL && !mInputs.mbClassifyOnly)
+   {
+      DynamicObject* pResultsMetadata = pResults->getMetadata();
+      if (pResultsMetadata != NULL)
+      {
+         pResultsMetadata->setAttribute("Signature Names", sigNames);
+      }
+   }
+
+   BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
+   SamAlgInput samInput(pElement, pResults.get(), pClassMap.get(), groups, signatureCount, mInputs.mThreshold,
+      mInputs.mbClassifyOnly, &mAbortFlag, iterChecker, NULL, NULL, 0);
+   SamAlgOutput samOutput;
+   string message = QString("SAM running on %1 signatures").arg(signatureCount).toStdString();
+   mta::ProgressObjectReporter reporter(message, getProgress());
+   mta::MultiThreadedAlgorithm<SamAlgInput, SamAlgOutput, SamThread>
+      mtaSam(mta::getNumRequiredThreads(numRows),
+      samInput,
+      samOutput,
+      &reporter);
+   mtaSam.run();
+   if (mAbortFlag)
+   {
+      progress.report("User aborted the operation.", 0, ABORT, true);
+      mAbortFlag = false;
+      return false;
+   }
+
+   mpClassMap = pClassMap.release();
+   mpClassMap->updateData();
+   mpResults = pResults.release();
+   if (mpResults != NULL)
+   {
+      mpResults->updateData();
+   }
+   else
+   {
+      mpResults = mpClassMap;
+   }
+
+   if (isInteractive() || mInputs.mbDisplayResults)
+   {
+      if (signatureCount > 1 || mInputs.mbClassifyOnly)
+      {
+         displayPseudocolorResults(mpClassMap, sigNames, layerOffset);
+      }
+      else
+      {
+         vector<ColorType> layerColors, excludeColors;
+         excludeColors.push_back(ColorType(0, 0, 0));
+         excludeColors.push_back(ColorType(255, 255, 255));
+         ColorType::getUniqueColors(1, layerColors, excludeColors);
+         ColorType color;
+         if (!layerColors.empty())
+         {
+            color = layerColors.front();
+         }
+         displayThresholdResults(mpResults, color, LOWER, mInputs.mThreshold,
+            mpResults->getStatistics()->getMax(), layerOffset);
+      }
+   }
+
+   progress.report(SAMNORM200, 100, NORMAL);
+   return true;
+}
+
 bool SamAlgorithm::resampleSpectrum(Signature* pSignature, vector<double>& resampledAmplitude,
                                     Wavelengths* pWavelengths, vector<int>& resampledBands)
 {
@@ -629,7 +695,7 @@ bool SamAlgorithm::resampleSpectrum(Signature* pSignature, vector<double>& resam
    return true;
 }
 
-RasterElement* SamAlgorithm::createResults(int numRows, int numColumns, const string& sigName)
+RasterElement* SamAlgorithm::createResults(int numRows, int numColumns, int numBands, const string& sigName)
 {
    RasterElement* pElement = getRasterElement();
    if (pElement == NULL)
@@ -649,11 +715,11 @@ RasterElement* SamAlgorithm::createResults(int numRows, int numColumns, const st
 
    // Create the new results element
    ModelResource<RasterElement> pResults(RasterUtilities::createRasterElement(sigName, numRows, numColumns,
-      FLT4BYTES, true, pElement));
+      numBands, FLT4BYTES, BIP, true, pElement));
    if (pResults.get() == NULL)
    {
       pResults = ModelResource<RasterElement>(RasterUtilities::createRasterElement(sigName, numRows, numColumns,
-         FLT4BYTES, false, pElement));
+         numBands, FLT4BYTES, BIP, false, pElement));
       if (pResults.get() == NULL)
       {
          reportProgress(ERRORS, 0, SAMERR009);
@@ -679,6 +745,44 @@ RasterElement* SamAlgorithm::createResults(int numRows, int numColumns, const st
    return pResults.release();
 }
 
+RasterElement* SamAlgorithm::createClassMap(int numRows, int numColumns, unsigned int classCount,
+                                            const string& name)
+{
+   RasterElement* pElement = getRasterElement();
+   if (pElement == NULL)
+   {
+      return NULL;
+   }
+
+   // Delete an existing element to ensure that the new class map is the correct size
+   Service<ModelServices> pModel;
+
+   RasterElement* pExistingResults = static_cast<RasterElement*>(pModel->getElement(name,
+      TypeConverter::toString<RasterElement>(), pElement));
+   if (pExistingResults != NULL)
+   {
+      pModel->destroyElement(pExistingResults);
+   }
+
+   // Class 0 is reserved for pixels which do not match any signature
+   EncodingType encoding = (classCount <= 255 ? INT1UBYTE : INT2UBYTES);
+   ModelResource<RasterElement> pClassMap(RasterUtilities::createRasterElement(name, numRows, numColumns,
+      1, encoding, BIP, true, pElement));
+   if (pClassMap.get() == NULL)
+   {
+      pClassMap = ModelResource<RasterElement>(RasterUtilities::createRasterElement(name, numRows, numColumns,
+         1, encoding, BIP, false, pElement));
+      if (pClassMap.get() == NULL)
+      {
+         reportProgress(ERRORS, 0, SAMERR009);
+         MessageResource(SAMERR009, "spectral", "2B4E5E0D-7A7D-4C43-9E0B-1F7F3A6C2D54");
+         return NULL;
+      }
+   }
+
+   return pClassMap.release();
+}
+
 bool SamAlgorithm::postprocess()
 {
    return true;
@@ -714,6 +818,11 @@ RasterElement* SamAlgorithm::getResults() const
    return mpResults;
 }
 
+RasterElement* SamAlgorithm::getClassMap() const
+{
+   return mpClassMap;
+}
+
 bool SamAlgorithm::canAbort() const
 {
    return true;
@@ -749,10 +858,10 @@ void SamThread::run()
 template<class T>
 void SamThread::ComputeSam(const T* pDummyData)
 {
-   int reSamBan_index = 0, row_index = 0, col_index = 0;
+   int row_index = 0, col_index = 0;
    float* pResultsData = NULL;
+   void* pClassData = NULL;
    int oldPercentDone = -1;
-   double spectrumMag = 0.0;
    const T* pData=NULL;
    const RasterDataDescriptor* pDescriptor = static_cast<const RasterDataDescriptor*>(
       mInput.mpCube->getDataDescriptor());
@@ -773,35 +882,77 @@ void SamThread::ComputeSam(const T* pDummyData)
       numResultsCols = mInput.mIterCheck.getNumSelectedColumns();
    }
 
-   if (mInput.mpResultsMatrix == NULL)
+   if (mInput.mpResultsMatrix == NULL && mInput.mpClassMatrix == NULL)
    {
       return;
    }
 
+   const RasterElement* pOutputMatrix = (mInput.mpResultsMatrix != NULL ? mInput.mpResultsMatrix :
+      mInput.mpClassMatrix);
    const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
-      mInput.mpResultsMatrix->getDataDescriptor());
+      pOutputMatrix->getDataDescriptor());
    // Gets results matrix that was initialized in ProcessAll()
    mRowRange.mFirst = std::max(0, mRowRange.mFirst);
    mRowRange.mLast = std::min(mRowRange.mLast, static_cast<int>(pDescriptor->getRowCount()) - 1);
-   FactoryResource<DataRequest> pResultRequest;
-   pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
-      pResultDescriptor->getActiveRow(mRowRange.mLast));
-   pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
-      pResultDescriptor->getActiveColumn(numResultsCols - 1));
-   pResultRequest->setWritable(true);
-   DataAccessor resultAccessor = mInput.mpResultsMatrix->getDataAccessor(pResultRequest.release());
-   if (!resultAccessor.isValid())
+   DataAccessor resultAccessor(NULL, NULL);
+   if (mInput.mpResultsMatrix != NULL)
    {
-      return;
+      FactoryResource<DataRequest> pResultRequest;
+      pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
+         pResultDescriptor->getActiveRow(mRowRange.mLast));
+      pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
+         pResultDescriptor->getActiveColumn(numResultsCols - 1));
+      pResultRequest->setWritable(true);
+      resultAccessor = mInput.mpResultsMatrix->getDataAccessor(pResultRequest.release());
+      if (!resultAccessor.isValid())
+      {
+         return;
+      }
+   }
+
+   DataAccessor classAccessor(NULL, NULL);
+   bool wideClasses = false;
+   if (mInput.mpClassMatrix != NULL)
+   {
+      wideClasses = static_cast<const RasterDataDescriptor*>(
+         mInput.mpClassMatrix->getDataDescriptor())->getDataType() == INT2UBYTES;
+      FactoryResource<DataRequest> pClassRequest;
+      pClassRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
+         pResultDescriptor->getActiveRow(mRowRange.mLast));
+      pClassRequest->setColumns(pResultDescriptor->getActiveColumn(0),
+         pResultDescriptor->getActiveColumn(numResultsCols - 1));
+      pClassRequest->setWritable(true);
+      classAccessor = mInput.mpClassMatrix->getDataAccessor(pClassRequest.release());
+      if (!classAccessor.isValid())
+      {
+         return;
+      }
+   }
+
+   // Bands which form one contiguous run are scored in place, all others are packed
+   // into a dense buffer once per pixel so every signature in the group reuses it
+   vector<bool> contiguousGroups;
+   unsigned int maxGroupBands = 0;
+   for (vector<SamSignatureGroup>::const_iterator group = mInput.mGroups.begin();
+      group != mInput.mGroups.end(); ++group)
+   {
+      contiguousGroups.push_back(SpectralKernels::isContiguous(group->mResampledBands));
+      maxGroupBands = std::max(maxGroupBands, static_cast<unsigned int>(group->mResampledBands.size()));
    }
+   vector<T> packedBands(std::max(maxGroupBands, 1U));
 
-   // Resamples and sets search signature 
-   for (reSamBan_index = 0; reSamBan_index < (int) mInput.mResampledBands.size(); ++reSamBan_index)
+   PseudocolorMerger merger(mInput.mpPseudocolorMatrix, mInput.mpLowestValueMatrix, mRowRange.mFirst,
+      mRowRange.mLast, numResultsCols, mInput.mSignatureIndex, mInput.mThreshold, false, 180.0f);
+   if (merger.isEnabled() && !merger.isValid())
    {
-      spectrumMag += mInput.mSpectrum[reSamBan_index] * mInput.mSpectrum[reSamBan_index];
+      return;
    }
+   const double degreesPerRadian = 180.0 / 3.141592654;
 
-   spectrumMag = sqrt(spectrumMag);
+   // The angle is monotonically decreasing in the cosine so the threshold test can be done on
+   // the cosine directly and only the best match needs an acos
+   double threshold = std::max(0.0, std::min(mInput.mThreshold, 180.0));
+   const double cosThreshold = cos(threshold / degreesPerRadian);
    int rowOffset = mInput.mIterCheck.getOffset().mY;
    int startRow = (mRowRange.mFirst + rowOffset);
    int stopRow = (mRowRange.mLast + rowOffset);
@@ -835,63 +986,177 @@ void SamThread::ComputeSam(const T* pDummyData)
 
       for (col_index = startColumn; col_index <= stopColumn; ++col_index)
       {  
-         VERIFYNRV(resultAccessor.isValid());
          VERIFYNRV(accessor.isValid());
-         // Pointer to results data
-         pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
-         if (pResultsData == NULL)
+         // Pointer to results data, one value per signature or the best angle when classifying
+         pResultsData = NULL;
+         if (resultAccessor.isValid())
+         {
+            pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
+            if (pResultsData == NULL)
+            {
+               return;
+            }
+         }
+         pClassData = NULL;
+         if (classAccessor.isValid())
          {
-            return;
+            pClassData = classAccessor->getColumn();
+            VERIFYNRV(pClassData != NULL);
          }
+
+         unsigned int classValue = 0;
          if (mInput.mIterCheck.getPixel(col_index, row_index))
          {
             //Pointer to cube/sensor data
             pData = reinterpret_cast<T*>(accessor->getColumn());
             VERIFYNRV(pData != NULL);
-            *pResultsData = 0.0f;
-            double pixelMag = 0.0;
-            double angle =0.0;
+            double lowestAngle = mInput.mThreshold;
+            double bestCosine = -2.0;
+            bool bMatched = false;
 
-            //Calculates Spectral Angle and Magnitude at current location
-            for (unsigned int reSam_index = 0; 
-               reSam_index < mInput.mResampledBands.size(); ++reSam_index)
+            //Calculates Spectral Angle and Magnitude at current location for every signature in each group
+            for (vector<SamSignatureGroup>::size_type group_index = 0; group_index < mInput.mGroups.size();
+               ++group_index)
             {
-               int resampledBand = mInput.mResampledBands[reSam_index];
-               double cubeVal = pData[resampledBand];
-               angle += cubeVal * mInput.mSpectrum[reSam_index];
-               pixelMag += cubeVal * cubeVal;
+               const SamSignatureGroup* group = &mInput.mGroups[group_index];
+               const unsigned int groupSignatures = group->mSignatureIndices.size();
+               const unsigned int groupBands = group->mResampledBands.size();
+               if (groupBands == 0)
+               {
+                  for (unsigned int sig = 0; sig < groupSignatures && !mInput.mbClassifyOnly; ++sig)
+                  {
+                     pResultsData[group->mSignatureIndices[sig]] = 181.0;
+                  }
+                  continue;
+               }
+
+               const T* pBands = &packedBands.front();
+               if (contiguousGroups[group_index])
+               {
+                  pBands = pData + group->mResampledBands.front();
+               }
+               else
+               {
+                  SpectralKernels::gatherBands(pData, group->mResampledBands, &packedBands.front());
+               }
+
+               double pixelMag = 0.0;
+               double firstDotProduct = 0.0;
+               SpectralKernels::dotProductAndSumOfSquares(pBands, &group->mSpectra.front(), groupBands,
+                  firstDotProduct, pixelMag);
+               pixelMag = sqrt(pixelMag);
+
+               for (unsigned int sig = 0; sig < groupSignatures; ++sig)
+               {
+                  double spectrumMag = group->mSpectrumMags[sig];
+                  unsigned int sigIndex = group->mSignatureIndices[sig];
+                  if (mInput.mbClassifyOnly)
+                  {
+                     if (pixelMag != 0.0 && spectrumMag != 0.0)
+                     {
+                        double cosine = (sig == 0 ? firstDotProduct :
+                           SpectralKernels::dotProduct(pBands, &group->mSpectra[sig * groupBands], groupBands));
+                        cosine /= (pixelMag * spectrumMag);
+                        if (cosine > bestCosine)
+                        {
+                           bestCosine = cosine;
+                           classValue = sigIndex + 1;
+                        }
+                     }
+                     continue;
+                  }
+
+                  double angle = 181.0;
+                  if (pixelMag != 0.0 && spectrumMag != 0.0)
+                  {
+                     angle = (sig == 0 ? firstDotProduct :
+                        SpectralKernels::dotProduct(pBands, &group->mSpectra[sig * groupBands], groupBands));
+                     angle /= (pixelMag * spectrumMag);
+                     if (angle < -1.0)
+                     {
+                        angle = -1.0;
+                     }
+                     if (angle > 1.0)
+                     {
+                        angle = 1.0;
+                     }
+
+                     angle = degreesPerRadian * acos(angle);
+                  }
+
+                  pResultsData[sigIndex] = angle;
+                  if (angle <= mInput.mThreshold && (!bMatched || angle < lowestAngle))
+                  {
+                     bMatched = true;
+                     lowestAngle = angle;
+                     classValue = sigIndex + 1;
+                  }
+               }
             }
-            pixelMag = sqrt(pixelMag);
-            if (pixelMag != 0.0 && spectrumMag != 0.0)
+
+            if (mInput.mbClassifyOnly)
             {
-               angle /= (pixelMag * spectrumMag);
-               if (angle < -1.0)
+               if (pResultsData != NULL)
                {
-                  angle = -1.0;
+                  *pResultsData = 181.0;
+                  if (classValue != 0)
+                  {
+                     *pResultsData = degreesPerRadian * acos(std::max(-1.0, std::min(bestCosine, 1.0)));
+                  }
                }
-               if (angle > 1.0)
+               if (bestCosine < cosThreshold)
                {
-                  angle = 1.0;
+                  classValue = 0;
                }
-
-               angle = (180.0 / 3.141592654) * acos(angle);
-               *pResultsData = angle;
             }
-            else
+         }
+         else if (pResultsData != NULL)
+         {
+            unsigned int resultCount = (mInput.mbClassifyOnly ? 1 : mInput.mSignatureCount);
+            for (unsigned int sig = 0; sig < resultCount; ++sig)
             {
-               *pResultsData = 181.0;
+               pResultsData[sig] = 181.0;
             }
          }
-         else
+
+         if (pResultsData != NULL && !mInput.mbClassifyOnly)
+         {
+            merger.merge(*pResultsData, mInput.mIterCheck.getPixel(col_index, row_index));
+         }
+         if (pClassData != NULL)
          {
-            *pResultsData = 181.0;
+            if (wideClasses)
+            {
+               *reinterpret_cast<unsigned short*>(pClassData) = static_cast<unsigned short>(classValue);
+            }
+            else
+            {
+               *reinterpret_cast<unsigned char*>(pClassData) = static_cast<unsigned char>(classValue);
+            }
          }
+
          //Increment Columns
-         resultAccessor->nextColumn();
          accessor->nextColumn();
+         merger.nextColumn();
+         if (resultAccessor.isValid())
+         {
+            resultAccessor->nextColumn();
+         }
+         if (classAccessor.isValid())
+         {
+            classAccessor->nextColumn();
+         }
       }
       //Increment Rows
-      resultAccessor->nextRow();
       accessor->nextRow();
+      merger.nextRow();
+      if (resultAccessor.isValid())
+      {
+         resultAccessor->nextRow();
+      }
+      if (classAccessor.isValid())
+      {
+         classAccessor->nextRow();
+      }
    }
 }
@@ -32,13 +32,33 @@ struct SamInputs
                  mbDisplayResults(false),
                  mResultsName("SAM Results"),
                  mpAoi(NULL),
-                 mbCreatePseudocolor(true) {}
+                 mbCreatePseudocolor(true),
+                 mbSinglePass(false),
+                 mbClassifyOnly(false),
+                 mbBestAngle(false) {}
    std::vector<Signature*> mSignatures;
    double mThreshold;
    bool mbDisplayResults;
    std::string mResultsName;
    AoiElement* mpAoi;
    bool mbCreatePseudocolor;
+   bool mbSinglePass;
+   bool mbClassifyOnly;
+   bool mbBestAngle;
+};
+
+/**
+ * Signatures which were resampled to the same set of cube bands.
+ *
+ * The spectra are stored one after another in signature order so each spectrum is a dense run
+ * of values which lines up with the pixel's resampled bands.
+ */
+struct SamSignatureGroup
+{
+   std::vector<int> mResampledBands;
+   std::vector<unsigned int> mSignatureIndices;
+   std::vector<double> mSpectra;
+   std::vector<double> mSpectrumMags;
 };
 
 class SamAlgorithm : public AlgorithmPattern
@@ -47,34 +67,50 @@ class SamAlgorithm : public AlgorithmPattern
    bool processAll();
    bool postprocess();
    bool initialize(void* pAlgorithmData);
-   RasterElement* createResults(int numRows, int numColumns, const std::string& sigName);
+   bool processSinglePass(ProgressTracker& progress, Wavelengths* pWavelengths);
+   RasterElement* createResults(int numRows, int numColumns, int numBands, const std::string& sigName);
+   RasterElement* createClassMap(int numRows, int numColumns, unsigned int classCount, const std::string& name);
    bool resampleSpectrum(Signature* pSignature, std::vector<double>& resampledAmplitude, 
       Wavelengths* pWavelengths, std::vector<int>& resampledBands);
    bool canAbort() const;
    bool doAbort();
 
    RasterElement* mpResults;
+   RasterElement* mpClassMap;
    SamInputs mInputs;
    bool mAbortFlag;
 
 public:
    SamAlgorithm(RasterElement* pElement, Progress* pProgress, bool interactive, const BitMask* pAoi);
    RasterElement* getResults() const;
+   RasterElement* getClassMap() const;
 };
 
 struct SamAlgInput
 {
    SamAlgInput(const RasterElement* pCube,
       RasterElement* pResultsMatrix,
-      const std::vector<double>& spectrum,
+      RasterElement* pClassMatrix,
+      const std::vector<SamSignatureGroup>& groups,
+      unsigned int signatureCount,
+      double threshold,
+      bool classifyOnly,
       const bool* pAbortFlag, 
       const BitMaskIterator& iterCheck,
-      const std::vector<int>& resampledBands) : mpCube(pCube),
+      RasterElement* pPseudocolorMatrix,
+      RasterElement* pLowestValueMatrix,
+      int signatureIndex) : mpCube(pCube),
       mpResultsMatrix(pResultsMatrix),
-      mSpectrum(spectrum),
+      mpClassMatrix(pClassMatrix),
+      mGroups(groups),
+      mSignatureCount(signatureCount),
+      mThreshold(threshold),
+      mbClassifyOnly(classifyOnly),
       mpAbortFlag(pAbortFlag),
       mIterCheck(iterCheck),
-      mResampledBands(resampledBands)
+      mpPseudocolorMatrix(pPseudocolorMatrix),
+      mpLowestValueMatrix(pLowestValueMatrix),
+      mSignatureIndex(signatureIndex)
    {
    }
 
@@ -83,11 +119,17 @@ struct SamAlgInput
    }
 
    const RasterElement* mpCube;
-   RasterElement* mpResultsMatrix;
-   const std::vector<double>& mSpectrum;
+   RasterElement* mpResultsMatrix;     // one band per signature, or the best angle when classifying, may be NULL
+   RasterElement* mpClassMatrix;       // optional 8 or 16 bit best match class map, may be NULL
+   const std::vector<SamSignatureGroup>& mGroups;
+   unsigned int mSignatureCount;
+   double mThreshold;
+   bool mbClassifyOnly;                // compare cosines against the threshold without computing every angle
    const bool* mpAbortFlag;
    const BitMaskIterator& mIterCheck;
-   const std::vector<int>& mResampledBands;
+   RasterElement* mpPseudocolorMatrix;  // NULL unless results are merged in to a pseudocolor layer
+   RasterElement* mpLowestValueMatrix;
+   int mSignatureIndex;
 };
 
 class SamThread : public mta::AlgorithmThread
@@ -0,0 +1,107 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2010 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "DataAccessorImpl.h"
+#include "DataRequest.h"
+#include "ObjectResource.h"
+#include "PseudocolorMerger.h"
+#include "RasterDataDescriptor.h"
+#include "RasterElement.h"
+
+namespace
+{
+   DataAccessor getRowAccessor(RasterElement* pMatrix, int firstRow, int lastRow, int numColumns)
+   {
+      const RasterDataDescriptor* pDescriptor =
+         static_cast<const RasterDataDescriptor*>(pMatrix->getDataDescriptor());
+      FactoryResource<DataRequest> pRequest;
+      pRequest->setRows(pDescriptor->getActiveRow(firstRow), pDescriptor->getActiveRow(lastRow));
+      pRequest->setColumns(pDescriptor->getActiveColumn(0), pDescriptor->getActiveColumn(numColumns - 1));
+      pRequest->setWritable(true);
+      return pMatrix->getDataAccessor(pRequest.release());
+   }
+}
+
+PseudocolorMerger::PseudocolorMerger(RasterElement* pPseudocolorMatrix, RasterElement* pBestValueMatrix,
+                                     int firstRow, int lastRow, int numColumns, int signatureIndex,
+                                     double threshold, bool higherIsBetter, float unmatchedValue) :
+   mEnabled(pPseudocolorMatrix != NULL),
+   mPseudocolorAccessor(NULL, NULL),
+   mBestValueAccessor(NULL, NULL),
+   mSignatureIndex(signatureIndex),
+   mThreshold(threshold),
+   mHigherIsBetter(higherIsBetter),
+   mUnmatchedValue(unmatchedValue)
+{
+   if (mEnabled && pBestValueMatrix != NULL)
+   {
+      mPseudocolorAccessor = getRowAccessor(pPseudocolorMatrix, firstRow, lastRow, numColumns);
+      mBestValueAccessor = getRowAccessor(pBestValueMatrix, firstRow, lastRow, numColumns);
+   }
+}
+
+bool PseudocolorMerger::isEnabled() const
+{
+   return mEnabled;
+}
+
+bool PseudocolorMerger::isValid() const
+{
+   return mEnabled && mPseudocolorAccessor.isValid() && mBestValueAccessor.isValid();
+}
+
+void PseudocolorMerger::merge(float value, bool selected)
+{
+   merge(value, mSignatureIndex, selected);
+}
+
+void PseudocolorMerger::merge(float value, int signatureIndex, bool selected)
+{
+   if (!isValid())
+   {
+      return;
+   }
+
+   float* pClass = reinterpret_cast<float*>(mPseudocolorAccessor->getColumn());
+   float* pBest = reinterpret_cast<float*>(mBestValueAccessor->getColumn());
+   if (pClass == NULL || pBest == NULL)
+   {
+      return;
+   }
+
+   bool passes = selected && (mHigherIsBetter ? value >= mThreshold : value <= mThreshold);
+   if (signatureIndex == 0)
+   {
+      *pClass = passes ? 1.0f : 0.0f;
+      *pBest = passes ? value : mUnmatchedValue;
+   }
+   else if (passes && (mHigherIsBetter ? value > *pBest : value < *pBest))
+   {
+      *pClass = static_cast<float>(signatureIndex + 1);
+      *pBest = value;
+   }
+}
+
+void PseudocolorMerger::nextColumn()
+{
+   if (isValid())
+   {
+      mPseudocolorAccessor->nextColumn();
+      mBestValueAccessor->nextColumn();
+   }
+}
+
+void PseudocolorMerger::nextRow()
+{
+   if (isValid())
+   {
+      mPseudocolorAccessor->nextRow();
+      mBestValueAccessor->nextRow();
+   }
+}
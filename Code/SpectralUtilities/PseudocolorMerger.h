@@ -0,0 +1,126 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2010 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef PSEUDOCOLORMERGER_H
+#define PSEUDOCOLORMERGER_H
+
+#include "DataAccessor.h"
+
+class RasterElement;
+
+/**
+ *  Merges per signature detector results into a pseudocolor class matrix
+ *  as they are produced.
+ *
+ *  Each detector thread creates a merger over its own rows of the results
+ *  and calls merge() for every pixel as it is scored, so no separate merge
+ *  pass over the results is needed once all threads have finished.  The
+ *  pseudocolor matrix holds the 1-based index of the best signature which
+ *  passes the threshold, or 0 if no signature passes, and the best value
+ *  matrix holds the score of that signature.  Both matrices are
+ *  single band float raster elements the same size as the results.
+ *
+ *  The first signature initializes both matrices, so they do not need to be
+ *  cleared before the first detector pass.
+ */
+class PseudocolorMerger
+{
+public:
+   /**
+    *  Creates a merger over a range of result rows.
+    *
+    *  @param   pPseudocolorMatrix
+    *           The class matrix.  If this is \c NULL, the merger is disabled
+    *           and merge() does nothing.
+    *  @param   pBestValueMatrix
+    *           The matrix holding the best score seen so far.
+    *  @param   firstRow
+    *           The first row of the results to merge.
+    *  @param   lastRow
+    *           The last row of the results to merge.
+    *  @param   numColumns
+    *           The number of result columns.
+    *  @param   signatureIndex
+    *           The 0-based index of the signature being merged.
+    *  @param   threshold
+    *           The threshold a score must pass to be assigned a class.
+    *  @param   higherIsBetter
+    *           \c True if scores at or above \em threshold pass and higher
+    *           scores are better, \c false if scores at or below
+    *           \em threshold pass and lower scores are better.
+    *  @param   unmatchedValue
+    *           The best value stored for pixels which have not matched any
+    *           signature.
+    */
+   PseudocolorMerger(RasterElement* pPseudocolorMatrix, RasterElement* pBestValueMatrix, int firstRow,
+      int lastRow, int numColumns, int signatureIndex, double threshold, bool higherIsBetter,
+      float unmatchedValue);
+
+   /**
+    *  Queries whether merging was requested.
+    *
+    *  @return  \c True if a pseudocolor matrix was provided, \c false otherwise.
+    */
+   bool isEnabled() const;
+
+   /**
+    *  Queries whether merging was requested and the matrices could be accessed.
+    *
+    *  @return  \c True if merge() will update the matrices, \c false otherwise.
+    */
+   bool isValid() const;
+
+   /**
+    *  Merges the score for the current pixel.
+    *
+    *  @param   value
+    *           The score of the current signature.
+    *  @param   selected
+    *           \c False if the pixel was not processed, in which case it is
+    *           only initialized for the first signature.
+    */
+   void merge(float value, bool selected = true);
+
+   /**
+    *  Merges the score of a specific signature for the current pixel.
+    *
+    *  This is used when a single detector pass scores several signatures.
+    *  The signatures for each pixel must be merged in index order starting
+    *  with signature 0.
+    *
+    *  @param   value
+    *           The score of the signature.
+    *  @param   signatureIndex
+    *           The 0-based index of the signature.
+    *  @param   selected
+    *           \c False if the pixel was not processed.
+    */
+   void merge(float value, int signatureIndex, bool selected);
+
+   /**
+    *  Advances to the next column of the current row.
+    */
+   void nextColumn();
+
+   /**
+    *  Advances to the first column of the next row.
+    */
+   void nextRow();
+
+private:
+   bool mEnabled;
+   DataAccessor mPseudocolorAccessor;
+   DataAccessor mBestValueAccessor;
+   int mSignatureIndex;
+   double mThreshold;
+   bool mHigherIsBetter;
+   float mUnmatchedValue;
+};
+
+#endif
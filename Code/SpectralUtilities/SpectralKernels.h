@@ -0,0 +1,685 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2010 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef SPECTRALKERNELS_H
+#define SPECTRALKERNELS_H
+
+#include "AppConfig.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPECTRAL_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * This namespace contains the per-pixel inner loops shared by the spectral
+ * detectors.
+ *
+ * The kernels operate on a dense run of band values.  Callers with a
+ * contiguous set of resampled bands pass a pointer directly into the BIP pixel,
+ * otherwise the bands are packed once with gatherBands() and the packed buffer
+ * is used for every signature.  Accumulation is done in double precision so
+ * results match the scalar loops they replace, except that sums and norms of
+ * 16-bit integer data are accumulated exactly in 64-bit integers.  SSE2
+ * versions are provided for the common data types when the compiler targets
+ * SSE2, all other types use a scalar loop with independent accumulators.
+ */
+namespace SpectralKernels
+{
+   /**
+    *  Determines if a set of band indices is a single ascending run.
+    *
+    *  @param   bands
+    *           The band indices.
+    *
+    *  @return  \c True if every band index is one more than the previous index,
+    *           \c false otherwise or if \em bands is empty.
+    */
+   inline bool isContiguous(const std::vector<int>& bands)
+   {
+      if (bands.empty())
+      {
+         return false;
+      }
+      for (std::vector<int>::size_type index = 1; index < bands.size(); ++index)
+      {
+         if (bands[index] != bands[index - 1] + 1)
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   /**
+    *  Copies selected band values from a BIP pixel into a dense buffer.
+    *
+    *  @param   pData
+    *           The first band of the pixel.
+    *  @param   bands
+    *           The bands to copy.
+    *  @param   pDest
+    *           The destination buffer which must hold at least bands.size() values.
+    */
+   template<class T>
+   inline void gatherBands(const T* pData, const std::vector<int>& bands, T* pDest)
+   {
+      const std::vector<int>::size_type count = bands.size();
+      for (std::vector<int>::size_type index = 0; index < count; ++index)
+      {
+         pDest[index] = pData[bands[index]];
+      }
+   }
+
+   /**
+    *  Computes the dot product of band values and a spectrum.
+    *
+    *  @param   pData
+    *           The dense band values.
+    *  @param   pSpectrum
+    *           The spectrum values.
+    *  @param   count
+    *           The number of values in \em pData and \em pSpectrum.
+    *
+    *  @return  The dot product.
+    */
+   template<class T>
+   inline double dotProduct(const T* pData, const double* pSpectrum, unsigned int count)
+   {
+      double sum0 = 0.0;
+      double sum1 = 0.0;
+      double sum2 = 0.0;
+      double sum3 = 0.0;
+      unsigned int index = 0;
+      for (; index + 4 <= count; index += 4)
+      {
+         sum0 += static_cast<double>(pData[index]) * pSpectrum[index];
+         sum1 += static_cast<double>(pData[index + 1]) * pSpectrum[index + 1];
+         sum2 += static_cast<double>(pData[index + 2]) * pSpectrum[index + 2];
+         sum3 += static_cast<double>(pData[index + 3]) * pSpectrum[index + 3];
+      }
+      for (; index < count; ++index)
+      {
+         sum0 += static_cast<double>(pData[index]) * pSpectrum[index];
+      }
+      return (sum0 + sum1) + (sum2 + sum3);
+   }
+
+   /**
+    *  Computes the dot product of band values and a spectrum along with the
+    *  sum of the squared band values in a single pass over the data.
+    *
+    *  @param   pData
+    *           The dense band values.
+    *  @param   pSpectrum
+    *           The spectrum values.
+    *  @param   count
+    *           The number of values in \em pData and \em pSpectrum.
+    *  @param   dot
+    *           Set to the dot product.
+    *  @param   sumSquares
+    *           Set to the sum of the squared band values.
+    */
+   template<class T>
+   inline void dotProductAndSumOfSquares(const T* pData, const double* pSpectrum, unsigned int count,
+      double& dot, double& sumSquares)
+   {
+      double dot0 = 0.0;
+      double dot1 = 0.0;
+      double sum0 = 0.0;
+      double sum1 = 0.0;
+      unsigned int index = 0;
+      for (; index + 2 <= count; index += 2)
+      {
+         double val0 = static_cast<double>(pData[index]);
+         double val1 = static_cast<double>(pData[index + 1]);
+         dot0 += val0 * pSpectrum[index];
+         dot1 += val1 * pSpectrum[index + 1];
+         sum0 += val0 * val0;
+         sum1 += val1 * val1;
+      }
+      for (; index < count; ++index)
+      {
+         double val = static_cast<double>(pData[index]);
+         dot0 += val * pSpectrum[index];
+         sum0 += val * val;
+      }
+      dot = dot0 + dot1;
+      sumSquares = sum0 + sum1;
+   }
+
+   /**
+    *  Computes the sum of the squared band values.
+    *
+    *  @param   pData
+    *           The dense band values.
+    *  @param   count
+    *           The number of values in \em pData.
+    *
+    *  @return  The sum of squares.  The square root of this is the vector magnitude.
+    */
+   template<class T>
+   inline double sumOfSquares(const T* pData, unsigned int count)
+   {
+      double sum0 = 0.0;
+      double sum1 = 0.0;
+      double sum2 = 0.0;
+      double sum3 = 0.0;
+      unsigned int index = 0;
+      for (; index + 4 <= count; index += 4)
+      {
+         double val0 = static_cast<double>(pData[index]);
+         double val1 = static_cast<double>(pData[index + 1]);
+         double val2 = static_cast<double>(pData[index + 2]);
+         double val3 = static_cast<double>(pData[index + 3]);
+         sum0 += val0 * val0;
+         sum1 += val1 * val1;
+         sum2 += val2 * val2;
+         sum3 += val3 * val3;
+      }
+      for (; index < count; ++index)
+      {
+         double val = static_cast<double>(pData[index]);
+         sum0 += val * val;
+      }
+      return (sum0 + sum1) + (sum2 + sum3);
+   }
+
+   /**
+    *  Computes the mean and population variance of the band values.
+    *
+    *  @param   pData
+    *           The dense band values.
+    *  @param   count
+    *           The number of values in \em pData.
+    *  @param   mean
+    *           Set to the mean of the values.
+    *  @param   variance
+    *           Set to the variance of the values, normalized by \em count.
+    */
+   template<class T>
+   inline void meanAndVariance(const T* pData, unsigned int count, double& mean, double& variance)
+   {
+      mean = 0.0;
+      variance = 0.0;
+      if (count == 0)
+      {
+         return;
+      }
+      for (unsigned int index = 0; index < count; ++index)
+      {
+         mean += static_cast<double>(pData[index]);
+      }
+      mean /= count;
+      for (unsigned int index = 0; index < count; ++index)
+      {
+         double val = static_cast<double>(pData[index]) - mean;
+         variance += val * val;
+      }
+      variance /= count;
+   }
+
+   /**
+    *  Computes the squared Euclidean distance between two runs of band values.
+    *
+    *  @param   pFirst
+    *           The first dense band values.
+    *  @param   pSecond
+    *           The second dense band values.
+    *  @param   count
+    *           The number of values in \em pFirst and \em pSecond.
+    *
+    *  @return  The sum of the squared differences.
+    */
+   template<class T>
+   inline double squaredDistance(const T* pFirst, const T* pSecond, unsigned int count)
+   {
+      double sum0 = 0.0;
+      double sum1 = 0.0;
+      double sum2 = 0.0;
+      double sum3 = 0.0;
+      unsigned int index = 0;
+      for (; index + 4 <= count; index += 4)
+      {
+         double diff0 = static_cast<double>(pFirst[index]) - static_cast<double>(pSecond[index]);
+         double diff1 = static_cast<double>(pFirst[index + 1]) - static_cast<double>(pSecond[index + 1]);
+         double diff2 = static_cast<double>(pFirst[index + 2]) - static_cast<double>(pSecond[index + 2]);
+         double diff3 = static_cast<double>(pFirst[index + 3]) - static_cast<double>(pSecond[index + 3]);
+         sum0 += diff0 * diff0;
+         sum1 += diff1 * diff1;
+         sum2 += diff2 * diff2;
+         sum3 += diff3 * diff3;
+      }
+      for (; index < count; ++index)
+      {
+         double diff = static_cast<double>(pFirst[index]) - static_cast<double>(pSecond[index]);
+         sum0 += diff * diff;
+      }
+      return (sum0 + sum1) + (sum2 + sum3);
+   }
+
+#if defined(SPECTRAL_KERNELS_SSE2)
+   namespace Sse2
+   {
+      inline double horizontalSum(__m128d sum)
+      {
+         double values[2];
+         _mm_storeu_pd(values, sum);
+         return values[0] + values[1];
+      }
+
+      // converts four 32-bit integers to two pairs of doubles
+      inline void convertEpi32(__m128i values, __m128d& low, __m128d& high)
+      {
+         low = _mm_cvtepi32_pd(values);
+         high = _mm_cvtepi32_pd(_mm_shuffle_epi32(values, _MM_SHUFFLE(3, 2, 3, 2)));
+      }
+
+      // loads four band values as two pairs of doubles
+      inline void load4(const float* pData, __m128d& low, __m128d& high)
+      {
+         __m128 values = _mm_loadu_ps(pData);
+         low = _mm_cvtps_pd(values);
+         high = _mm_cvtps_pd(_mm_movehl_ps(values, values));
+      }
+
+      inline void load4(const double* pData, __m128d& low, __m128d& high)
+      {
+         low = _mm_loadu_pd(pData);
+         high = _mm_loadu_pd(pData + 2);
+      }
+
+      inline void load4(const int* pData, __m128d& low, __m128d& high)
+      {
+         convertEpi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pData)), low, high);
+      }
+
+      inline void load4(const short* pData, __m128d& low, __m128d& high)
+      {
+         __m128i values = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pData));
+         convertEpi32(_mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16), low, high);
+      }
+
+      inline void load4(const unsigned short* pData, __m128d& low, __m128d& high)
+      {
+         __m128i values = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pData));
+         convertEpi32(_mm_unpacklo_epi16(values, _mm_setzero_si128()), low, high);
+      }
+
+      /**
+       *  Accumulates the exact sum and sum of squares of 16-bit values, eight at a time.
+       *
+       *  Each value is xor'd with \em flip before it is accumulated so unsigned data
+       *  can be biased in to the signed range used by the multiply-add.  Values past
+       *  the last multiple of eight are not accumulated.
+       *
+       *  @return  The number of values accumulated.
+       */
+      inline unsigned int sums16(const void* pData, unsigned int count, __m128i flip,
+         int64_t& sum, uint64_t& sumSquares)
+      {
+         const __m128i zero = _mm_setzero_si128();
+         const __m128i ones = _mm_set1_epi16(1);
+         const __m128i* pValues = reinterpret_cast<const __m128i*>(pData);
+         __m128i squares = zero;
+         sum = 0;
+         unsigned int index = 0;
+         const unsigned int total = count & ~7U;
+         while (index < total)
+         {
+            // the 32-bit lane sums grow by at most 2^16 per step so they are flushed
+            // every 8192 steps, well before they can overflow
+            const unsigned int blockEnd = index + std::min(total - index, 65536U);
+            __m128i sums = zero;
+            for (; index < blockEnd; index += 8, ++pValues)
+            {
+               __m128i values = _mm_xor_si128(_mm_loadu_si128(pValues), flip);
+               sums = _mm_add_epi32(sums, _mm_madd_epi16(values, ones));
+
+               // a pair of squares can reach 2^31 so the 32-bit results are zero extended
+               __m128i pairSquares = _mm_madd_epi16(values, values);
+               squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(pairSquares, zero));
+               squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(pairSquares, zero));
+            }
+
+            int laneSums[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(laneSums), sums);
+            sum += static_cast<int64_t>(laneSums[0]) + laneSums[1] + laneSums[2] + laneSums[3];
+         }
+
+         uint64_t laneSquares[2];
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(laneSquares), squares);
+         sumSquares = laneSquares[0] + laneSquares[1];
+         return total;
+      }
+
+      template<class T>
+      inline double dotProduct(const T* pData, const double* pSpectrum, unsigned int count)
+      {
+         __m128d sum0 = _mm_setzero_pd();
+         __m128d sum1 = _mm_setzero_pd();
+         unsigned int index = 0;
+         for (; index + 4 <= count; index += 4)
+         {
+            __m128d low;
+            __m128d high;
+            load4(pData + index, low, high);
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(low, _mm_loadu_pd(pSpectrum + index)));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(high, _mm_loadu_pd(pSpectrum + index + 2)));
+         }
+         double sum = horizontalSum(_mm_add_pd(sum0, sum1));
+         for (; index < count; ++index)
+         {
+            sum += static_cast<double>(pData[index]) * pSpectrum[index];
+         }
+         return sum;
+      }
+
+      template<class T>
+      inline double sumOfSquares(const T* pData, unsigned int count)
+      {
+         __m128d sum0 = _mm_setzero_pd();
+         __m128d sum1 = _mm_setzero_pd();
+         unsigned int index = 0;
+         for (; index + 4 <= count; index += 4)
+         {
+            __m128d low;
+            __m128d high;
+            load4(pData + index, low, high);
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(low, low));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(high, high));
+         }
+         double sum = horizontalSum(_mm_add_pd(sum0, sum1));
+         for (; index < count; ++index)
+         {
+            double val = static_cast<double>(pData[index]);
+            sum += val * val;
+         }
+         return sum;
+      }
+
+      template<class T>
+      inline void dotProductAndSumOfSquares(const T* pData, const double* pSpectrum, unsigned int count,
+         double& dot, double& sumSquares)
+      {
+         __m128d dot0 = _mm_setzero_pd();
+         __m128d dot1 = _mm_setzero_pd();
+         __m128d sum0 = _mm_setzero_pd();
+         __m128d sum1 = _mm_setzero_pd();
+         unsigned int index = 0;
+         for (; index + 4 <= count; index += 4)
+         {
+            __m128d low;
+            __m128d high;
+            load4(pData + index, low, high);
+            dot0 = _mm_add_pd(dot0, _mm_mul_pd(low, _mm_loadu_pd(pSpectrum + index)));
+            dot1 = _mm_add_pd(dot1, _mm_mul_pd(high, _mm_loadu_pd(pSpectrum + index + 2)));
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(low, low));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(high, high));
+         }
+         dot = horizontalSum(_mm_add_pd(dot0, dot1));
+         sumSquares = horizontalSum(_mm_add_pd(sum0, sum1));
+         for (; index < count; ++index)
+         {
+            double val = static_cast<double>(pData[index]);
+            dot += val * pSpectrum[index];
+            sumSquares += val * val;
+         }
+      }
+
+      template<class T>
+      inline double squaredDistance(const T* pFirst, const T* pSecond, unsigned int count)
+      {
+         __m128d sum0 = _mm_setzero_pd();
+         __m128d sum1 = _mm_setzero_pd();
+         unsigned int index = 0;
+         for (; index + 4 <= count; index += 4)
+         {
+            __m128d firstLow;
+            __m128d firstHigh;
+            __m128d secondLow;
+            __m128d secondHigh;
+            load4(pFirst + index, firstLow, firstHigh);
+            load4(pSecond + index, secondLow, secondHigh);
+            __m128d low = _mm_sub_pd(firstLow, secondLow);
+            __m128d high = _mm_sub_pd(firstHigh, secondHigh);
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(low, low));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(high, high));
+         }
+         double sum = horizontalSum(_mm_add_pd(sum0, sum1));
+         for (; index < count; ++index)
+         {
+            double diff = static_cast<double>(pFirst[index]) - static_cast<double>(pSecond[index]);
+            sum += diff * diff;
+         }
+         return sum;
+      }
+   }
+
+   template<>
+   inline double dotProduct<float>(const float* pData, const double* pSpectrum, unsigned int count)
+   {
+      return Sse2::dotProduct(pData, pSpectrum, count);
+   }
+
+   template<>
+   inline double dotProduct<double>(const double* pData, const double* pSpectrum, unsigned int count)
+   {
+      return Sse2::dotProduct(pData, pSpectrum, count);
+   }
+
+   template<>
+   inline double dotProduct<int>(const int* pData, const double* pSpectrum, unsigned int count)
+   {
+      return Sse2::dotProduct(pData, pSpectrum, count);
+   }
+
+   template<>
+   inline double dotProduct<short>(const short* pData, const double* pSpectrum, unsigned int count)
+   {
+      return Sse2::dotProduct(pData, pSpectrum, count);
+   }
+
+   template<>
+   inline double dotProduct<unsigned short>(const unsigned short* pData, const double* pSpectrum,
+      unsigned int count)
+   {
+      return Sse2::dotProduct(pData, pSpectrum, count);
+   }
+
+   template<>
+   inline double sumOfSquares<float>(const float* pData, unsigned int count)
+   {
+      return Sse2::sumOfSquares(pData, count);
+   }
+
+   template<>
+   inline double sumOfSquares<double>(const double* pData, unsigned int count)
+   {
+      return Sse2::sumOfSquares(pData, count);
+   }
+
+   template<>
+   inline double sumOfSquares<int>(const int* pData, unsigned int count)
+   {
+      return Sse2::sumOfSquares(pData, count);
+   }
+
+   template<>
+   inline void dotProductAndSumOfSquares<float>(const float* pData, const double* pSpectrum, unsigned int count,
+      double& dot, double& sumSquares)
+   {
+      Sse2::dotProductAndSumOfSquares(pData, pSpectrum, count, dot, sumSquares);
+   }
+
+   template<>
+   inline void dotProductAndSumOfSquares<double>(const double* pData, const double* pSpectrum, unsigned int count,
+      double& dot, double& sumSquares)
+   {
+      Sse2::dotProductAndSumOfSquares(pData, pSpectrum, count, dot, sumSquares);
+   }
+
+   template<>
+   inline void dotProductAndSumOfSquares<int>(const int* pData, const double* pSpectrum, unsigned int count,
+      double& dot, double& sumSquares)
+   {
+      Sse2::dotProductAndSumOfSquares(pData, pSpectrum, count, dot, sumSquares);
+   }
+
+   template<>
+   inline double squaredDistance<float>(const float* pFirst, const float* pSecond, unsigned int count)
+   {
+      return Sse2::squaredDistance(pFirst, pSecond, count);
+   }
+
+   template<>
+   inline double squaredDistance<double>(const double* pFirst, const double* pSecond, unsigned int count)
+   {
+      return Sse2::squaredDistance(pFirst, pSecond, count);
+   }
+#endif
+
+   /**
+    *  Exact integer accumulation for 16-bit data.
+    *
+    *  The sums of 16-bit band values and of their squares fit in 64-bit integers
+    *  for any band count, so they are accumulated exactly and converted to double
+    *  once per pixel.  The norm and statistics kernels use these for INT2SBYTES and
+    *  INT2UBYTES data instead of widening every value to double.
+    */
+   namespace Integer
+   {
+      template<class T>
+      inline void sums(const T* pData, unsigned int count, int64_t& sum, uint64_t& sumSquares)
+      {
+         sum = 0;
+         sumSquares = 0;
+         for (unsigned int index = 0; index < count; ++index)
+         {
+            int64_t val = pData[index];
+            sum += val;
+            sumSquares += static_cast<uint64_t>(val * val);
+         }
+      }
+
+#if defined(SPECTRAL_KERNELS_SSE2)
+      inline void sums(const short* pData, unsigned int count, int64_t& sum, uint64_t& sumSquares)
+      {
+         unsigned int index = Sse2::sums16(pData, count, _mm_setzero_si128(), sum, sumSquares);
+         for (; index < count; ++index)
+         {
+            int64_t val = pData[index];
+            sum += val;
+            sumSquares += static_cast<uint64_t>(val * val);
+         }
+      }
+
+      inline void sums(const unsigned short* pData, unsigned int count, int64_t& sum, uint64_t& sumSquares)
+      {
+         // the values are biased by -32768 so the signed multiply-add can be used, the
+         // bias is then removed from the sums: x^2 = (x - b)^2 + 2b(x - b) + b^2
+         int64_t biasedSum = 0;
+         uint64_t biasedSquares = 0;
+         unsigned int index = Sse2::sums16(pData, count, _mm_set1_epi16(static_cast<short>(0x8000)),
+            biasedSum, biasedSquares);
+         const int64_t bias = 32768;
+         sum = biasedSum + bias * index;
+         sumSquares = static_cast<uint64_t>(static_cast<int64_t>(biasedSquares) + 2 * bias * biasedSum +
+            bias * bias * index);
+         for (; index < count; ++index)
+         {
+            uint64_t val = pData[index];
+            sum += static_cast<int64_t>(val);
+            sumSquares += val * val;
+         }
+      }
+#endif
+
+      /**
+       *  Computes the population variance from exact sums.
+       *
+       *  count * sumSquares - sum^2 is evaluated exactly in 64 bits when it cannot
+       *  overflow, which covers any real sensor's band count.
+       */
+      inline double variance(int64_t sum, uint64_t sumSquares, unsigned int count)
+      {
+         if (count == 0)
+         {
+            return 0.0;
+         }
+         const double countSquared = static_cast<double>(count) * count;
+         if (count <= 32768)
+         {
+            return static_cast<double>(static_cast<int64_t>(count * sumSquares) - sum * sum) / countSquared;
+         }
+         double mean = static_cast<double>(sum) / count;
+         return std::max(0.0, static_cast<double>(sumSquares) / count - mean * mean);
+      }
+   }
+
+   template<>
+   inline double sumOfSquares<short>(const short* pData, unsigned int count)
+   {
+      int64_t sum;
+      uint64_t sumSquares;
+      Integer::sums(pData, count, sum, sumSquares);
+      return static_cast<double>(sumSquares);
+   }
+
+   template<>
+   inline double sumOfSquares<unsigned short>(const unsigned short* pData, unsigned int count)
+   {
+      int64_t sum;
+      uint64_t sumSquares;
+      Integer::sums(pData, count, sum, sumSquares);
+      return static_cast<double>(sumSquares);
+   }
+
+   template<>
+   inline void dotProductAndSumOfSquares<short>(const short* pData, const double* pSpectrum, unsigned int count,
+      double& dot, double& sumSquares)
+   {
+      dot = dotProduct(pData, pSpectrum, count);
+      sumSquares = sumOfSquares(pData, count);
+   }
+
+   template<>
+   inline void dotProductAndSumOfSquares<unsigned short>(const unsigned short* pData, const double* pSpectrum,
+      unsigned int count, double& dot, double& sumSquares)
+   {
+      dot = dotProduct(pData, pSpectrum, count);
+      sumSquares = sumOfSquares(pData, count);
+   }
+
+   template<>
+   inline void meanAndVariance<short>(const short* pData, unsigned int count, double& mean, double& variance)
+   {
+      int64_t sum;
+      uint64_t sumSquares;
+      Integer::sums(pData, count, sum, sumSquares);
+      mean = (count == 0) ? 0.0 : static_cast<double>(sum) / count;
+      variance = Integer::variance(sum, sumSquares, count);
+   }
+
+   template<>
+   inline void meanAndVariance<unsigned short>(const unsigned short* pData, unsigned int count, double& mean,
+      double& variance)
+   {
+      int64_t sum;
+      uint64_t sumSquares;
+      Integer::sums(pData, count, sum, sumSquares);
+      mean = (count == 0) ? 0.0 : static_cast<double>(sum) / count;
+      variance = Integer::variance(sum, sumSquares, count);
+   }
+}
+
+#endif
@@ -32,6 +32,8 @@
 #include <QtCore/QtConcurrentMap>
 #include <QtCore/QDate>
 
+#include <algorithm>
+#include <math.h>
 #include <vector>
 #include <string>
 
@@ -113,6 +115,111 @@ namespace
          }
       }
    }
+
+   template<typename T>
+   void accumulateOuterProduct(const T* pPixel, std::vector<double>& pixelVec, std::vector<double>& sums)
+   {
+      const int bands = static_cast<int>(pixelVec.size());
+      for (int band = 0; band < bands; ++band)
+      {
+         pixelVec[band] = pPixel[band];
+      }
+
+      // only the upper triangle is accumulated, the matrix is symmetric
+      for (int band1 = 0; band1 < bands; ++band1)
+      {
+         double* pRow = &sums[band1 * bands];
+         const double value = pixelVec[band1];
+         for (int band2 = band1; band2 < bands; ++band2)
+         {
+            pRow[band2] += value * pixelVec[band2];
+         }
+      }
+   }
+
+   struct SecondMomentSums
+   {
+      std::vector<double> mSums[2];
+      unsigned int mCounts[2];
+   };
+
+   struct SecondMomentMap
+   {
+      typedef unsigned int input_type;
+      typedef SecondMomentSums result_type;
+
+      const RasterElement* mpElement;
+      const RasterDataDescriptor* mpDesc;
+      int mBands;
+      EncodingType mEncoding;
+      BitMaskIterator& mIter;
+      unsigned int mStartCol;
+      unsigned int mEndCol;
+      unsigned int mRowSkip;
+      unsigned int mColumnSkip;
+
+      SecondMomentMap(const RasterElement* pElement, BitMaskIterator& iter, unsigned int rowSkip,
+         unsigned int columnSkip) : mpElement(pElement), mIter(iter), mBands(0), mEncoding(INT1SBYTE),
+         mStartCol(0), mEndCol(0), mRowSkip(rowSkip), mColumnSkip(columnSkip)
+      {
+         mpDesc = dynamic_cast<const RasterDataDescriptor*>(mpElement->getDataDescriptor());
+         VERIFYNRV(mpDesc != NULL);
+         mBands = mpDesc->getBandCount();
+         mEncoding = mpDesc->getDataType();
+         mStartCol = mIter.getBoundingBoxStartColumn();
+         mEndCol = mIter.getBoundingBoxEndColumn();
+      }
+
+      result_type operator()(const input_type& row)
+      {
+         SecondMomentSums sums;
+         sums.mSums[0].resize(mBands * mBands, 0.0);
+         sums.mSums[1].resize(mBands * mBands, 0.0);
+         sums.mCounts[0] = 0;
+         sums.mCounts[1] = 0;
+         VERIFYRV(mpDesc != NULL, sums);
+         DimensionDescriptor rowDesc = mpDesc->getActiveRow(row);
+         FactoryResource<DataRequest> pReq;
+         pReq->setInterleaveFormat(BIP);
+         pReq->setRows(rowDesc, rowDesc);
+         DataAccessor acc(mpElement->getDataAccessor(pReq.release()));
+         ENSURE(acc.isValid());
+
+         // alternate rows start on alternate halves so the halves form a checkerboard
+         unsigned int half = (row / mRowSkip) % 2;
+         std::vector<double> pixelVec(mBands);
+         for (unsigned int col = mStartCol; col <= mEndCol; col += mColumnSkip)
+         {
+            if (mIter.getPixel(col, row))
+            {
+               acc->toPixel(row, col);
+               switchOnEncoding(mEncoding, accumulateOuterProduct, acc->getColumn(), pixelVec, sums.mSums[half]);
+               ++sums.mCounts[half];
+            }
+            half = 1 - half;
+         }
+         return sums;
+      }
+   };
+
+   void secondMomentReduce(SecondMomentSums& final, const SecondMomentSums& intermediate)
+   {
+      if (final.mSums[0].empty())
+      {
+         final = intermediate;
+      }
+      else
+      {
+         for (int half = 0; half < 2; ++half)
+         {
+            for (std::vector<double>::size_type i = 0; i < final.mSums[half].size(); ++i)
+            {
+               final.mSums[half][i] += intermediate.mSums[half][i];
+            }
+            final.mCounts[half] += intermediate.mCounts[half];
+         }
+      }
+   }
 #endif
 }
 
@@ -569,6 +676,95 @@ std::vector<double> SpectralUtilities::calculateMeans(const RasterElement* pElem
    iter.firstPixel();
    return muMat;
 }
+
+std::vector<double> SpectralUtilities::calculateSecondMoment(const RasterElement* pElement, BitMaskIterator& iter,
+   unsigned int rowSkip, unsigned int columnSkip, double& relativeError, ProgressTracker& progress, bool* pAbort)
+{
+   std::vector<double> smm;
+   relativeError = 0.0;
+   VERIFYRV(pElement != NULL, smm);
+   rowSkip = std::max(rowSkip, 1U);
+   columnSkip = std::max(columnSkip, 1U);
+
+   QList<unsigned int> rows;
+   unsigned int startRow = iter.getBoundingBoxStartRow();
+   unsigned int endRow = iter.getBoundingBoxEndRow();
+   for (unsigned int row = startRow; row <= endRow; row += rowSkip)
+   {
+      rows.push_back(row);
+   }
+
+   // setup the map-reduce and execute with progress reporting
+   SecondMomentMap smmMap(pElement, iter, rowSkip, columnSkip);
+   QFuture<SecondMomentSums> sums;
+   sums = QtConcurrent::mappedReduced(rows.begin(), rows.end(), smmMap, secondMomentReduce,
+      QtConcurrent::UnorderedReduce);
+   bool isCancelling = false;
+   while (sums.isRunning())
+   {
+      if (isCancelling)
+      {
+         progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
+      }
+      else
+      {
+         progress.report("Calculating second moment",
+               (sums.progressValue() - sums.progressMinimum()) * 100 /
+               std::max(1, sums.progressMaximum() - sums.progressMinimum()), NORMAL);
+         if (pAbort != NULL && *pAbort)
+         {
+            sums.cancel();
+            isCancelling = true;
+         }
+      }
+      QThread::yieldCurrentThread();
+   }
+
+   if (sums.isCanceled())
+   {
+      progress.report("User canceled operation.", 100, ABORT, true);
+      return smm;
+   }
+
+   const SecondMomentSums& result = sums.result();
+   unsigned int count = result.mCounts[0] + result.mCounts[1];
+   if (count == 0)
+   {
+      progress.report("Need to calculate the second moment on at least one pixel.", 100, ERRORS, true);
+      return smm;
+   }
+
+   // complete the calculation, filling in the lower triangle and comparing the halves
+   int bands = static_cast<int>(sqrt(static_cast<double>(result.mSums[0].size())) + 0.5);
+   smm.resize(bands * bands);
+   double differenceNorm = 0.0;
+   double norm = 0.0;
+   for (int band1 = 0; band1 < bands; ++band1)
+   {
+      for (int band2 = band1; band2 < bands; ++band2)
+      {
+         int index = band1 * bands + band2;
+         double value = (result.mSums[0][index] + result.mSums[1][index]) / count;
+         smm[index] = value;
+         smm[band2 * bands + band1] = value;
+
+         double weight = (band1 == band2) ? 1.0 : 2.0;
+         norm += weight * value * value;
+         if (result.mCounts[0] > 0 && result.mCounts[1] > 0)
+         {
+            double difference = result.mSums[0][index] / result.mCounts[0] -
+               result.mSums[1][index] / result.mCounts[1];
+            differenceNorm += weight * difference * difference;
+         }
+      }
+   }
+   if (norm > 0.0)
+   {
+      relativeError = sqrt(differenceNorm) / (2.0 * sqrt(norm));
+   }
+   iter.firstPixel();
+   return smm;
+}
 #endif
 
 double SpectralUtilities::determineReflectanceConversionFactor(double solarElevationAngleInDegrees,
@@ -161,6 +161,39 @@ namespace SpectralUtilities
     */
    std::vector<double> calculateMeans(const RasterElement* pElement, 
       BitMaskIterator& iter, ProgressTracker& progress, bool* pAbort = NULL);
+
+   /**
+    *  Estimates the second moment matrix of a RasterElement from a regular
+    *  subsample of its pixels using QtConcurrent.
+    *
+    *  The sampled pixels are split in to two interleaved halves and the
+    *  relative difference between the two half estimates is returned as an
+    *  indication of how well the subsample represents the data.
+    *
+    *  @param   pElement
+    *           The RasterElement on which the second moment calculation will be performed.
+    *  @param   iter
+    *           A BitMaskIterator to note which pixels may be included in the calculation.
+    *  @param   rowSkip
+    *           Only every \em rowSkip row is read.  A value of 1 reads every row.
+    *  @param   columnSkip
+    *           Only every \em columnSkip column is read.  A value of 1 reads every column.
+    *  @param   relativeError
+    *           Populated with the Frobenius norm of the difference between the two half
+    *           estimates divided by twice the norm of the full estimate.  This approximates
+    *           the relative standard error of the returned matrix.
+    *  @param   progress
+    *           The ProgressTracker object to update.
+    *  @param   pAbort
+    *           This method will query the state of this flag during computations and will abort if the 
+    *           flag is \c true. If \em pAbort is \c NULL, the method will run to completion.
+    *
+    *  @return  The bands x bands second moment matrix in row major order, or an empty
+    *           vector if no pixels were sampled or the calculation was aborted.
+    */
+   std::vector<double> calculateSecondMoment(const RasterElement* pElement, BitMaskIterator& iter,
+      unsigned int rowSkip, unsigned int columnSkip, double& relativeError, ProgressTracker& progress,
+      bool* pAbort = NULL);
 #endif
 
    /**
@@ -0,0 +1,375 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2010 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "AoiElement.h"
+#include "AppVerify.h"
+#include "DataAccessor.h"
+#include "DataAccessorImpl.h"
+#include "DataRequest.h"
+#include "DataVariant.h"
+#include "DynamicObject.h"
+#include "ModelServices.h"
+#include "ObjectResource.h"
+#include "RasterDataDescriptor.h"
+#include "RasterElement.h"
+#include "RasterUtilities.h"
+#include "Slot.h"
+#include "SpectralKernels.h"
+#include "Subject.h"
+#include "switchOnEncoding.h"
+#include "TypeConverter.h"
+#include "Units.h"
+#include "WhitenedCube.h"
+
+#include <boost/any.hpp>
+#include <QtCore/QtConcurrentMap>
+
+#include <algorithm>
+#include <map>
+
+namespace
+{
+   const std::string sMeansPath = "Whitened Cube/Means";
+   const std::string sWhiteningPath = "Whitened Cube/Whitening";
+
+   /**
+    *  Tracks the caches built by this module and marks them stale when their cube or statistics AOI changes.
+    *
+    *  Nothing is destroyed from inside a notification; a stale cache is simply no longer returned and is replaced
+    *  the next time a cache is created.  A cache this module is not watching, such as one restored from a session or
+    *  built by another module, may have missed changes and is never trusted.  The slots are detached when the
+    *  module is unloaded so none are left behind.
+    */
+   class WhitenedCubeWatcher
+   {
+   public:
+      ~WhitenedCubeWatcher()
+      {
+         while (!mCaches.empty())
+         {
+            forget(mCaches.begin()->first);
+         }
+      }
+
+      void watch(RasterElement* pCache, RasterElement* pElement, const AoiElement* pAoi)
+      {
+         forget(pCache);
+         CacheSource& source = mCaches[pCache];
+         source.mpElement = pElement;
+         source.mpAoi = const_cast<AoiElement*>(pAoi);
+         source.mStale = false;
+         VERIFYNRV(pCache->attach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::cacheDeleted)));
+         VERIFYNRV(pElement->attach(SIGNAL_NAME(Subject, Modified),
+            Slot(this, &WhitenedCubeWatcher::sourceModified)));
+         VERIFYNRV(pElement->attach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::sourceDeleted)));
+         if (source.mpAoi != NULL)
+         {
+            VERIFYNRV(source.mpAoi->attach(SIGNAL_NAME(Subject, Modified),
+               Slot(this, &WhitenedCubeWatcher::sourceModified)));
+            VERIFYNRV(source.mpAoi->attach(SIGNAL_NAME(Subject, Deleted),
+               Slot(this, &WhitenedCubeWatcher::sourceDeleted)));
+         }
+      }
+
+      bool isCurrent(const RasterElement* pCache, const RasterElement* pElement, const AoiElement* pAoi) const
+      {
+         std::map<RasterElement*, CacheSource>::const_iterator iter =
+            mCaches.find(const_cast<RasterElement*>(pCache));
+         return iter != mCaches.end() && !iter->second.mStale && iter->second.mpElement == pElement &&
+            iter->second.mpAoi == pAoi;
+      }
+
+      void sourceModified(Subject& subject, const std::string& signal, const boost::any& value)
+      {
+         markStale(subject, false);
+      }
+
+      void sourceDeleted(Subject& subject, const std::string& signal, const boost::any& value)
+      {
+         // the subject is going away so its slots go with it
+         markStale(subject, true);
+      }
+
+      void cacheDeleted(Subject& subject, const std::string& signal, const boost::any& value)
+      {
+         std::map<RasterElement*, CacheSource>::iterator iter = mCaches.find(dynamic_cast<RasterElement*>(&subject));
+         if (iter != mCaches.end())
+         {
+            iter->first->detach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::cacheDeleted));
+            detachSource(iter->second);
+            mCaches.erase(iter);
+         }
+      }
+
+   private:
+      struct CacheSource
+      {
+         CacheSource() : mpElement(NULL), mpAoi(NULL), mStale(true) {}
+
+         RasterElement* mpElement;
+         AoiElement* mpAoi;
+         bool mStale;
+      };
+
+      void markStale(Subject& subject, bool deleted)
+      {
+         for (std::map<RasterElement*, CacheSource>::iterator iter = mCaches.begin(); iter != mCaches.end(); ++iter)
+         {
+            CacheSource& source = iter->second;
+            if (&subject == source.mpElement || &subject == source.mpAoi)
+            {
+               source.mStale = true;
+               if (deleted)
+               {
+                  if (&subject == source.mpElement)
+                  {
+                     source.mpElement = NULL;
+                  }
+                  else
+                  {
+                     source.mpAoi = NULL;
+                  }
+               }
+            }
+         }
+      }
+
+      void detachSource(CacheSource& source)
+      {
+         if (source.mpElement != NULL)
+         {
+            source.mpElement->detach(SIGNAL_NAME(Subject, Modified), Slot(this, &WhitenedCubeWatcher::sourceModified));
+            source.mpElement->detach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::sourceDeleted));
+         }
+         if (source.mpAoi != NULL)
+         {
+            source.mpAoi->detach(SIGNAL_NAME(Subject, Modified), Slot(this, &WhitenedCubeWatcher::sourceModified));
+            source.mpAoi->detach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::sourceDeleted));
+         }
+      }
+
+      void forget(RasterElement* pCache)
+      {
+         std::map<RasterElement*, CacheSource>::iterator iter = mCaches.find(pCache);
+         if (iter != mCaches.end())
+         {
+            pCache->detach(SIGNAL_NAME(Subject, Deleted), Slot(this, &WhitenedCubeWatcher::cacheDeleted));
+            detachSource(iter->second);
+            mCaches.erase(iter);
+         }
+      }
+
+      std::map<RasterElement*, CacheSource> mCaches;
+   };
+
+   WhitenedCubeWatcher& getWatcher()
+   {
+      static WhitenedCubeWatcher sWatcher;
+      return sWatcher;
+   }
+
+   template<typename T>
+   void centerPixel(const T* pData, double scale, const std::vector<double>& means, std::vector<double>& centered)
+   {
+      for (std::vector<double>::size_type band = 0; band < centered.size(); ++band)
+      {
+         centered[band] = scale * pData[band] - means[band];
+      }
+   }
+
+   struct WhitenRow
+   {
+      typedef void result_type;
+
+      const RasterElement* mpElement;
+      RasterElement* mpCache;
+      const std::vector<double>& mMeans;
+      const std::vector<double>& mWhitening;
+      const bool* mpAbort;
+
+      WhitenRow(const RasterElement* pElement, RasterElement* pCache, const std::vector<double>& means,
+         const std::vector<double>& whitening, const bool* pAbort) :
+         mpElement(pElement),
+         mpCache(pCache),
+         mMeans(means),
+         mWhitening(whitening),
+         mpAbort(pAbort)
+      {}
+
+      void operator()(const int& row)
+      {
+         if (mpAbort != NULL && *mpAbort)
+         {
+            return;
+         }
+
+         const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(mpElement->getDataDescriptor());
+         const RasterDataDescriptor* pCacheDesc =
+            static_cast<const RasterDataDescriptor*>(mpCache->getDataDescriptor());
+         unsigned int numCols = pDesc->getColumnCount();
+         unsigned int numBands = pDesc->getBandCount();
+         const Units* pUnits = pDesc->getUnits();
+         double scale = (pUnits == NULL) ? 1.0 : pUnits->getScaleFromStandard();
+         EncodingType encoding = pDesc->getDataType();
+
+         FactoryResource<DataRequest> pRequest;
+         pRequest->setInterleaveFormat(BIP);
+         pRequest->setRows(pDesc->getActiveRow(row), pDesc->getActiveRow(row));
+         DataAccessor acc(mpElement->getDataAccessor(pRequest.release()));
+         FactoryResource<DataRequest> pCacheRequest;
+         pCacheRequest->setInterleaveFormat(BIP);
+         pCacheRequest->setRows(pCacheDesc->getActiveRow(row), pCacheDesc->getActiveRow(row));
+         pCacheRequest->setWritable(true);
+         DataAccessor cacheAcc(mpCache->getDataAccessor(pCacheRequest.release()));
+         VERIFYNRV(acc.isValid() && cacheAcc.isValid());
+
+         std::vector<double> centered(numBands);
+         for (unsigned int col = 0; col < numCols; ++col)
+         {
+            VERIFYNRV(acc.isValid() && cacheAcc.isValid());
+            switchOnEncoding(encoding, centerPixel, acc->getColumn(), scale, mMeans, centered);
+            float* pWhitened = reinterpret_cast<float*>(cacheAcc->getColumn());
+            for (unsigned int band = 0; band < numBands; ++band)
+            {
+               pWhitened[band] = static_cast<float>(
+                  SpectralKernels::dotProduct(&centered.front(), &mWhitening[band * numBands], numBands));
+            }
+            acc->nextColumn();
+            cacheAcc->nextColumn();
+         }
+      }
+   };
+}
+
+std::string WhitenedCube::getCacheName()
+{
+   return "Whitened Cube";
+}
+
+RasterElement* WhitenedCube::getCache(RasterElement* pElement, const AoiElement* pAoi)
+{
+   VERIFYRV(pElement != NULL, NULL);
+   RasterElement* pCache = dynamic_cast<RasterElement*>(Service<ModelServices>()->getElement(getCacheName(),
+      TypeConverter::toString<RasterElement>(), pElement));
+   if (pCache == NULL)
+   {
+      return NULL;
+   }
+
+   // the cache may have been restored from a session or built by another plug-in so check it matches the cube
+   const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+   const RasterDataDescriptor* pCacheDesc = static_cast<const RasterDataDescriptor*>(pCache->getDataDescriptor());
+   std::vector<double> means;
+   std::vector<double> whitening;
+   if (pCacheDesc->getRowCount() != pDesc->getRowCount() ||
+      pCacheDesc->getColumnCount() != pDesc->getColumnCount() ||
+      pCacheDesc->getBandCount() != pDesc->getBandCount() ||
+      pCacheDesc->getDataType() != FLT4BYTES ||
+      !getWhitening(pCache, means, whitening) ||
+      means.size() != pDesc->getBandCount())
+   {
+      return NULL;
+   }
+
+   // the cube or the statistics AOI may have changed since the cache was built
+   if (!getWatcher().isCurrent(pCache, pElement, pAoi))
+   {
+      return NULL;
+   }
+   return pCache;
+}
+
+bool WhitenedCube::getWhitening(const RasterElement* pCache, std::vector<double>& means,
+                                std::vector<double>& whitening)
+{
+   VERIFY(pCache != NULL);
+   const DynamicObject* pMetadata = pCache->getMetadata();
+   VERIFY(pMetadata != NULL);
+   const std::vector<double>* pMeans =
+      pMetadata->getAttributeByPath(sMeansPath).getPointerToValue<std::vector<double> >();
+   const std::vector<double>* pWhitening =
+      pMetadata->getAttributeByPath(sWhiteningPath).getPointerToValue<std::vector<double> >();
+   if (pMeans == NULL || pWhitening == NULL || pWhitening->size() != pMeans->size() * pMeans->size())
+   {
+      return false;
+   }
+   means = *pMeans;
+   whitening = *pWhitening;
+   return true;
+}
+
+RasterElement* WhitenedCube::createCache(RasterElement* pElement, const AoiElement* pAoi,
+                                         const std::vector<double>& means, const std::vector<double>& whitening,
+                                         ProgressTracker& progress, bool* pAbort)
+{
+   VERIFYRV(pElement != NULL, NULL);
+   const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+   unsigned int numRows = pDesc->getRowCount();
+   unsigned int numCols = pDesc->getColumnCount();
+   unsigned int numBands = pDesc->getBandCount();
+   VERIFYRV(means.size() == numBands && whitening.size() == numBands * numBands, NULL);
+
+   Service<ModelServices> pModel;
+   RasterElement* pOldCache = dynamic_cast<RasterElement*>(pModel->getElement(getCacheName(),
+      TypeConverter::toString<RasterElement>(), pElement));
+   if (pOldCache != NULL)
+   {
+      pModel->destroyElement(pOldCache);
+   }
+
+   ModelResource<RasterElement> pCache(RasterUtilities::createRasterElement(getCacheName(), numRows, numCols,
+      numBands, FLT4BYTES, BIP, true, pElement));
+   if (pCache.get() == NULL)
+   {
+      pCache = ModelResource<RasterElement>(RasterUtilities::createRasterElement(getCacheName(), numRows, numCols,
+         numBands, FLT4BYTES, BIP, false, pElement));
+      if (pCache.get() == NULL)
+      {
+         progress.report("Unable to create the whitened cube.", 0, ERRORS, true);
+         return NULL;
+      }
+   }
+
+   QList<int> rows;
+   for (unsigned int row = 0; row < numRows; ++row)
+   {
+      rows.push_back(row);
+   }
+   WhitenRow whitenRow(pElement, pCache.get(), means, whitening, pAbort);
+#ifndef QT_NO_CONCURRENT
+   QFuture<void> future = QtConcurrent::map(rows, whitenRow);
+   while (future.isRunning())
+   {
+      progress.report("Whitening cube", (future.progressValue() - future.progressMinimum()) * 100 /
+         std::max(1, future.progressMaximum() - future.progressMinimum()), NORMAL);
+      QThread::yieldCurrentThread();
+   }
+#else
+   for (QList<int>::iterator row = rows.begin(); row != rows.end(); ++row)
+   {
+      whitenRow(*row);
+      progress.report("Whitening cube", *row * 100 / numRows, NORMAL);
+   }
+#endif
+   if (pAbort != NULL && *pAbort)
+   {
+      progress.report("User canceled operation.", 100, ABORT, true);
+      return NULL;
+   }
+
+   DynamicObject* pMetadata = pCache->getMetadata();
+   VERIFYRV(pMetadata != NULL, NULL);
+   pMetadata->setAttributeByPath(sMeansPath, means);
+   pMetadata->setAttributeByPath(sWhiteningPath, whitening);
+   pCache->updateData();
+
+   // the cache is only watched once it is complete so building it does not mark it stale
+   getWatcher().watch(pCache.get(), pElement, pAoi);
+   return pCache.release();
+}
@@ -0,0 +1,102 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2010 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef WHITENEDCUBE_H
+#define WHITENEDCUBE_H
+
+#include "ProgressTracker.h"
+
+#include <string>
+#include <vector>
+
+class AoiElement;
+class RasterElement;
+
+/**
+ *  Maintains a cached whitened copy of a cube for Mahalanobis based detectors.
+ *
+ *  The cache is a child RasterElement of the cube holding every pixel with the
+ *  band means removed and the symmetric inverse square root of the covariance
+ *  applied, stored as BIP floats.  With the cache a detector only needs one
+ *  dot product per pixel for each whitened target instead of re-running the
+ *  covariance calculation and re-whitening every pixel.
+ *
+ *  The means and whitening matrix used to build the cache are stored in its
+ *  metadata so targets can be whitened consistently.  The cube and the AOI
+ *  the statistics were taken from are watched after the cache is built, and
+ *  the cache is no longer used once either of them is modified.
+ */
+namespace WhitenedCube
+{
+   /**
+    *  Returns the name of the cache element.
+    *
+    *  @return  The name of the child element holding the whitened cube.
+    */
+   std::string getCacheName();
+
+   /**
+    *  Locates a valid cache for a cube.
+    *
+    *  @param   pElement
+    *           The cube which was whitened.
+    *  @param   pAoi
+    *           The AOI the statistics were calculated over, or \c NULL for
+    *           the whole cube.
+    *
+    *  @return  The cache element, or \c NULL if the cube has no cache, the
+    *           cache was built for a different AOI, or the cube or AOI has
+    *           been modified since the cache was built.
+    */
+   RasterElement* getCache(RasterElement* pElement, const AoiElement* pAoi = NULL);
+
+   /**
+    *  Retrieves the statistics used to build a cache.
+    *
+    *  @param   pCache
+    *           The cache element returned by getCache() or createCache().
+    *  @param   means
+    *           Populated with the band means, in standard units.
+    *  @param   whitening
+    *           Populated with the bands x bands whitening matrix in row major
+    *           order.
+    *
+    *  @return  \c True if the statistics were found, \c false otherwise.
+    */
+   bool getWhitening(const RasterElement* pCache, std::vector<double>& means, std::vector<double>& whitening);
+
+   /**
+    *  Whitens a cube and stores the result as its cache.
+    *
+    *  Any existing cache is replaced.  Rows are whitened concurrently.
+    *
+    *  @param   pElement
+    *           The cube to whiten.
+    *  @param   pAoi
+    *           The AOI the statistics were calculated over, or \c NULL for
+    *           the whole cube.
+    *  @param   means
+    *           The band means of the cube, in standard units.
+    *  @param   whitening
+    *           The bands x bands whitening matrix in row major order.  This
+    *           should be the symmetric inverse square root of the covariance.
+    *  @param   progress
+    *           The ProgressTracker object to update.
+    *  @param   pAbort
+    *           This method will query the state of this flag during computations and will abort if the
+    *           flag is \c true. If \em pAbort is \c NULL, the method will run to completion.
+    *
+    *  @return  The cache element, or \c NULL if the cache could not be created
+    *           or the operation was aborted.
+    */
+   RasterElement* createCache(RasterElement* pElement, const AoiElement* pAoi, const std::vector<double>& means,
+      const std::vector<double>& whitening, ProgressTracker& progress, bool* pAbort = NULL);
+}
+
+#endif
@@ -11,6 +11,7 @@
 // Moving this after Opticks includes will incorrectly use the Xerces X macro.
 #include <cstddef>
 #include <opencv/cv.h>
+#include <algorithm>
 #include <memory>
 #include <limits>
 
@@ -20,6 +21,8 @@
 #include "DataAccessorImpl.h"
 #include "DataRequest.h"
 #include "DesktopServices.h"
+#include "FileResource.h"
+#include "Filename.h"
 #include "LayerList.h"
 #include "ObjectResource.h"
 #include "PlugInArgList.h"
@@ -33,10 +36,15 @@
 #include "Tad.h"
 #include "TadDialog.h"
 #include "SpatialDataView.h"
+#include "SpectralKernels.h"
 #include "SpectralVersion.h"
 #include "ThresholdLayer.h"
 #include "UtilityServices.h"
+#include "Wavelengths.h"
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QtConcurrentMap>
+#include <QtCore/QString>
 
 REGISTER_PLUGIN_BASIC(TadModule, Tad);
 
@@ -52,58 +60,130 @@ namespace
       }
    }
  
-   struct DistCalcMap
+   /**
+    * Maps squared distances to a fixed number of equal width bins.
+    *
+    * A distance quantile is found by refining through a chain of these.  The first covers
+    * every distance and each later one splits the target bin of the one before it.
+    */
+   struct DistanceBins
    {
-      typedef unsigned int input_type;
-      typedef std::vector<float> result_type;
+      static const int sBins = 4096;
 
-      cv::Mat& mInputMat;
+      double mLow;
+      double mWidth;
+      int mTarget;
 
-      DistCalcMap(cv::Mat& inputMat) : mInputMat(inputMat)
+      DistanceBins(double low, double width) : mLow(low), mWidth(width), mTarget(-1)
       {
       }
 
-      result_type operator()(const input_type& index)
+      int getBin(double distance) const
       {
-         std::vector<float> pixelDistances;
-         unsigned int bands = mInputMat.cols;
-         unsigned int size = mInputMat.rows;
+         // clamp so values rounded across an edge of the parent bin stay in this level
+         double bin = floor((distance - mLow) / mWidth);
+         return static_cast<int>(std::max(0.0, std::min(bin, static_cast<double>(sBins - 1))));
+      }
+   };
 
-         unsigned int count = 0;
-         std::vector<float> spectrum(bands);
-         for (unsigned int j = 0; j < bands; j++)
+   // the largest sample used to find the background radius, every pair of samples is compared
+   const unsigned int sMaxRadiusSamples = 20000;
+
+   // the target bin is refined until it holds few enough distances to select from directly
+   const quint64 sMaxCollectedDistances = 1 << 20;
+   const std::vector<DistanceBins>::size_type sMaxDistanceLevels = 4;
+
+   struct DistanceHistogram
+   {
+      std::vector<quint64> mCounts;
+      std::vector<float> mValues;
+   };
+
+   /**
+    * Finds the squared distances between a tile of sample rows and every later sample.
+    *
+    * Only pairs above the diagonal are visited since the distances are symmetric.  The
+    * later samples are visited a tile at a time so both tiles stay in cache while their
+    * distances are computed.  A distance is kept when it falls in the target bin of every
+    * level but the last, and is then either counted in the last level's histogram or
+    * collected so the quantile can be selected without sorting every distance.
+    */
+   struct PairDistanceMap
+   {
+      typedef QPair<int, int> input_type;
+      typedef DistanceHistogram result_type;
+
+      static const int sTileSize = 32;
+
+      const cv::Mat& mSamples;
+      const std::vector<DistanceBins>& mLevels;
+      bool mCollect;
+
+      PairDistanceMap(const cv::Mat& samples, const std::vector<DistanceBins>& levels, bool collect) :
+         mSamples(samples), mLevels(levels), mCollect(collect)
+      {
+      }
+
+      result_type operator()(const input_type& rows)
+      {
+         DistanceHistogram histogram;
+         if (!mCollect)
          {
-            spectrum[j] = mInputMat.at<float>(index, j);
+            histogram.mCounts.assign(DistanceBins::sBins, 0);
          }
-
-         //calculate the euclidian distance between the spectrum this and every other pixel
-         for (unsigned int k = 0; k < size; k++)
+         const int numSamples = mSamples.rows;
+         const unsigned int bands = mSamples.cols;
+         const std::vector<DistanceBins>::size_type parents = mLevels.size() - 1;
+         for (int colStart = rows.first; colStart < numSamples; colStart += sTileSize)
          {
-            double dist = 0.0;
-            for (unsigned int l = 0; l < bands; l++)
+            const int colEnd = std::min(numSamples, colStart + sTileSize);
+            for (int row = rows.first; row < rows.second; ++row)
             {
-               double diff = spectrum[l] - mInputMat.at<float>(k, l);
-               dist += diff * diff;
-            }
-            if (dist > std::numeric_limits<float>::epsilon()) 
-            {
-               pixelDistances.push_back(dist);
+               const float* pRow = mSamples.ptr<float>(row);
+               for (int col = std::max(colStart, row + 1); col < colEnd; ++col)
+               {
+                  double distance = SpectralKernels::squaredDistance(pRow, mSamples.ptr<float>(col), bands);
+                  // identical spectra are not counted as edges
+                  if (distance <= std::numeric_limits<float>::epsilon())
+                  {
+                     continue;
+                  }
+                  std::vector<DistanceBins>::size_type level = 0;
+                  while (level < parents && mLevels[level].getBin(distance) == mLevels[level].mTarget)
+                  {
+                     ++level;
+                  }
+                  if (level < parents)
+                  {
+                     continue;
+                  }
+                  int bin = mLevels[level].getBin(distance);
+                  if (!mCollect)
+                  {
+                     ++histogram.mCounts[bin];
+                  }
+                  else if (bin == mLevels[level].mTarget)
+                  {
+                     histogram.mValues.push_back(static_cast<float>(distance));
+                  }
+               }
             }
          }
-         return pixelDistances;
+         return histogram;
       }
    };
 
-   //write the results to the data accessor after each calculation
-   void distCalcReduce(std::vector<float>& final, 
-      const std::vector<float>& intermediate)
+   void pairDistanceReduce(DistanceHistogram& final, const DistanceHistogram& intermediate)
    {
-      unsigned int size = intermediate.size();
-      for (unsigned int i = 0; i < size; i++)
+      if (final.mCounts.size() < intermediate.mCounts.size())
       {
-
-         final.push_back(intermediate[i]);
+         final.mCounts.resize(intermediate.mCounts.size(), 0);
+      }
+      for (std::vector<quint64>::size_type bin = 0; bin < intermediate.mCounts.size(); ++bin)
+      {
+         final.mCounts[bin] += intermediate.mCounts[bin];
       }
+      final.mValues.insert(final.mValues.end(), intermediate.mValues.begin(), intermediate.mValues.end());
    }
 
    struct BackCalcMap
@@ -163,82 +243,108 @@ namespace
       }
    }
 
+   template<typename T>
+   void copyBandData(T* pPtr, float* pOutput, unsigned int bands)
+   {
+      for (unsigned int band = 0; band < bands; ++band)
+      {
+         pOutput[band] = static_cast<float>(pPtr[band]);
+      }
+   }
+
+   // stores a value in a result element created as either FLT4BYTES or FLT8BYTES
+   void setResult(DataAccessor& resacc, EncodingType resultType, double value)
+   {
+      if (resultType == FLT4BYTES)
+      {
+         *reinterpret_cast<float*>(resacc->getColumn()) = static_cast<float>(value);
+      }
+      else
+      {
+         *reinterpret_cast<double*>(resacc->getColumn()) = value;
+      }
+   }
+
+   // multiplies a value in a result element created as either FLT4BYTES or FLT8BYTES
+   void scaleResult(DataAccessor& resacc, EncodingType resultType, double scale)
+   {
+      if (resultType == FLT4BYTES)
+      {
+         *reinterpret_cast<float*>(resacc->getColumn()) *= static_cast<float>(scale);
+      }
+      else
+      {
+         *reinterpret_cast<double*>(resacc->getColumn()) *= scale;
+      }
+   }
+
+   /**
+    * Finds the background neighbors of a range of the pixels in a row block.
+    *
+    * Each range is searched with one batched query and writes to its own rows of the
+    * neighbor matrices.  The matrices are allocated once for the largest block so no
+    * memory is allocated per pixel.
+    */
    struct TadMap
    {
-      typedef unsigned int input_type;
-      typedef QPair<LocationType, QPair<DataAccessor*, double > > result_type;
-      DataAccessor* mpResAcc;
-      cv::Mat& mInputMat;
-      cv::Mat& mBackground;
+      typedef QPair<int, int> input_type;
+      typedef void result_type;
+
+      // the TAD value sums the distances to the third through fifth nearest neighbors
+      static const int sNeighbors = 5;
+
+      // the number of pixels in each query
+      static const int sQueryPixels = 256;
+
+      const cv::Mat& mPixels;
       cv::flann::Index& mFlannIndex;
-      unsigned int mCols;
-      unsigned int mStartRow;
-      std::vector<LocationType>& mLocations;
-
-      TadMap(cv::Mat& inputMat, cv::flann::Index& flannIndex, cv::Mat& background, 
-         DataAccessor* pResAcc, std::vector<LocationType>& locations, unsigned int nCols,
-         unsigned int startRow) :
-               mInputMat(inputMat),
+      cv::Mat& mIndices;
+      cv::Mat& mDists;
+      int mChecks;
+
+      TadMap(const cv::Mat& pixels, cv::flann::Index& flannIndex, cv::Mat& indices, cv::Mat& dists, int checks) :
+               mPixels(pixels),
                mFlannIndex(flannIndex),
-               mBackground(background),
-               mpResAcc(pResAcc),
-               mLocations(locations),
-               mCols(nCols),
-               mStartRow(startRow)
+               mIndices(indices),
+               mDists(dists),
+               mChecks(checks)
       {
       }
 
-      //Perform the TAD calculation for each pixel in parallel
-      result_type operator()(const input_type& loc)
+      void operator()(const input_type& range)
       {
-         //initialize the variables
-         LocationType location(0, 0);
-         double tadValue = 0.0;
-         if (loc < mLocations.size())
-         {
-            //retrieve the location of the data relative to the output
-            location.mY = mLocations[loc].mY;
-            location.mX = mLocations[loc].mX;
-
-            unsigned int inputMatLoc = (location.mY-mStartRow) * mCols + location.mX;
-            //retrieve the set of bands for the specified pixels
-            cv::Mat vec = mInputMat.row(inputMatLoc);
-            std::vector<float> nnInput(mInputMat.cols);
-            for (unsigned int i = 0; i < static_cast<unsigned int>(mInputMat.cols); i++)
-            {
-               nnInput[i] = static_cast<float>(vec.at<double>(i));
-            }
-
-            std::vector<int> indices(5);
-            std::vector<float> dists(5);
-            mFlannIndex.knnSearch(nnInput, indices, dists, 5, cv::flann::SearchParams(mBackground.cols));
-
-            tadValue = sqrt(dists[2]);
-            tadValue += sqrt(dists[3]);
-            tadValue += sqrt(dists[4]);
-         }
-         return QPair<LocationType, QPair<DataAccessor*, double> >(location, QPair<DataAccessor*, double>(
-            mpResAcc, tadValue));
+         cv::Mat indices = mIndices.rowRange(range.first, range.second);
+         cv::Mat dists = mDists.rowRange(range.first, range.second);
+         mFlannIndex.knnSearch(mPixels.rowRange(range.first, range.second), indices, dists, sNeighbors,
+            cv::flann::SearchParams(mChecks));
       }
    };
 
-   //write the results to the data accessor after each calculation
-   void tadReduce(QPair<LocationType, QPair<DataAccessor*, double> >& final, 
-      const QPair<LocationType, QPair<DataAccessor*, double> >& intermediate)
+   const std::string sModelHeader = "TAD Background Model";
+   const int sIndexTrees = 4;
+
+   // FLANN writes the kd-tree in its own binary format so it is saved next to the model
+   std::string getIndexFilename(const std::string& modelFilename)
    {
-      int row = intermediate.first.mY;
-      int col = intermediate.first.mX;
-      if (intermediate.second.first != NULL)
-      {
-         DataAccessor acc = *intermediate.second.first;
-         if (acc.isValid())
-         {
-            acc->toPixel(row, col);
+      return modelFilename + ".flann";
+   }
 
-            //the data is assumed to be retrieved with a BIP accessor
-            memcpy(acc->getColumn(), &intermediate.second.second, sizeof(double));
-         }
-      }
+   // the model records how its index was built so a stale or foreign index file is never loaded
+   struct IndexStamp
+   {
+      IndexStamp() : mTrees(0), mRows(0), mColumns(0), mFileSize(0) {}
+
+      int mTrees;
+      int mRows;
+      int mColumns;
+      qint64 mFileSize;
+   };
+
+   std::vector<double> getCenterWavelengths(RasterElement& element)
+   {
+      FactoryResource<Wavelengths> pWavelengths;
+      pWavelengths->initializeFromDynamicObject(element.getMetadata(), false);
+      return pWavelengths->getCenterValues();
    }
 }
 
@@ -272,6 +378,13 @@ bool Tad::getInputSpecification(PlugInArgList*& pArgList)
                                     "to be considered different."));
    VERIFY(pArgList->addArg<unsigned int>("Sample Size", 10000,
                                     "The number of samples to use when calculating the background components. "));
+   VERIFY(pArgList->addArg<bool>("Single Precision", false, "If true, the results are stored as 4 byte floats. "
+                                    "The neighbor searches are single precision either way."));
+   VERIFY(pArgList->addArg<Filename>("Background Model Filename", NULL, "Background model saved by an earlier run. "
+                                    "If set, the background is read from this file instead of being characterized "
+                                    "from the data, and the sample size and thresholds are ignored."));
+   VERIFY(pArgList->addArg<Filename>("Save Background Model Filename", NULL, "If set, the background model is "
+                                    "saved to this file so later runs over the same area and sensor can reuse it."));
    return true;
 }
 
@@ -305,6 +418,20 @@ bool Tad::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    pInArgList->getPlugInArgValue("Background Threshold", backgroundThreshold);
    unsigned int sampleSize = 0;
    bool useSubspace = pInArgList->getPlugInArgValue("Sample Size", sampleSize);
+   bool singlePrecision = false;
+   pInArgList->getPlugInArgValue("Single Precision", singlePrecision);
+   std::string modelFilename;
+   Filename* pModelFilename = pInArgList->getPlugInArgValue<Filename>("Background Model Filename");
+   if (pModelFilename != NULL)
+   {
+      modelFilename = pModelFilename->getFullPathAndName();
+   }
+   std::string saveFilename;
+   Filename* pSaveFilename = pInArgList->getPlugInArgValue<Filename>("Save Background Model Filename");
+   if (pSaveFilename != NULL)
+   {
+      saveFilename = pSaveFilename->getFullPathAndName();
+   }
 
    // display options dialog
    if (!isBatch())
@@ -328,6 +455,9 @@ bool Tad::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       }
       dlg.setComponentSize(componentThreshold);
       dlg.setSampleSize(sampleSize);
+      dlg.setSinglePrecision(singlePrecision);
+      dlg.setLoadModelFilename(QString::fromStdString(modelFilename));
+      dlg.setSaveModelFilename(QString::fromStdString(saveFilename));
       if (dlg.exec() == QDialog::Rejected)
       {
          progress.report("Canceled by user", 100, ABORT, true);
@@ -336,6 +466,9 @@ bool Tad::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
       backgroundThreshold = dlg.getPercentBackground();
       componentThreshold = dlg.getComponentSize();
       sampleSize = dlg.getSampleSize();
+      singlePrecision = dlg.isSinglePrecision();
+      modelFilename = dlg.getLoadModelFilename().toStdString();
+      saveFilename = dlg.getSaveModelFilename().toStdString();
       QString aoiId = dlg.getAoi();
       pAoi = aoiId.isEmpty() ? NULL : dynamic_cast<AoiElement*>(
                static_cast<Layer*>(Service<SessionManager>()->getSessionItem(
@@ -367,9 +500,8 @@ bool Tad::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    unsigned int startRow = iter.getRowOffset();
    double resultBackgroundFraction = 0.0;
    double threshold = 0.0;
-   bool bCancel = false;
    
-   if (sampleSize > pixelCount)
+   if (modelFilename.empty() && sampleSize > pixelCount)
    {
       progress.report("Invalid sample size. Cannot select more samples than there are pixels.", 
          0, ERRORS, true);
@@ -378,332 +510,269 @@ bool Tad::execute(PlugInArgList *pInArgList, PlugInArgList *pOutArgList)
    // Calculate values using Topographical Anomaly Detector
    try
    {
-      // generate location index map from the bitmask iterator
-      QMap<int, QList<int> > locationMap;
-      for (; iter != iter.end(); ++iter)
-      {
-         LocationType loc;
-         iter.getPixelLocation(loc);
-         locationMap[loc.mY].push_back(loc.mX);
-      }
-
-      // arrange the location index map by row with a list of columns
-      QList<QPair<int, QList<int> > > locations;
-      foreach(int key, locationMap.keys())
+      cv::Mat backLocationsMat;
+      std::auto_ptr<cv::flann::Index> backFlannIndex;
+      float radius = 0.0;
+      if (!modelFilename.empty())
       {
-         locations.push_back(qMakePair(key, locationMap[key]));
+         //a saved background skips characterizing the background of this scene
+         backFlannIndex.reset(loadBackgroundModel(modelFilename, *pElement, backLocationsMat, radius, threshold,
+            progress));
+         if (backFlannIndex.get() == NULL)
+         {
+            return false;
+         }
       }
-
-      //first populate the samples vector
-      unsigned int radiusSampleSize = sampleSize;
-      if (radiusSampleSize > 2500)
+      else
       {
-         radiusSampleSize = 2500;
-      }
-      progress.report("Generating Radius for background",
-         1, NORMAL);
-      std::auto_ptr<cv::Mat> pLocationsMat(getSampleOfPixels(radiusSampleSize, *pElement, iter));
-      VERIFY(pLocationsMat.get() != NULL);
-
-      //create the index to perform the searches on
-      progress.report("Generating Radius for background",
-         25, NORMAL);
+         //first populate the samples vector
+         unsigned int radiusSampleSize = std::min(sampleSize, sMaxRadiusSamples);
+         progress.report("Generating Radius for background",
+            1, NORMAL);
+         std::auto_ptr<cv::Mat> pLocationsMat(getSampleOfPixels(radiusSampleSize, *pElement, iter));
+         VERIFY(pLocationsMat.get() != NULL);
 
-      //do a search on every pixel in the samples, searching for the distance to every other pixel in the samples
-      float radius = 0.0;
-      progress.report("Generating Radius for background",
-         50, NORMAL);
+         //find the distance between samples that the requested percentage of the edges fall below
+         if (!getBackgroundRadius(*pLocationsMat, backgroundThreshold, radius, progress))
+         {
+            return false;
+         }
+         progress.report("Generating Radius for background",
+            75, NORMAL);
 
-      std::vector<float> pixelDistances;
-      // setup the map-reduce and execute with progress reporting
-      DistCalcMap distMap(*pLocationsMat);
-      QFuture<std::vector<float> > distances;
-      QList<int> inputIndices;
-      for (int i = 0; i < static_cast<int>(radiusSampleSize); i++)
-      {
-         inputIndices.push_back(i);
-      }
-      distances = QtConcurrent::mappedReduced(inputIndices.begin(), inputIndices.end(), distMap, distCalcReduce, 
-         QtConcurrent::UnorderedReduce);
-      bool isCancelling = false;
-      while (distances.isRunning())
-      {
-         if (isCancelling)
+         if (sampleSize != radiusSampleSize)
          {
-            progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
+            //we need to re-get the sample, as it is of a different size from the one used to get the radius
+            pLocationsMat.reset(getSampleOfPixels(sampleSize, *pElement, iter));
+            VERIFY(pLocationsMat.get() != NULL);
+            sampleSize = pLocationsMat->rows;
          }
-         else
+         std::auto_ptr<cv::flann::Index> pFlannIndex(new cv::flann::Index(*pLocationsMat, 
+            cv::flann::KDTreeIndexParams(sIndexTrees)));
+
+         //go through each pixel in the locations vector and determine if it makes up enough of the image
+         //to be considered a background pixel
+         std::vector<unsigned int> validBackgroundIndices;
+         BackCalcMap backMap(*pLocationsMat, *pFlannIndex, componentThreshold, radius);
+         QFuture<std::vector<unsigned int> > backgrounds;
+         QList<int> inputIndices;
+         for (int i = 0; i < static_cast<int>(sampleSize); i++)
+         {
+            inputIndices.push_back(i);
+         }
+         backgrounds = QtConcurrent::mappedReduced(inputIndices.begin(), inputIndices.end(), backMap, backCalcReduce, 
+            QtConcurrent::UnorderedReduce);
+         bool isCancelling = false;
+         while (backgrounds.isRunning())
          {
-            //Handle fringe case of max=min to avoid divide by zero
-            if (distances.progressMinimum() == distances.progressMaximum())
+            if (isCancelling)
             {
-               progress.report("Calculating distances in sample", 0, NORMAL);
+               progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
             }
             else
             {
-               progress.report("Calculating distances in sample",
-                  (distances.progressValue() - distances.progressMinimum()) * 75 /
-                  (distances.progressMaximum() - distances.progressMinimum()), NORMAL);
+               progress.report("Calculating background values",
+                     (backgrounds.progressValue() - backgrounds.progressMinimum()) * 100 /
+                           (backgrounds.progressMaximum() - backgrounds.progressMinimum()), NORMAL);
+               if (isAborted())
+               {
+                  backgrounds.cancel();
+                  isCancelling = true;
+                  setAbortSupported(false);
+               }
             }
-            if (isAborted())
+            QThread::yieldCurrentThread();
+         }
+
+         if (backgrounds.isCanceled())
+         {
+            progress.report("User canceled operation.", 100, ABORT, true);
+            return false;
+         }
+
+         // save the results of the background calculation
+         validBackgroundIndices = backgrounds.result() ;
+         unsigned int backgroundCount = validBackgroundIndices.size();
+         resultBackgroundFraction = static_cast<double>(backgroundCount)/sampleSize;      
+         threshold = resultBackgroundFraction*100.0;
+
+         if (resultBackgroundFraction >= 1.0 || resultBackgroundFraction <= 0.0)
+         {
+            progress.report("Could not distinguish background.", 100, ABORT, true);
+            return false;
+         }
+
+         backLocationsMat.create(backgroundCount, bands, CV_32F);
+         for (unsigned int i = 0; i < backgroundCount; i++)
+         {
+            for (unsigned int j = 0; j < bands; j++)
             {
-               distances.cancel();
-               isCancelling = true;
-               setAbortSupported(false);
+               backLocationsMat.at<float>(i,j) = pLocationsMat->at<float>(validBackgroundIndices[i], j);
             }
          }
-         QThread::yieldCurrentThread();
+         backFlannIndex.reset(new cv::flann::Index(backLocationsMat, cv::flann::KDTreeIndexParams(sIndexTrees)));
       }
-
-      if (distances.isCanceled())
+      if (!saveFilename.empty())
       {
-         progress.report("User canceled operation.", 100, ABORT, true);
-         return false;
+         if (!saveBackgroundModel(saveFilename, *pElement, backLocationsMat, *backFlannIndex, radius, threshold,
+            progress))
+         {
+            progress.report("The background model was not saved to " + saveFilename + " but detection will continue.",
+               0, WARNING, true);
+         }
       }
 
-      // save the results from the distances calculation
-      pixelDistances = distances.result() ;
-      if (pixelDistances.empty())
+      //create the output dataset
+      pResult = ModelResource<RasterElement>(createResults(numRows, numCols, 1, resultsName, 
+         singlePrecision ? FLT4BYTES : FLT8BYTES, pElement));
+      if (pResult.get() == NULL)
       {
-         progress.report("Could not generate pixel distances. Try larger data set.", 0, ERRORS, true);
+         progress.report("Unable to create results.", 0, ERRORS, true);
          return false;
       }
-      progress.report("Generating Radius for background",
-         75, NORMAL);
-
-      std::sort(pixelDistances.begin(), pixelDistances.end());
-      radius = pixelDistances.at(static_cast<unsigned int>(ceil(backgroundThreshold/100.0*pixelDistances.size())));
-
-      if (sampleSize != radiusSampleSize)
+      const RasterDataDescriptor* pResDesc = 
+         static_cast<const RasterDataDescriptor*>(pResult->getDataDescriptor());
+      VERIFY(pResDesc);
+      unsigned int blockSize = 50;
+      unsigned int numRowBlocks = numRows / blockSize;
+      if (numRows%blockSize > 0)
       {
-         //we need to re-get the sample, as it is of a different size from the one used to get the radius
-         pLocationsMat.reset(getSampleOfPixels(sampleSize, *pElement, iter));
-         VERIFY(pLocationsMat.get() != NULL);
-         sampleSize = pLocationsMat->rows;
+         numRowBlocks++;
       }
-      std::auto_ptr<cv::flann::Index> pFlannIndex(new cv::flann::Index(*pLocationsMat, 
-         cv::flann::KDTreeIndexParams(4)));
 
-      //go through each pixel in the locations vector and determine if it makes up enough of the image
-      //to be considered a background pixel
-      std::vector<unsigned int> validBackgroundIndices;
-      BackCalcMap backMap(*pLocationsMat, *pFlannIndex, componentThreshold, radius);
-      QFuture<std::vector<unsigned int> > backgrounds;
-      inputIndices.clear();
-      for (int i = 0; i < static_cast<int>(sampleSize); i++)
+      //the selected pixels of a block are packed in single precision, which is what the kd-tree searches.
+      //the next block is read into the other buffer while the current one is searched, and the search
+      //results are kept in matrices sized for the largest block
+      cv::Mat pixels[2];
+      pixels[0].create(blockSize * numCols, bands, CV_32F);
+      pixels[1].create(blockSize * numCols, bands, CV_32F);
+      std::vector<LocationType> aoiLocations[2];
+      cv::Mat neighborIndices(blockSize * numCols, TadMap::sNeighbors, CV_32S);
+      cv::Mat neighborDists(blockSize * numCols, TadMap::sNeighbors, CV_32F);
+      EncodingType resultType = pResDesc->getDataType();
+      double maxVal = 0.0;
+
+      if (!readRowBlock(*pElement, iter, 0, std::min(blockSize, numRows), pixels[0], aoiLocations[0]))
       {
-         inputIndices.push_back(i);
+         progress.report("Unable to access data.", 0, ERRORS, true);
+         return false;
       }
-      backgrounds = QtConcurrent::mappedReduced(inputIndices.begin(), inputIndices.end(), backMap, backCalcReduce, 
-         QtConcurrent::UnorderedReduce);
-      isCancelling = false;
-      while (backgrounds.isRunning())
+
+      //now loop through each pixel of the actual image, searching for the 5 closest
+      //neighbors and computing the sam distance between them to get a TAD value
+      for (unsigned int rowBlocks = 0; rowBlocks < numRowBlocks; rowBlocks++)
       {
-         if (isCancelling)
+         const int current = rowBlocks % 2;
+         const std::vector<LocationType>& blockLocations = aoiLocations[current];
+         unsigned int localStartRow = rowBlocks * blockSize;
+         unsigned int endRow = std::min(localStartRow + blockSize, numRows);
+
+         //search for the neighbors of the packed pixels in batches
+         const int blockPixels = static_cast<int>(blockLocations.size());
+         QList<QPair<int, int> > queries;
+         for (int first = 0; first < blockPixels; first += TadMap::sQueryPixels)
          {
-            progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
+            queries.push_back(qMakePair(first, std::min(blockPixels, first + TadMap::sQueryPixels)));
          }
-         else
+         TadMap tadMap(pixels[current], *backFlannIndex, neighborIndices, neighborDists, backLocationsMat.cols);
+         QFuture<void> tadResults = QtConcurrent::map(queries, tadMap);
+
+         //the data accessors are not thread safe so the next block is read here while the workers search
+         bool nextBlockRead = true;
+         if (rowBlocks + 1 < numRowBlocks)
          {
-            progress.report("Calculating background values",
-                  (backgrounds.progressValue() - backgrounds.progressMinimum()) * 100 /
-                        (backgrounds.progressMaximum() - backgrounds.progressMinimum()), NORMAL);
-            if (isAborted())
-            {
-               backgrounds.cancel();
-               isCancelling = true;
-               setAbortSupported(false);
-            }
+            nextBlockRead = readRowBlock(*pElement, iter, endRow, std::min(endRow + blockSize, numRows),
+               pixels[1 - current], aoiLocations[1 - current]);
          }
-         QThread::yieldCurrentThread();
-      }
 
-      if (backgrounds.isCanceled())
-      {
-         progress.report("User canceled operation.", 100, ABORT, true);
-         return false;
-      }
-
-      // save the results of the background calculation
-      validBackgroundIndices = backgrounds.result() ;
-      unsigned int backgroundCount = validBackgroundIndices.size();
-      resultBackgroundFraction = static_cast<double>(backgroundCount)/sampleSize;      
-      threshold = resultBackgroundFraction*100.0;
-
-      if (resultBackgroundFraction < 1.0 && resultBackgroundFraction > 0.0)
-      {
-         cv::Mat backLocationsMat(backgroundCount, bands, CV_32F);
-         for (unsigned int i = 0; i < backgroundCount; i++)
+         bool isCancelling = false;
+         float rowBlocksPercent = 100 / numRowBlocks;
+         while (tadResults.isRunning())
          {
-            for (unsigned int j = 0; j < bands; j++)
+            if (isCancelling)
             {
-               backLocationsMat.at<float>(i,j) = pLocationsMat->at<float>(validBackgroundIndices[i], j);
+               progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
+            }
+            else
+            {
+               progress.report("Calculating Topographical Anomaly Detector result",
+                     rowBlocksPercent*rowBlocks + 
+                     (tadResults.progressValue() - tadResults.progressMinimum())*(rowBlocksPercent)/
+                     std::max(1, tadResults.progressMaximum() - tadResults.progressMinimum()), NORMAL);
+               if (isAborted())
+               {
+                  tadResults.cancel();
+                  isCancelling = true;
+                  setAbortSupported(false);
+               }
             }
+            QThread::yieldCurrentThread();
          }
-         std::auto_ptr<cv::flann::Index> backFlannIndex(new cv::flann::Index(backLocationsMat, 
-            cv::flann::KDTreeIndexParams(4)));
-      
-         //create the output dataset
-         pResult = ModelResource<RasterElement>(createResults(numRows, numCols, 1, resultsName, 
-            FLT8BYTES, pElement));
-         if (pResult.get() == NULL)
+         if (tadResults.isCanceled() || isAborted())
          {
-            progress.report("Unable to create results.", 0, ERRORS, true);
+            progress.report("User canceled operation.", 100, ABORT, true);
             return false;
          }
-         const RasterDataDescriptor* pResDesc = 
-            static_cast<const RasterDataDescriptor*>(pResult->getDataDescriptor());
-         VERIFY(pResDesc);
-         unsigned int blockSize = 50;
-         unsigned int numRowBlocks = numRows / blockSize;
-         if (numRows%blockSize > 0)
-         {
-            numRowBlocks++;
-         }
-         int pixelCount = 0;
-
-         // setup write data accessor
-         FactoryResource<DataRequest> pResReq;
-         pResReq->setWritable(true);
-         DataAccessor resacc(pResult->getDataAccessor(pResReq.release()));
-         if (!resacc.isValid())
+         if (!nextBlockRead)
          {
             progress.report("Unable to access data.", 0, ERRORS, true);
             return false;
          }
 
-         //restart the iterator so we can put the values back in the same spot
-         iter.begin();
-
-         //now loop through each pixel of the actual image, searching for the 5 closest
-         //neighbors and computing the sam distance between them to get a TAD value
-         for (unsigned int rowBlocks = 0; rowBlocks < numRowBlocks; rowBlocks++)
+         //write the block, setting pixels outside of the AOI to 0. the distances from the search are squared.
+         FactoryResource<DataRequest> pReq;
+         pReq->setInterleaveFormat(BIP);
+         pReq->setRows(pResDesc->getActiveRow(localStartRow), pResDesc->getActiveRow(endRow - 1));
+         pReq->setWritable(true);
+         DataAccessor blockacc(pResult->getDataAccessor(pReq.release()));
+         VERIFY(blockacc.isValid());
+         std::vector<LocationType>::const_iterator location = blockLocations.begin();
+         for (unsigned int row = localStartRow; row < endRow; row++)
          {
-            std::vector<LocationType> aoiLocations;
-            unsigned int localStartRow = rowBlocks * blockSize;
-            unsigned int endRow = localStartRow + blockSize;
-            if (endRow > numRows)
+            for (unsigned int col = 0; col < numCols; col++)
             {
-               endRow = numRows;
-            }
-
-            //set up the result data accessor
-            DimensionDescriptor rowDesc = pResDesc->getActiveRow(localStartRow);
-            DimensionDescriptor rowDesc2 = pResDesc->getActiveRow(endRow - 1);
-            FactoryResource<DataRequest> pReq;
-            pReq->setInterleaveFormat(BIP);
-            pReq->setRows(rowDesc, rowDesc2);
-            DataAccessor resacc(pResult->getDataAccessor(pReq.release()));
-            VERIFY(resacc.isValid());
-
-            //set up the input data accessor
-            DimensionDescriptor inputRowDesc = pDesc->getActiveRow(localStartRow + startRow);
-            DimensionDescriptor inputRowDesc2 = pDesc->getActiveRow(startRow+endRow - 1);
-            FactoryResource<DataRequest> pInputReq;
-            pInputReq->setInterleaveFormat(BIP);
-            pInputReq->setRows(inputRowDesc, inputRowDesc2);
-            DataAccessor acc(pElement->getDataAccessor(pInputReq.release()));
-            VERIFY(acc.isValid());
-
-            resacc->toPixel(localStartRow, 0);
-            acc->toPixel(localStartRow + startRow, startCol);
-            QList<int> indices;
-            std::vector<double> pixelValues(bands);
-            cv::Mat inputMat(numCols * (endRow - localStartRow), pDesc->getBandCount(), CV_64F);
-            inputMat = cv::Scalar(0);
-            pixelCount = 0;
-            for (unsigned int row = localStartRow; row < endRow; row++)
-            {
-               for (unsigned int col = 0; col < numCols; col++)
-               {
-                  acc->toPixel(startRow + row, startCol + col);
-
-                  //record which indices to put into the multithreaded processing function
-                  if (iter.getPixel(startCol + col, startRow + row))
-                  {
-                     switchOnEncoding(pDesc->getDataType(), readBandData, acc->getColumn(), pixelValues);
-
-                     //store the data in the input matrix with information per band stored as a column to
-                     //each pixels row
-                     for (unsigned int band = 0; band < bands; ++band)
-                     {
-                        inputMat.at<double>((row - localStartRow) * numCols + col, band) = pixelValues[band];
-                     }
-                     indices.push_back(pixelCount);
-                     aoiLocations.push_back(LocationType(col, row));
-                     pixelCount++;
-                  }
-                  else
-                  {
-                     //if not within the AOI, then set the RasterElement value to 0
-                     resacc->toPixel(row, col);
-                     double zero = 0.0;
-                     memcpy(resacc->getColumn(), &zero, sizeof(double));
-                  }
-               }
-               if (bCancel)
+               blockacc->toPixel(row, col);
+               if (location != blockLocations.end() && static_cast<unsigned int>(location->mY) == row &&
+                  static_cast<unsigned int>(location->mX) == col)
                {
-                  progress.report("User canceled operation.", 100, ABORT, true);
-                  return false;
+                  const float* pDists = neighborDists.ptr<float>(static_cast<int>(location - blockLocations.begin()));
+                  double value = sqrt(pDists[2]) + sqrt(pDists[3]) + sqrt(pDists[4]);
+                  maxVal = std::max(maxVal, value);
+                  setResult(blockacc, resultType, value);
+                  ++location;
                }
                else
                {
-                  if (isAborted())
-                  {
-                     bCancel = true;
-                     setAbortSupported(false);
-                  }
+                  setResult(blockacc, resultType, 0.0);
                }
             }
+         }
+      }
 
-            //create structure to calculate TAD on each pixel
-            TadMap tadMap(inputMat, *backFlannIndex, backLocationsMat, &resacc, aoiLocations, numCols, localStartRow);
-            QFuture<QPair<LocationType, QPair<DataAccessor*, double> > > tadResults;
-            tadResults = QtConcurrent::mappedReduced(
-               indices.begin(), indices.end(), tadMap, tadReduce, QtConcurrent::UnorderedReduce);
-            bool isCancelling = false;
-            float rowBlocksPercent = 100 / numRowBlocks;
-            while (tadResults.isRunning())
-            {
-               if (isCancelling)
-               {
-                  progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
-               }
-               else
-               {
-                  progress.report("Calculating Topographical Anomaly Detector result",
-                        rowBlocksPercent*rowBlocks + 
-                        (tadResults.progressValue() - tadResults.progressMinimum())*(rowBlocksPercent)/
-                        (tadResults.progressMaximum() - tadResults.progressMinimum()), NORMAL);
-                  if (isAborted())
-                  {
-                     tadResults.cancel();
-                     isCancelling = true;
-                     setAbortSupported(false);
-                  }
-               }
-               QThread::yieldCurrentThread();
-            }
-            if (tadResults.isCanceled())
-            {
-               progress.report("User canceled operation.", 100, ABORT, true);
-               return false;
-            }
+      //scale by the running maximum through the accessor so results paged from disk are never fully loaded
+      if (maxVal > 0)
+      {
+         progress.report("Normalizing Topographical Anomaly Detector result", 99, NORMAL);
+         FactoryResource<DataRequest> pResReq;
+         pResReq->setInterleaveFormat(BIP);
+         pResReq->setWritable(true);
+         DataAccessor resacc(pResult->getDataAccessor(pResReq.release()));
+         if (!resacc.isValid())
+         {
+            progress.report("Unable to access data.", 0, ERRORS, true);
+            return false;
          }
-         cv::Mat result(numRows, numCols, CV_64F, pResult->getRawData());
-         double minVal = 0.0;
-         double maxVal = 0.0;
-         cv::minMaxLoc(result, &minVal, &maxVal);
-         if (maxVal > 0)
+         for (unsigned int row = 0; row < numRows; row++)
          {
-            result /= maxVal;
+            resacc->toPixel(row, 0);
+            VERIFY(resacc.isValid());
+            for (unsigned int col = 0; col < numCols; col++)
+            {
+               scaleResult(resacc, resultType, 1.0 / maxVal);
+               resacc->nextColumn();
+            }
          }
       }
-      else
-      {
-         progress.report("Could not distinguish background.", 100, ABORT, true);
-         return false;
-      }
    }
    catch (const cv::Exception& exc)
    {
@@ -844,3 +913,339 @@ cv::Mat* Tad::getSampleOfPixels(unsigned int& sampleSize, RasterElement& element
    }
    return pLocationsMat.release();
 }
+
+bool Tad::getBackgroundRadius(const cv::Mat& samples, double percentile, float& radius, ProgressTracker& progress)
+{
+   // no two samples are further apart than twice the furthest sample is from the mean
+   cv::Mat mean;
+   cv::reduce(samples, mean, 0, CV_REDUCE_AVG);
+   double maxDistance = 0.0;
+   for (int row = 0; row < samples.rows; ++row)
+   {
+      maxDistance = std::max(maxDistance,
+         SpectralKernels::squaredDistance(samples.ptr<float>(row), mean.ptr<float>(), samples.cols));
+   }
+   if (maxDistance <= 0.0)
+   {
+      progress.report("Could not generate pixel distances. Try larger data set.", 0, ERRORS, true);
+      return false;
+   }
+
+   QList<QPair<int, int> > tiles;
+   for (int row = 0; row < samples.rows; row += PairDistanceMap::sTileSize)
+   {
+      tiles.push_back(qMakePair(row, std::min(samples.rows, row + PairDistanceMap::sTileSize)));
+   }
+
+   std::vector<DistanceBins> levels(1, DistanceBins(0.0, 4.0 * maxDistance / DistanceBins::sBins));
+   quint64 rank = 0;
+   bool collect = false;
+   for (int pass = 0; ; ++pass)
+   {
+      PairDistanceMap pairMap(samples, levels, collect);
+      QFuture<DistanceHistogram> distances = QtConcurrent::mappedReduced(tiles.begin(), tiles.end(), pairMap,
+         pairDistanceReduce, QtConcurrent::UnorderedReduce);
+      bool isCancelling = false;
+      while (distances.isRunning())
+      {
+         if (isCancelling)
+         {
+            progress.report("Cleaning up processing threads. Please wait.", 99, NORMAL);
+         }
+         else
+         {
+            progress.report("Calculating distances in sample", 1 + (distances.progressValue() -
+               distances.progressMinimum()) * 74 / std::max(1, distances.progressMaximum() -
+               distances.progressMinimum()), NORMAL);
+            if (isAborted())
+            {
+               distances.cancel();
+               isCancelling = true;
+               setAbortSupported(false);
+            }
+         }
+         QThread::yieldCurrentThread();
+      }
+      if (distances.isCanceled())
+      {
+         progress.report("User canceled operation.", 100, ABORT, true);
+         return false;
+      }
+      DistanceHistogram histogram = distances.result();
+
+      if (collect)
+      {
+         VERIFY(rank < histogram.mValues.size());
+         std::vector<float>::iterator selected = histogram.mValues.begin() + static_cast<std::ptrdiff_t>(rank);
+         std::nth_element(histogram.mValues.begin(), selected, histogram.mValues.end());
+         radius = *selected;
+         return true;
+      }
+
+      if (pass == 0)
+      {
+         quint64 total = 0;
+         for (std::vector<quint64>::const_iterator count = histogram.mCounts.begin();
+            count != histogram.mCounts.end(); ++count)
+         {
+            total += *count;
+         }
+         if (total == 0)
+         {
+            progress.report("Could not generate pixel distances. Try larger data set.", 0, ERRORS, true);
+            return false;
+         }
+
+         // this is the index the percentile had in the sorted list of both orderings of every pair,
+         // which holds each distance twice
+         quint64 index = static_cast<quint64>(ceil(percentile / 100.0 * 2 * total));
+         rank = std::min(index, 2 * total - 1) / 2;
+      }
+
+      // find the bin holding the distance and its rank within the bin
+      int bin = 0;
+      while (histogram.mCounts[bin] <= rank)
+      {
+         rank -= histogram.mCounts[bin];
+         ++bin;
+      }
+      DistanceBins level = levels.back();
+      levels.back().mTarget = bin;
+      if (histogram.mCounts[bin] <= sMaxCollectedDistances)
+      {
+         collect = true;
+      }
+      else if (levels.size() < sMaxDistanceLevels)
+      {
+         levels.push_back(DistanceBins(level.mLow + bin * level.mWidth, level.mWidth / DistanceBins::sBins));
+      }
+      else
+      {
+         // the bin is far narrower than any difference in the radius that matters
+         radius = static_cast<float>(level.mLow + bin * level.mWidth);
+         return true;
+      }
+   }
+}
+
+bool Tad::saveBackgroundModel(const std::string& filename, RasterElement& element, const cv::Mat& background,
+   cv::flann::Index& index, float radius, double threshold, ProgressTracker& progress)
+{
+   // the index is written first so the model can record exactly which index file belongs to it
+   IndexStamp stamp;
+   QString indexFilename = QString::fromStdString(getIndexFilename(filename));
+   QFile::remove(indexFilename);
+   try
+   {
+      index.save(indexFilename.toStdString());
+      stamp.mTrees = sIndexTrees;
+      stamp.mRows = background.rows;
+      stamp.mColumns = background.cols;
+      stamp.mFileSize = QFileInfo(indexFilename).size();
+   }
+   catch (const cv::Exception& exc)
+   {
+      QFile::remove(indexFilename);
+      progress.report("Unable to save the search index of the background model: " + std::string(exc.what()),
+         0, WARNING, true);
+   }
+   if (stamp.mFileSize <= 0)
+   {
+      QFile::remove(indexFilename);
+      stamp = IndexStamp();
+   }
+
+   FileResource pFile(filename.c_str(), "wt");
+   if (pFile.get() == NULL)
+   {
+      QFile::remove(indexFilename);
+      progress.report("Unable to save the background model to " + filename, 0, WARNING, true);
+      return false;
+   }
+
+   // wavelengths are only saved when every band has one
+   std::vector<double> wavelengths = getCenterWavelengths(element);
+   if (wavelengths.size() != static_cast<std::vector<double>::size_type>(background.cols))
+   {
+      wavelengths.clear();
+   }
+
+   bool success = fprintf(pFile, "%s\n", sModelHeader.c_str()) > 0;
+   success = success && fprintf(pFile, "%d\n", background.cols) > 0;
+   success = success && fprintf(pFile, "%d\n", background.rows) > 0;
+   success = success && fprintf(pFile, "%.9g\n", radius) > 0;
+   success = success && fprintf(pFile, "%.15e\n", threshold) > 0;
+   success = success && fprintf(pFile, "%d %d %d %lld\n", stamp.mTrees, stamp.mRows, stamp.mColumns,
+      static_cast<long long>(stamp.mFileSize)) > 0;
+   success = success && fprintf(pFile, "%u\n", static_cast<unsigned int>(wavelengths.size())) > 0;
+   for (std::vector<double>::const_iterator wavelength = wavelengths.begin();
+      success && wavelength != wavelengths.end(); ++wavelength)
+   {
+      success = fprintf(pFile, "%.15g\n", *wavelength) > 0;
+   }
+   for (int row = 0; success && row < background.rows; ++row)
+   {
+      const float* pSpectrum = background.ptr<float>(row);
+      for (int band = 0; success && band < background.cols; ++band)
+      {
+         success = fprintf(pFile, "%.9g ", pSpectrum[band]) > 0;
+      }
+      success = success && fprintf(pFile, "\n") > 0;
+   }
+   success = success && fflush(pFile) == 0 && ferror(pFile) == 0;
+   if (!success)
+   {
+      progress.report("Unable to write the background model to " + filename, 0, WARNING, true);
+      return false;
+   }
+   return true;
+}
+
+cv::flann::Index* Tad::loadBackgroundModel(const std::string& filename, RasterElement& element, cv::Mat& background,
+   float& radius, double& threshold, ProgressTracker& progress)
+{
+   FileResource pFile(filename.c_str(), "rt");
+   if (pFile.get() == NULL)
+   {
+      progress.report("Unable to read the background model from " + filename, 0, ERRORS, true);
+      return NULL;
+   }
+   progress.report("Reading the background model", 1, NORMAL);
+
+   char header[64] = "";
+   unsigned int numBands = 0;
+   unsigned int count = 0;
+   unsigned int numWavelengths = 0;
+   IndexStamp stamp;
+   long long indexFileSize = 0;
+   if (fgets(header, sizeof(header), pFile) == NULL || std::string(header).find(sModelHeader) != 0 ||
+      fscanf(pFile, "%u %u %g %lg %d %d %d %lld %u", &numBands, &count, &radius, &threshold, &stamp.mTrees,
+         &stamp.mRows, &stamp.mColumns, &indexFileSize, &numWavelengths) != 9 || count == 0)
+   {
+      progress.report(filename + " is not a valid TAD background model.", 0, ERRORS, true);
+      return NULL;
+   }
+
+   // the model is only meaningful for data from the same sensor
+   const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(element.getDataDescriptor());
+   VERIFYRV(pDesc != NULL, NULL);
+   if (numBands != pDesc->getBandCount())
+   {
+      progress.report(QString("The background model has %1 bands but the data has %2.")
+         .arg(numBands).arg(pDesc->getBandCount()).toStdString(), 0, ERRORS, true);
+      return NULL;
+   }
+   std::vector<double> modelWavelengths(numWavelengths);
+   for (unsigned int band = 0; band < numWavelengths; ++band)
+   {
+      if (fscanf(pFile, "%lg", &modelWavelengths[band]) != 1)
+      {
+         progress.report(filename + " is not a valid TAD background model.", 0, ERRORS, true);
+         return NULL;
+      }
+   }
+   std::vector<double> wavelengths = getCenterWavelengths(element);
+   if (wavelengths.size() != numBands)
+   {
+      wavelengths.clear();
+   }
+   if (modelWavelengths.empty() != wavelengths.empty())
+   {
+      progress.report("The wavelengths of the background model could not be compared to the data since only one "
+         "of them has wavelengths.", 1, WARNING, true);
+   }
+   else
+   {
+      for (std::vector<double>::size_type band = 0; band < wavelengths.size(); ++band)
+      {
+         double tolerance = 1e-6 * std::max(fabs(wavelengths[band]), fabs(modelWavelengths[band]));
+         if (fabs(wavelengths[band] - modelWavelengths[band]) > tolerance)
+         {
+            progress.report(QString("The wavelength of band %1 of the background model does not match the data.")
+               .arg(band + 1).toStdString(), 0, ERRORS, true);
+            return NULL;
+         }
+      }
+   }
+
+   background.create(count, numBands, CV_32F);
+   for (unsigned int row = 0; row < count; ++row)
+   {
+      float* pSpectrum = background.ptr<float>(row);
+      for (unsigned int band = 0; band < numBands; ++band)
+      {
+         if (fscanf(pFile, "%g", &pSpectrum[band]) != 1)
+         {
+            progress.report(filename + " is not a valid TAD background model.", 0, ERRORS, true);
+            return NULL;
+         }
+      }
+   }
+
+   // the kd-tree is randomized so the saved tree is used when it is available to reproduce the earlier results,
+   // but only when it was built from this background with the current parameters
+   std::string indexFilename = getIndexFilename(filename);
+   QFileInfo indexInfo(QString::fromStdString(indexFilename));
+   if (!indexInfo.exists())
+   {
+      progress.report("The search index saved with the background model was not found so it will be rebuilt.",
+         1, WARNING, true);
+   }
+   else if (stamp.mTrees != sIndexTrees || stamp.mRows != static_cast<int>(count) ||
+      stamp.mColumns != static_cast<int>(numBands) || indexFileSize <= 0 || indexInfo.size() != indexFileSize)
+   {
+      progress.report("The search index saved with the background model does not match the model so it will be "
+         "rebuilt.", 1, WARNING, true);
+   }
+   else
+   {
+      try
+      {
+         return new cv::flann::Index(background, cv::flann::SavedIndexParams(indexFilename));
+      }
+      catch (const cv::Exception&)
+      {
+         progress.report("The search index saved with the background model could not be read so it will be "
+            "rebuilt.", 1, WARNING, true);
+      }
+   }
+   return new cv::flann::Index(background, cv::flann::KDTreeIndexParams(sIndexTrees));
+}
+
+bool Tad::readRowBlock(RasterElement& element, BitMaskIterator& iter, unsigned int startRow, unsigned int endRow,
+   cv::Mat& pixels, std::vector<LocationType>& locations)
+{
+   locations.clear();
+   const RasterDataDescriptor* pDesc = static_cast<const RasterDataDescriptor*>(element.getDataDescriptor());
+   VERIFY(pDesc != NULL);
+   unsigned int bands = pDesc->getBandCount();
+   unsigned int numCols = iter.getNumSelectedColumns();
+   unsigned int rowOffset = iter.getRowOffset();
+   unsigned int colOffset = iter.getColumnOffset();
+
+   FactoryResource<DataRequest> pReq;
+   pReq->setInterleaveFormat(BIP);
+   pReq->setRows(pDesc->getActiveRow(rowOffset + startRow), pDesc->getActiveRow(rowOffset + endRow - 1));
+   DataAccessor acc(element.getDataAccessor(pReq.release()));
+   if (!acc.isValid())
+   {
+      return false;
+   }
+
+   //pack the selected pixels in raster order
+   for (unsigned int row = startRow; row < endRow; row++)
+   {
+      for (unsigned int col = 0; col < numCols; col++)
+      {
+         if (iter.getPixel(colOffset + col, rowOffset + row))
+         {
+            acc->toPixel(rowOffset + row, colOffset + col);
+            VERIFY(acc.isValid());
+            switchOnEncoding(pDesc->getDataType(), copyBandData, acc->getColumn(),
+               pixels.ptr<float>(static_cast<int>(locations.size())), bands);
+            locations.push_back(LocationType(col, row));
+         }
+      }
+   }
+   return true;
+}
@@ -13,11 +13,13 @@
 #include <string.h>
 
 #include "AlgorithmShell.h"
+#include "LocationType.h"
 #include "TypesFile.h"
 
 #include <opencv/cv.h>
 #include <QtCore/QList>
 #include <QtCore/QPair>
+#include <vector>
 
 class RasterElement;
 class ProgressTracker;
@@ -37,6 +39,13 @@ private:
    RasterElement* createResults(int numRows, int numColumns, int numBands, const std::string& sigName, EncodingType eType, 
       RasterElement* pElement);
    cv::Mat* getSampleOfPixels(unsigned int& sampleSize, RasterElement& element, BitMaskIterator& iter);
+   bool readRowBlock(RasterElement& element, BitMaskIterator& iter, unsigned int startRow, unsigned int endRow,
+      cv::Mat& pixels, std::vector<LocationType>& locations);
+   bool getBackgroundRadius(const cv::Mat& samples, double percentile, float& radius, ProgressTracker& progress);
+   bool saveBackgroundModel(const std::string& filename, RasterElement& element, const cv::Mat& background,
+      cv::flann::Index& index, float radius, double threshold, ProgressTracker& progress);
+   cv::flann::Index* loadBackgroundModel(const std::string& filename, RasterElement& element, cv::Mat& background,
+      float& radius, double& threshold, ProgressTracker& progress);
 };
 
 #endif
\ No newline at end of file
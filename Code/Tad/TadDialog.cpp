@@ -8,6 +8,7 @@
  */
 
 #include "AppVerify.h"
+#include "FileBrowser.h"
 #include "TadDialog.h"
 #include <QtCore/QList>
 #include <QtCore/QPair>
@@ -15,6 +16,22 @@
 TadDialog::TadDialog(QWidget* pParent) : QDialog(pParent)
 {
    setupUi(this);
+
+   QString filters = "TAD Background Models (*.tad);;All Files (*)";
+   mpLoadModel = new FileBrowser(this);
+   mpLoadModel->setBrowseExistingFile(true);
+   mpLoadModel->setBrowseCaption("Load Background Model");
+   mpLoadModel->setBrowseFileFilters(filters);
+   mpLoadModel->setToolTip("If set, the background is read from this file instead of being characterized.");
+   mpSaveModel = new FileBrowser(this);
+   mpSaveModel->setBrowseExistingFile(false);
+   mpSaveModel->setBrowseCaption("Save Background Model");
+   mpSaveModel->setBrowseFileFilters(filters);
+   mpSaveModel->setToolTip("If set, the background is saved to this file for use with other scenes.");
+
+   // insert above the single precision check box
+   formLayout->insertRow(4, "Load Background", mpLoadModel);
+   formLayout->insertRow(5, "Save Background", mpSaveModel);
 }
 
 TadDialog::~TadDialog()
@@ -44,6 +61,21 @@ void TadDialog::setSampleSize(unsigned int size)
    mpSampleSize->setValue(size);
 }
 
+void TadDialog::setSinglePrecision(bool enabled)
+{
+   mpSinglePrecision->setChecked(enabled);
+}
+
+void TadDialog::setLoadModelFilename(const QString& filename)
+{
+   mpLoadModel->setFilename(filename);
+}
+
+void TadDialog::setSaveModelFilename(const QString& filename)
+{
+   mpSaveModel->setFilename(filename);
+}
+
 void TadDialog::setAoi(const QString& sessionId)
 {
    int idx = mpAoi->findData(sessionId);
@@ -74,3 +106,18 @@ unsigned int TadDialog::getSampleSize() const
 {
    return mpSampleSize->value();
 }
+
+bool TadDialog::isSinglePrecision() const
+{
+   return mpSinglePrecision->isChecked();
+}
+
+QString TadDialog::getLoadModelFilename() const
+{
+   return mpLoadModel->getFilename();
+}
+
+QString TadDialog::getSaveModelFilename() const
+{
+   return mpSaveModel->getFilename();
+}
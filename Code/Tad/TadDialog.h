@@ -14,6 +14,8 @@
 #include "ui_TadDialog.h"
 #include <QtGui/QDialog>
 
+class FileBrowser;
+
 class TadDialog : public QDialog, private Ui_TadDialog
 {
    Q_OBJECT
@@ -27,11 +29,21 @@ public:
    void setComponentSize(double threshold);
    void setAoi(const QString& sessionId);
    void setSampleSize(unsigned int size);
+   void setSinglePrecision(bool enabled);
+   void setLoadModelFilename(const QString& filename);
+   void setSaveModelFilename(const QString& filename);
 
    double getPercentBackground() const;
    double getComponentSize() const;
    QString getAoi() const;
    unsigned int getSampleSize() const;
+   bool isSinglePrecision() const;
+   QString getLoadModelFilename() const;
+   QString getSaveModelFilename() const;
+
+private:
+   FileBrowser* mpLoadModel;
+   FileBrowser* mpSaveModel;
 };
 
 #endif
\ No newline at end of file
@@ -29,11 +29,13 @@
 #include "PlugInRegistration.h"
 #include "PlugInResource.h"
 #include "ProgressTracker.h"
+#include "PseudocolorMerger.h"
 #include "RasterDataDescriptor.h"
 #include "RasterElement.h"
 #include "RasterUtilities.h"
 #include "Resampler.h"
 #include "Signature.h"
+#include "SpectralKernels.h"
 #include "SpectralUtilities.h"
 #include "SpectralVersion.h"
 #include "Statistics.h"
@@ -44,6 +46,7 @@
 #include "WangBovikErr.h"
 #include "Wavelengths.h"
 
+#include <algorithm>
 #include <limits>
 #include <vector>
 
@@ -277,115 +280,30 @@ bool WangBovikAlgorithm::processAll()
          progress.report(WBIERR004, 0, ERRORS, true);
          return false;
       }
-
-      FactoryResource<DataRequest> pseudoRequest;
-      pseudoRequest->setWritable(true);
-      string failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-      DataAccessor pseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-      if (!pseudoAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      FactoryResource<DataRequest> havRequest;
-      havRequest->setWritable(true);
-      failedDataRequestErrorMessage =
-         SpectralUtilities::getFailedDataRequestErrorMessage(havRequest.get(), pHighestWangBovikValueMatrix.get());
-      DataAccessor highestWangBovikValueAccessor = pHighestWangBovikValueMatrix->getDataAccessor(havRequest.release());
-      if (!highestWangBovikValueAccessor.isValid())
-      {
-         string msg = "Unable to access results.";
-         if (!failedDataRequestErrorMessage.empty())
-         {
-            msg += "\n" + failedDataRequestErrorMessage;
-         }
-
-         progress.report(msg, 0, ERRORS, true);
-         return false;
-      }
-
-      //Lets zero out all the results in case we connect to an existing matrix.
-      float* pPseudoValue = NULL;
-      float* pHighestValue = NULL;
-
-      for (unsigned int row_ctr = 0; row_ctr < numRows; row_ctr++)
-      {
-         for (unsigned int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-         {
-            if (!pseudoAccessor.isValid() || !highestWangBovikValueAccessor.isValid())
-            {
-               progress.report("Unable to access results.", 0, ERRORS, true);
-               return false;
-            }
-
-            pHighestValue = reinterpret_cast<float*>(highestWangBovikValueAccessor->getColumn());
-            pPseudoValue = reinterpret_cast<float*>(pseudoAccessor->getColumn());
-
-            //Initialize the matrices
-            *pPseudoValue = 0.0f;
-            *pHighestValue = 0.0f;
-
-            pseudoAccessor->nextColumn();
-            highestWangBovikValueAccessor->nextColumn();
-         }
-         pseudoAccessor->nextRow();
-         highestWangBovikValueAccessor->nextRow();
-      }
    }
 
-   ModelResource<RasterElement> pResults(reinterpret_cast<RasterElement*>(NULL));
-
-   // Processes each selected signature one at a time and
-   // accumulates results
-   for (sig_index = 0; bSuccess && (sig_index < iSignatureCount) && !mAbortFlag; sig_index++)
+   // Resample every signature up front and group the signatures which cover the same bands so
+   // the pixel statistics are computed once per group and shared by all of its signatures
+   vector<WangBovikSignatureGroup> groups;
+   for (sig_index = 0; sig_index < iSignatureCount && !mAbortFlag; sig_index++)
    {
-      // Get the spectrum
       Signature* pSignature = mInputs.mSignatures[sig_index];
-
-      // Create the results matrix
       sigNames.push_back(pSignature->getName());
-      std::string rname = mInputs.mResultsName;
-      if (iSignatureCount > 1 && !mInputs.mbCreatePseudocolor)
-      {
-         rname += " " + sigNames.back();
-      }
-      else if (iSignatureCount > 1)
-      {
-         rname += "WangBovikTemp";
-      }
 
-      if (mInputs.mbCreatePseudocolor == false || pResults.get() == NULL)
-      {
-         pResults = ModelResource<RasterElement>(createResults(numRows, numColumns, 1, rname));
-      }
-      if (pResults.get() == NULL)
+      vector<double> spectrumValues;
+      vector<int> resampledBands;
+      if (!resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands) ||
+         spectrumValues.empty())
       {
          bSuccess = false;
          break;
       }
 
-      //Send the message to the progress object
-      QString messageSigNumber = QString("Processing Signature %1 of %2 : WBI running on signature %3")
-         .arg(sig_index+1).arg(iSignatureCount).arg(QString::fromStdString(sigNames.back()));
-      string message = messageSigNumber.toStdString();
-
-      vector<double> spectrumValues;
-      vector<int> resampledBands;
-      bSuccess = resampleSpectrum(pSignature, spectrumValues, pWavelengths.get(), resampledBands);
-
       // adjust signature values for the scaling factor
       const Units* pSigUnits = pSignature->getUnits("Reflectance");
-      double scaleFactor = pSigUnits->getScaleFromStandard();
       if (pSigUnits != NULL)
       {
+         double scaleFactor = pSigUnits->getScaleFromStandard();
          for (std::vector<double>::iterator iter = spectrumValues.begin(); iter != spectrumValues.end(); ++iter)
          {
             *iter *= scaleFactor;
@@ -393,158 +311,128 @@ bool WangBovikAlgorithm::processAll()
       }
 
       // Check for limited spectral coverage and warning log
-      if (bSuccess && pWavelengths->hasCenterValues() &&
-         resampledBands.size() != pWavelengths->getCenterValues().size())
+      if (pWavelengths->hasCenterValues() && resampledBands.size() != pWavelengths->getCenterValues().size())
       {
-         QString buf = QString("Warning WangBovikAlg014: The spectrum only provides spectral coverage for %1 of %2 bands.")
-            .arg(resampledBands.size()).arg(pWavelengths->getCenterValues().size());
+         QString buf = QString("Warning WangBovikAlg014: The spectrum %1 only provides spectral coverage for %2 of %3 bands.")
+            .arg(QString::fromStdString(sigNames.back())).arg(resampledBands.size())
+            .arg(pWavelengths->getCenterValues().size());
          progress.report(buf.toStdString(), 0, WARNING, true);
       }
 
-      if (bSuccess)
+      // subtract signature mean from the signature values
+      double sigMean = 0.0;
+      for (vector<double>::const_iterator value = spectrumValues.begin(); value != spectrumValues.end(); ++value)
       {
-         BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
-         RasterElement* pResult = NULL;
+         sigMean += *value;
+      }
+      sigMean /= spectrumValues.size();
+      double sigVariance = 0.0;
+      for (vector<double>::iterator value = spectrumValues.begin(); value != spectrumValues.end(); ++value)
+      {
+         *value -= sigMean;
+         sigVariance += *value * *value;
+      }
+      sigVariance /= spectrumValues.size();
 
-         cv::Mat spectrum(spectrumValues.size(), 1, CV_64F);
-         for (unsigned int i = 0; i < spectrumValues.size(); ++i)
-         {
-            spectrum.at<double>(i, 0) = spectrumValues[i];
-         }
-         cv::Scalar sigMean;
-         cv::Scalar sigStdDev;
-         cv::meanStdDev(spectrum, sigMean, sigStdDev);
-         double sigVariance = sigStdDev[0] * sigStdDev[0];
+      vector<WangBovikSignatureGroup>::size_type group_index = 0;
+      while (group_index < groups.size() && groups[group_index].mResampledBands != resampledBands)
+      {
+         ++group_index;
+      }
+      if (group_index == groups.size())
+      {
+         groups.push_back(WangBovikSignatureGroup());
+         groups.back().mResampledBands = resampledBands;
+      }
+      WangBovikSignatureGroup& group = groups[group_index];
+      group.mSignatureIndices.push_back(sig_index);
+      group.mSpectra.insert(group.mSpectra.end(), spectrumValues.begin(), spectrumValues.end());
+      group.mSpectrumMeans.push_back(sigMean);
+      group.mSpectrumVariances.push_back(sigVariance);
+   }
+   if (!bSuccess)
+   {
+      progress.report(WBIERR002, 0, ERRORS, true);
+      return false;
+   }
 
-         // subtract signature mean from the signature values
-         for (unsigned int i = 0; i < spectrumValues.size(); ++i)
+   // Results are only needed for each signature when they are not merged in to a pseudocolor layer
+   bool bMerged = (iSignatureCount > 1 && mInputs.mbCreatePseudocolor);
+   vector<RasterElement*> resultsMatrices;
+   if (!bMerged)
+   {
+      for (sig_index = 0; sig_index < iSignatureCount; sig_index++)
+      {
+         std::string rname = mInputs.mResultsName;
+         if (iSignatureCount > 1)
          {
-            spectrum.at<double>(i) -= sigMean[0];
+            rname += " " + sigNames[sig_index];
          }
-         WangBovikAlgInput wbiInput(pElement, pResults.get(), spectrum, &mAbortFlag, iterChecker, resampledBands,
-            sigMean[0], sigVariance);
-
-         //Output Structure
-         WangBovikAlgOutput wbiOutput;
 
-         // Reports current Spectrum WBI is running on
-         mta::ProgressObjectReporter reporter(message, getProgress());
-
-         // Initializes all threads
-         mta::MultiThreadedAlgorithm<WangBovikAlgInput, WangBovikAlgOutput, WangBovikThread>
-            mtaWangBovik(mta::getNumRequiredThreads(numRows),
-            wbiInput,
-            wbiOutput,
-            &reporter);
-
-         // Calculates Wang-Bovik Index values for current signature
-         mtaWangBovik.run();
-         if (mAbortFlag)
+         RasterElement* pResults = createResults(numRows, numColumns, 1, rname);
+         if (pResults == NULL)
          {
-            progress.report(WBIABORT000, 0, ABORT, true);
-            mAbortFlag = false;
-            return false;
-         }
-         if (wbiInput.mpResultsMatrix == NULL)
-         {
-            progress.report(WBIERR003, 0, ERRORS, true);
+            for (vector<RasterElement*>::iterator iter = resultsMatrices.begin();
+               iter != resultsMatrices.end(); ++iter)
+            {
+               Service<ModelServices>()->destroyElement(*iter);
+            }
+            progress.report(WBIERR005, 0, ERRORS, true);
             return false;
          }
+         resultsMatrices.push_back(pResults);
+      }
+   }
 
-         if (isInteractive() || mInputs.mbDisplayResults)
-         {
-            if (iSignatureCount > 1 && mInputs.mbCreatePseudocolor)
-            {
-               // Merges results in to one output layer if a Pseudocolor
-               // output layer has been selected
-               FactoryResource<DataRequest> pseudoRequest, currentRequest, highestRequest;
-               pseudoRequest->setWritable(true);
-               string failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(pseudoRequest.get(), pPseudocolorMatrix.get());
-               DataAccessor daPseudoAccessor = pPseudocolorMatrix->getDataAccessor(pseudoRequest.release());
-               if (!daPseudoAccessor.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
+   BitMaskIterator iterChecker(getPixelsToProcess(), pElement);
+   WangBovikAlgInput wbiInput(pElement, resultsMatrices, groups, iSignatureCount, &mAbortFlag, iterChecker,
+      pPseudocolorMatrix.get(), pHighestWangBovikValueMatrix.get(), mInputs.mThreshold);
 
-               DataAccessor daCurrentAccessor = pResults->getDataAccessor(currentRequest.release());
+   //Output Structure
+   WangBovikAlgOutput wbiOutput;
 
-               highestRequest->setWritable(true);
-               failedDataRequestErrorMessage =
-                  SpectralUtilities::getFailedDataRequestErrorMessage(highestRequest.get(), pHighestWangBovikValueMatrix.get());
-               DataAccessor daHighestWangBovikValue = pHighestWangBovikValueMatrix->getDataAccessor(highestRequest.release());
-               if (!daHighestWangBovikValue.isValid())
-               {
-                  string msg = "Unable to access data.";
-                  if (!failedDataRequestErrorMessage.empty())
-                  {
-                     msg += "\n" + failedDataRequestErrorMessage;
-                  }
-
-                  progress.report(msg, 0, ERRORS, true);
-                  return false;
-               }
+   // Reports the signatures WBI is running on
+   string message = QString("WBI running on %1 signatures").arg(iSignatureCount).toStdString();
+   mta::ProgressObjectReporter reporter(message, getProgress());
 
-               float* pPseudoValue = NULL;
-               float* pCurrentValue = NULL;
-               float* pHighestValue = NULL;
-
-               for (unsigned  int row_ctr = 0; row_ctr < numRows; row_ctr++)
-               {
-                  for (unsigned  int col_ctr = 0; col_ctr < numColumns; col_ctr++)
-                  {
-                     if (!daPseudoAccessor.isValid() || !daCurrentAccessor.isValid())
-                     {
-                        progress.report("Unable to access data.", 0, ERRORS, true);
-                        return false;
-                     }
-                     daPseudoAccessor->toPixel(row_ctr, col_ctr);
-                     daCurrentAccessor->toPixel(row_ctr, col_ctr);
-
-                     pPseudoValue = reinterpret_cast<float*>(daPseudoAccessor->getColumn());
-                     pCurrentValue = reinterpret_cast<float*>(daCurrentAccessor->getColumn());
-
-                     daHighestWangBovikValue->toPixel(row_ctr, col_ctr);
-                     pHighestValue = reinterpret_cast<float*>(daHighestWangBovikValue->getColumn());
-
-                     if (*pCurrentValue >= mInputs.mThreshold)
-                     {
-                        if (*pCurrentValue > *pHighestValue)
-                        {
-                           *pPseudoValue = sig_index + 1;
-                           *pHighestValue = *pCurrentValue;
-                        }
-                     }
-                  }
-               }
-            }
-            else
-            {
-               ColorType color;
-               if (sig_index <= static_cast<int>(layerColors.size()))
-               {
-                  color = layerColors[sig_index];
-               }
+   // Initializes all threads
+   mta::MultiThreadedAlgorithm<WangBovikAlgInput, WangBovikAlgOutput, WangBovikThread>
+      mtaWangBovik(mta::getNumRequiredThreads(numRows),
+      wbiInput,
+      wbiOutput,
+      &reporter);
 
-               double dMaxValue = pResults->getStatistics()->getMax();
+   // Calculates Wang-Bovik Index values for all signatures
+   mtaWangBovik.run();
+   if (mAbortFlag)
+   {
+      for (vector<RasterElement*>::iterator iter = resultsMatrices.begin(); iter != resultsMatrices.end(); ++iter)
+      {
+         Service<ModelServices>()->destroyElement(*iter);
+      }
+      progress.report(WBIABORT000, 0, ABORT, true);
+      mAbortFlag = false;
+      return false;
+   }
 
-               // Displays results for current signature
-               displayThresholdResults(pResults.release(), color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
-            }
-         }
-         else
+   for (sig_index = 0; sig_index < static_cast<int>(resultsMatrices.size()); sig_index++)
+   {
+      RasterElement* pResults = resultsMatrices[sig_index];
+      pResults->updateData();
+      if (isInteractive() || mInputs.mbDisplayResults)
+      {
+         ColorType color;
+         if (sig_index <= static_cast<int>(layerColors.size()))
          {
-            pResults.release();
+            color = layerColors[sig_index];
          }
+
+         double dMaxValue = pResults->getStatistics()->getMax();
+
+         // Displays results for current signature
+         displayThresholdResults(pResults, color, UPPER, mInputs.mThreshold, dMaxValue, layerOffset);
       }
-   } //End of Signature Loop Counter
+   }
 
    if (bSuccess && !mAbortFlag)
    {
@@ -571,10 +459,9 @@ bool WangBovikAlgorithm::processAll()
          mpResults = pPseudocolorMatrix.get();
          mpResults->updateData();
       }
-      else if (pResults.get() != NULL)
+      else if (!resultsMatrices.empty())
       {
-         mpResults = pResults.get();
-         mpResults->updateData();
+         mpResults = resultsMatrices.back();
       }
       else
       {
@@ -785,14 +672,11 @@ void WangBovikThread::ComputeWangBovik(const T* pDummyData)
 {
    const double wbiConstant(4.0);         // from Wang, Bovik, "A Universal Image Quality Index",
                                           // IEEE Signal Processing Letters, Vol 9, No. 3, March 2002
-   float* pResultsData = NULL;
    int oldPercentDone = -1;
    const T* pData = NULL;
    const RasterDataDescriptor* pDescriptor = static_cast<const RasterDataDescriptor*>(
       mInput.mpCube->getDataDescriptor());
    unsigned int numCols = pDescriptor->getColumnCount();
-   unsigned int numBands = pDescriptor->getBandCount();
-   unsigned int numRows = (mRowRange.mLast - mRowRange.mFirst + 1);
 
    int numResultsCols = 0;
 
@@ -808,25 +692,36 @@ void WangBovikThread::ComputeWangBovik(const T* pDummyData)
       numResultsCols = mInput.mIterCheck.getNumSelectedColumns();
    }
 
-   if (mInput.mpResultsMatrix == NULL)
+   if (mInput.mResultsMatrices.empty() && mInput.mpPseudocolorMatrix == NULL)
    {
       return;
    }
 
-   const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
-      mInput.mpResultsMatrix->getDataDescriptor());
-
-   // Gets results matrix that was initialized in ProcessAll()
+   // Gets results matrices that were initialized in ProcessAll()
    mRowRange.mFirst = std::max(0, mRowRange.mFirst);
    mRowRange.mLast = std::min(mRowRange.mLast, static_cast<int>(pDescriptor->getRowCount()) - 1);
-   FactoryResource<DataRequest> pResultRequest;
-   pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
-      pResultDescriptor->getActiveRow(mRowRange.mLast));
-   pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
-      pResultDescriptor->getActiveColumn(numResultsCols - 1));
-   pResultRequest->setWritable(true);
-   DataAccessor resultAccessor = mInput.mpResultsMatrix->getDataAccessor(pResultRequest.release());
-   if (!resultAccessor.isValid())
+   vector<DataAccessor> resultAccessors;
+   for (vector<RasterElement*>::const_iterator iter = mInput.mResultsMatrices.begin();
+      iter != mInput.mResultsMatrices.end(); ++iter)
+   {
+      const RasterDataDescriptor* pResultDescriptor = static_cast<const RasterDataDescriptor*>(
+         (*iter)->getDataDescriptor());
+      FactoryResource<DataRequest> pResultRequest;
+      pResultRequest->setRows(pResultDescriptor->getActiveRow(mRowRange.mFirst),
+         pResultDescriptor->getActiveRow(mRowRange.mLast));
+      pResultRequest->setColumns(pResultDescriptor->getActiveColumn(0),
+         pResultDescriptor->getActiveColumn(numResultsCols - 1));
+      pResultRequest->setWritable(true);
+      resultAccessors.push_back((*iter)->getDataAccessor(pResultRequest.release()));
+      if (!resultAccessors.back().isValid())
+      {
+         return;
+      }
+   }
+
+   PseudocolorMerger merger(mInput.mpPseudocolorMatrix, mInput.mpHighestValueMatrix, mRowRange.mFirst,
+      mRowRange.mLast, numResultsCols, 0, mInput.mThreshold, true, 0.0f);
+   if (merger.isEnabled() && !merger.isValid())
    {
       return;
    }
@@ -852,6 +747,19 @@ void WangBovikThread::ComputeWangBovik(const T* pDummyData)
       return;
    }
 
+   // Bands which form one contiguous run are used in place, all others are packed into a
+   // dense buffer in the native data type once per group and reused by every signature
+   vector<bool> contiguousGroups;
+   unsigned int maxGroupBands = 1;
+   for (vector<WangBovikSignatureGroup>::const_iterator group = mInput.mGroups.begin();
+      group != mInput.mGroups.end(); ++group)
+   {
+      contiguousGroups.push_back(SpectralKernels::isContiguous(group->mResampledBands));
+      maxGroupBands = std::max(maxGroupBands, static_cast<unsigned int>(group->mResampledBands.size()));
+   }
+   vector<T> packedBands(maxGroupBands);
+   vector<float> pixelValues(std::max(mInput.mSignatureCount, 1U));
+
    for (int row_index = startRow; row_index <= stopRow; ++row_index)
    {
       int percentDone = mRowRange.computePercent(row_index-rowOffset);
@@ -867,17 +775,11 @@ void WangBovikThread::ComputeWangBovik(const T* pDummyData)
 
       for (int col_index = startColumn; col_index <= stopColumn; ++col_index)
       {
-         VERIFYNRV(resultAccessor.isValid());
          VERIFYNRV(accessor.isValid());
 
-         // Pointer to results data
-         pResultsData = reinterpret_cast<float*>(resultAccessor->getColumn());
-         if (pResultsData == NULL)
-         {
-            return;
-         }
-         *pResultsData = wbiBadValue;
-         if (mInput.mIterCheck.getPixel(col_index, row_index))
+         std::fill(pixelValues.begin(), pixelValues.end(), wbiBadValue);
+         bool selected = mInput.mIterCheck.getPixel(col_index, row_index);
+         if (selected)
          {
             //Pointer to cube/sensor data
             pData = reinterpret_cast<T*>(accessor->getColumn());
@@ -890,50 +792,82 @@ void WangBovikThread::ComputeWangBovik(const T* pDummyData)
             // var_d = variance for the data spectrum
             // var_t = variance for the target spectrum
             // WBI = (4 * covar * mu_d * mu_t) / ((mu_d^2 + mu_t^2) * (var_d + var_t))
-
-            //Calculate mean and variance at current location
-            cv::Mat dataSpectrum(mInput.mResampledBands.size(), 1, CV_64F);
-            for (unsigned int index = 0; index < mInput.mResampledBands.size(); ++index)
-            {
-               int resampledBand = mInput.mResampledBands[index];
-               dataSpectrum.at<double>(index, 0) = unitScale * pData[resampledBand];
-            }
-            cv::Scalar dataMean;
-            cv::Scalar dataStdDev;
-            cv::meanStdDev(dataSpectrum, dataMean, dataStdDev);
-            double dataVariance = dataStdDev[0] * dataStdDev[0];
-            
-            // mean adjust the data spectrum
-            for (unsigned int i = 0; i < mInput.mResampledBands.size(); ++i)
+            for (vector<WangBovikSignatureGroup>::size_type group_index = 0; group_index < mInput.mGroups.size();
+               ++group_index)
             {
-               dataSpectrum.at<double>(i, 0) -= dataMean[0];
-            }
+               const WangBovikSignatureGroup& group = mInput.mGroups[group_index];
+               const unsigned int groupBands = group.mResampledBands.size();
+               if (groupBands == 0)
+               {
+                  continue;
+               }
+               const T* pBands = &packedBands.front();
+               if (contiguousGroups[group_index])
+               {
+                  pBands = pData + group.mResampledBands.front();
+               }
+               else
+               {
+                  SpectralKernels::gatherBands(pData, group.mResampledBands, &packedBands.front());
+               }
 
-            // compute the covariance - both the data and target spectra have been mean adjusted
-            double covariance(0.0);
-            for (unsigned int i = 0; i < mInput.mResampledBands.size(); ++i)
-            {
-               covariance += dataSpectrum.at<double>(i, 0) * mInput.mSpectrum.at<double>(i, 0);
+               //Calculate mean and variance at current location, 16-bit data is summed exactly
+               double dataMean = 0.0;
+               double dataVariance = 0.0;
+               SpectralKernels::meanAndVariance(pBands, groupBands, dataMean, dataVariance);
+               dataMean *= unitScale;
+               dataVariance *= unitScale * unitScale;
+
+               for (vector<unsigned int>::size_type sig = 0; sig < group.mSignatureIndices.size(); ++sig)
+               {
+                  // compute the covariance - the target spectrum has been mean adjusted so the data
+                  // mean drops out and the raw band values can be used directly
+                  double covariance = unitScale * SpectralKernels::dotProduct(pBands,
+                     &group.mSpectra[sig * groupBands], groupBands) / groupBands;
+
+                  // compute the WBI value
+                  double spectrumMean = group.mSpectrumMeans[sig];
+                  double numerator = wbiConstant * covariance * dataMean * spectrumMean;
+                  double denominator = (dataMean * dataMean + spectrumMean * spectrumMean) *
+                     (dataVariance + group.mSpectrumVariances[sig]);
+                  if (abs(denominator) > std::numeric_limits<double>::epsilon())
+                  {
+                     pixelValues[group.mSignatureIndices[sig]] = static_cast<float>(numerator / denominator);
+                  }
+               }
             }
-            covariance /= static_cast<double>(mInput.mResampledBands.size());
+         }
+
+         for (vector<DataAccessor>::size_type sig = 0; sig < resultAccessors.size(); ++sig)
+         {
+            VERIFYNRV(resultAccessors[sig].isValid());
 
-            // compute the WBI value
-            double numerator = wbiConstant * covariance * dataMean[0] * mInput.mSpectrumMean;
-            double denominator = (dataMean[0] * dataMean[0] + mInput.mSpectrumMean * mInput.mSpectrumMean) *
-               (dataVariance + mInput.mSpectrumVariance);
-            if (abs(denominator) > std::numeric_limits<double>::epsilon())
+            // Pointer to results data
+            float* pResultsData = reinterpret_cast<float*>(resultAccessors[sig]->getColumn());
+            if (pResultsData == NULL)
             {
-               *pResultsData = static_cast<float>(numerator / denominator);
+               return;
             }
+            *pResultsData = pixelValues[sig];
+            resultAccessors[sig]->nextColumn();
+         }
+         for (unsigned int sig = 0; sig < mInput.mSignatureCount && merger.isValid(); ++sig)
+         {
+            merger.merge(pixelValues[sig], sig, selected);
          }
 
          //Increment Columns
-         resultAccessor->nextColumn();
          accessor->nextColumn();
+         merger.nextColumn();
       }
 
       //Increment Rows
-      resultAccessor->nextRow();
+      for (vector<DataAccessor>::iterator resultAccessor = resultAccessors.begin();
+         resultAccessor != resultAccessors.end(); ++resultAccessor)
+      {
+         (*resultAccessor)->nextRow();
+      }
       accessor->nextRow();
+      merger.nextRow();
    }
 }
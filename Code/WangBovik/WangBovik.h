@@ -65,32 +65,50 @@ public:
    RasterElement* getResults() const;
 };
 
+/**
+ * Signatures which were resampled to the same set of cube bands.
+ *
+ * The pixel mean, variance and mean adjusted spectrum only depend on the bands so they are
+ * computed once per pixel for each group and shared by all of its signatures.
+ */
+struct WangBovikSignatureGroup
+{
+   std::vector<int> mResampledBands;
+   std::vector<unsigned int> mSignatureIndices;
+   std::vector<double> mSpectra;             // mean subtracted values, one signature after another
+   std::vector<double> mSpectrumMeans;
+   std::vector<double> mSpectrumVariances;
+};
+
 struct WangBovikAlgInput
 {
-   WangBovikAlgInput(const RasterElement* pCube, RasterElement* pResultsMatrix, const cv::Mat& spectrum,
-      const bool* pAbortFlag, const BitMaskIterator& iterCheck, const std::vector<int>& resampledBands,
-      const double& spectrumMean, const double& spectrumVariance) :
+   WangBovikAlgInput(const RasterElement* pCube, const std::vector<RasterElement*>& resultsMatrices,
+      const std::vector<WangBovikSignatureGroup>& groups, unsigned int signatureCount, const bool* pAbortFlag,
+      const BitMaskIterator& iterCheck, RasterElement* pPseudocolorMatrix, RasterElement* pHighestValueMatrix,
+      double threshold) :
       mpCube(pCube),
-      mpResultsMatrix(pResultsMatrix),
-      mSpectrum(spectrum),
+      mResultsMatrices(resultsMatrices),
+      mGroups(groups),
+      mSignatureCount(signatureCount),
       mpAbortFlag(pAbortFlag),
       mIterCheck(iterCheck),
-      mResampledBands(resampledBands),
-      mSpectrumMean(spectrumMean),
-      mSpectrumVariance(spectrumVariance)
+      mpPseudocolorMatrix(pPseudocolorMatrix),
+      mpHighestValueMatrix(pHighestValueMatrix),
+      mThreshold(threshold)
    {}
 
    virtual ~WangBovikAlgInput()
    {}
 
    const RasterElement* mpCube;
-   RasterElement* mpResultsMatrix;
-   const cv::Mat& mSpectrum;                  // mean subtracted values
+   const std::vector<RasterElement*>& mResultsMatrices;   // one per signature, empty when only merging
+   const std::vector<WangBovikSignatureGroup>& mGroups;
+   unsigned int mSignatureCount;
    const bool* mpAbortFlag;
    const BitMaskIterator& mIterCheck;
-   const std::vector<int>& mResampledBands;
-   const double& mSpectrumMean;
-   const double& mSpectrumVariance;
+   RasterElement* mpPseudocolorMatrix;        // NULL unless results are merged in to a pseudocolor layer
+   RasterElement* mpHighestValueMatrix;
+   double mThreshold;
 };
 
 class WangBovikThread : public mta::AlgorithmThread